@@ -0,0 +1,274 @@
+#include "data_loader.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dataset.h"
+#include "include/random.h"
+#include "include/threads.h"
+#include "parse_csv.h"
+
+// One batch being filled by the producer while the caller uses the other
+#define NUM_SLOTS 2
+
+typedef enum { SOURCE_CSV, SOURCE_DATASET } source_t;
+
+typedef enum { SLOT_FREE, SLOT_READY, SLOT_IN_USE } slot_state_t;
+
+typedef struct {
+    matrix_t X;        // batch_size x features, only the first rows are valid
+    matrix_t y;
+    matrix_t batch_X;  // What loader_next hands out, the filled rows of X or a
+    matrix_t batch_y;  // view of the dataset
+    size_t rows;       // 0 marks the end of an epoch
+    slot_state_t state;
+} slot_t;
+
+struct data_loader {
+    source_t source;
+    csv_file_t csv;
+    dataset_t dataset;
+    size_t num_rows;
+    size_t num_features;
+
+    size_t batch_size;
+    bool shuffle;
+    size_t *permutation; // Only used when shuffling, owned by the producer
+    uint64_t rng_state;
+
+    slot_t slots[NUM_SLOTS];
+    size_t next_consumed;  // Slots are filled and consumed in round robin order
+    bool holding;          // The caller has the slot before next_consumed
+    bool stopping;
+    mutex_t lock;
+    cond_t changed;
+    thread_t producer;
+};
+
+// Reads one float from every page of the rows, so the mapped file is faulted
+// in by the producer rather than by the caller
+static void touch_rows(matrix_t rows) {
+    const size_t floats_per_page = 4096 / sizeof(float);
+    volatile float sink = 0;
+    for (size_t r = 0; r < rows.m; r++) {
+        const float *row = matrix_row(rows, r);
+        for (size_t j = 0; j < rows.n; j += floats_per_page) {
+            sink += row[j];
+        }
+    }
+    (void)sink;
+}
+
+// Copies the given rows of the source into a slot. Runs on the producer
+// thread, so reading the rows (page faults on the mapped file included)
+// overlaps with whatever the caller is doing with the other slot. Rows of a
+// dataset in file order are already laid out as a batch, so the slot just
+// points at them.
+static void fill_slot(data_loader_t *loader, slot_t *slot, size_t first, size_t rows) {
+    size_t features = loader->num_features;
+    slot->rows = rows;
+
+    if (loader->source == SOURCE_DATASET && !loader->shuffle) {
+        slot->batch_X = matrix_rows(loader->dataset.X, first, rows);
+        slot->batch_y = matrix_rows(loader->dataset.y, first, rows);
+        touch_rows(slot->batch_X);
+        touch_rows(slot->batch_y);
+        return;
+    }
+
+    for (size_t r = 0; r < rows; r++) {
+        size_t sample = loader->shuffle ? loader->permutation[first + r] : first + r;
+        if (loader->source == SOURCE_DATASET) {
+            memcpy(matrix_row(slot->X, r), matrix_row(loader->dataset.X, sample), features * sizeof(float));
+            slot->y.values[r] = matrix_row(loader->dataset.y, sample)[0];
+        } else {
+            read_csv_row(&loader->csv, sample, matrix_row(slot->X, r), &slot->y.values[r]);
+        }
+    }
+    slot->batch_X = matrix_rows(slot->X, 0, rows);
+    slot->batch_y = matrix_rows(slot->y, 0, rows);
+}
+
+// Waits for the slot to be handed back by the caller. Returns false if the
+// loader is being closed instead.
+static bool wait_for_free_slot(data_loader_t *loader, slot_t *slot) {
+    MUTEX_LOCK(loader->lock);
+    while (slot->state != SLOT_FREE && !loader->stopping) {
+        COND_WAIT(loader->changed, loader->lock);
+    }
+    bool stopping = loader->stopping;
+    MUTEX_UNLOCK(loader->lock);
+    return !stopping;
+}
+
+static void publish_slot(data_loader_t *loader, slot_t *slot) {
+    MUTEX_LOCK(loader->lock);
+    slot->state = SLOT_READY;
+    COND_BROADCAST(loader->changed);
+    MUTEX_UNLOCK(loader->lock);
+}
+
+// Fills slots one epoch after another until the loader is closed. Each epoch
+// ends with an empty slot, so the caller knows where one stops.
+static THREAD_ENTRY producer_main(thread_func_param_t arg) {
+    data_loader_t *loader = (data_loader_t *)arg;
+    size_t next_slot = 0;
+
+    while (true) {
+        if (loader->shuffle) {
+            shuffle_indices(loader->permutation, loader->num_rows, &loader->rng_state);
+        }
+
+        size_t first = 0;
+        size_t rows;
+        do {
+            rows = (loader->num_rows - first < loader->batch_size)
+                ? loader->num_rows - first : loader->batch_size;
+
+            slot_t *slot = &loader->slots[next_slot];
+            if (!wait_for_free_slot(loader, slot)) {
+                return (thread_func_return_t)(uintptr_t)NULL;
+            }
+            fill_slot(loader, slot, first, rows);
+            publish_slot(loader, slot);
+
+            next_slot = (next_slot + 1) % NUM_SLOTS;
+            first += rows;
+        } while (rows > 0);
+    }
+}
+
+// Sets up everything but the source, then starts the producer
+static data_loader_t *start_loader(data_loader_t *loader, size_t batch_size, bool shuffle, uint64_t seed) {
+    assert(batch_size > 0);
+    loader->batch_size = batch_size;
+    loader->shuffle = shuffle;
+    loader->rng_state = seed;
+    loader->permutation = NULL;
+    if (shuffle) {
+        loader->permutation = malloc((loader->num_rows > 0 ? loader->num_rows : 1) * sizeof(size_t));
+        assert(loader->permutation != NULL);
+        for (size_t i = 0; i < loader->num_rows; i++) {
+            loader->permutation[i] = i;
+        }
+    }
+
+    for (size_t i = 0; i < NUM_SLOTS; i++) {
+        loader->slots[i].X = zeroes(batch_size, loader->num_features);
+        loader->slots[i].y = zeroes(batch_size, 1);
+        loader->slots[i].rows = 0;
+        loader->slots[i].state = SLOT_FREE;
+    }
+    loader->next_consumed = 0;
+    loader->holding = false;
+    loader->stopping = false;
+    MUTEX_INIT(loader->lock);
+    COND_INIT(loader->changed);
+
+    THREAD_CREATE(loader->producer, producer_main, loader);
+    return loader;
+}
+
+data_loader_t *loader_open_csv(char* const filename, const char delimiter, size_t output_column,
+                               bool is_header, size_t batch_size, bool shuffle, uint64_t seed) {
+    data_loader_t *loader = calloc(1, sizeof(data_loader_t));
+    assert(loader != NULL);
+    loader->source = SOURCE_CSV;
+    if (!open_csv(filename, delimiter, output_column, is_header, &loader->csv)) {
+        free(loader);
+        return NULL;
+    }
+    loader->num_rows = loader->csv.num_rows;
+    loader->num_features = loader->csv.num_cols - 1;
+    return start_loader(loader, batch_size, shuffle, seed);
+}
+
+data_loader_t *loader_open_dataset(const char *filename, size_t batch_size, bool shuffle, uint64_t seed) {
+    data_loader_t *loader = calloc(1, sizeof(data_loader_t));
+    assert(loader != NULL);
+    loader->source = SOURCE_DATASET;
+    if (!load_dataset(filename, &loader->dataset)) {
+        free(loader);
+        return NULL;
+    }
+    loader->num_rows = loader->dataset.X.m;
+    loader->num_features = loader->dataset.X.n;
+    return start_loader(loader, batch_size, shuffle, seed);
+}
+
+// Must be called with the loader lock held
+static void release_held_slot(data_loader_t *loader) {
+    if (loader->holding) {
+        size_t held = (loader->next_consumed + NUM_SLOTS - 1) % NUM_SLOTS;
+        loader->slots[held].state = SLOT_FREE;
+        loader->holding = false;
+        COND_BROADCAST(loader->changed);
+    }
+}
+
+bool loader_next(data_loader_t *loader, matrix_t *X, matrix_t *y) {
+    MUTEX_LOCK(loader->lock);
+    // The previous batch is done with, let the producer refill it
+    release_held_slot(loader);
+
+    slot_t *slot = &loader->slots[loader->next_consumed];
+    while (slot->state != SLOT_READY) {
+        COND_WAIT(loader->changed, loader->lock);
+    }
+    slot->state = SLOT_IN_USE;
+    loader->next_consumed = (loader->next_consumed + 1) % NUM_SLOTS;
+    loader->holding = true;
+
+    bool end_of_epoch = (slot->rows == 0);
+    if (end_of_epoch) {
+        release_held_slot(loader);
+    }
+    MUTEX_UNLOCK(loader->lock);
+
+    if (end_of_epoch) {
+        return false;
+    }
+    *X = slot->batch_X;
+    *y = slot->batch_y;
+    return true;
+}
+
+size_t loader_num_rows(const data_loader_t *loader) {
+    return loader->num_rows;
+}
+
+size_t loader_num_features(const data_loader_t *loader) {
+    return loader->num_features;
+}
+
+size_t loader_batch_size(const data_loader_t *loader) {
+    return loader->batch_size;
+}
+
+void loader_close(data_loader_t *loader) {
+    MUTEX_LOCK(loader->lock);
+    loader->stopping = true;
+    COND_BROADCAST(loader->changed);
+    MUTEX_UNLOCK(loader->lock);
+
+    void *result;
+    THREAD_JOIN(loader->producer, result);
+    (void)result;
+    THREAD_CLOSE(loader->producer);
+
+    MUTEX_DESTROY(loader->lock);
+    COND_DESTROY(loader->changed);
+    for (size_t i = 0; i < NUM_SLOTS; i++) {
+        free_matrix(loader->slots[i].X);
+        free_matrix(loader->slots[i].y);
+    }
+    free(loader->permutation);
+    if (loader->source == SOURCE_CSV) {
+        close_csv(&loader->csv);
+    } else {
+        close_dataset(&loader->dataset);
+    }
+    free(loader);
+}
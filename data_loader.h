@@ -0,0 +1,30 @@
+#ifndef DATA_LOADER_H
+#define DATA_LOADER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "matrix.h"
+
+// Streams fixed size batches out of a csv or binary dataset (see dataset.h)
+// without materialising the whole dataset. A background thread assembles the
+// next batch into a second buffer while the caller works on the current one.
+typedef struct data_loader data_loader_t;
+
+// shuffle draws a new permutation of the rows every epoch from seed, otherwise
+// rows come out in file order. Both return NULL if the file can't be opened,
+// or for a dataset, if it is malformed.
+data_loader_t *loader_open_csv(char* const filename, const char delimiter, size_t output_column,
+                               bool is_header, size_t batch_size, bool shuffle, uint64_t seed);
+data_loader_t *loader_open_dataset(const char *filename, size_t batch_size, bool shuffle, uint64_t seed);
+
+// Points X and y at the next batch, which stays valid until the next call.
+// The last batch of an epoch can have fewer rows than batch_size. Returns
+// false once the epoch is finished, the call after that starts the next epoch.
+bool loader_next(data_loader_t *loader, matrix_t *X, matrix_t *y);
+
+size_t loader_num_rows(const data_loader_t *loader);
+size_t loader_num_features(const data_loader_t *loader);
+size_t loader_batch_size(const data_loader_t *loader);
+void loader_close(data_loader_t *loader);
+
+#endif
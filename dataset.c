@@ -0,0 +1,124 @@
+#include "dataset.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "parse_csv.h"
+
+bool tensor_in_file(const tensor_descriptor_t *tensor, size_t element_size, size_t file_size) {
+    if (tensor->offset > file_size) {
+        return false;
+    }
+    uint64_t fits = (file_size - tensor->offset) / element_size;
+    return tensor->rows == 0 || tensor->cols <= fits / tensor->rows;
+}
+
+static inline uint64_t align_up(uint64_t offset) {
+    return (offset + DATASET_ALIGNMENT - 1) / DATASET_ALIGNMENT * DATASET_ALIGNMENT;
+}
+
+static bool write_padding(FILE *file, uint64_t from, uint64_t to) {
+    static const char zeroes_buffer[DATASET_ALIGNMENT] = {0};
+    return fwrite(zeroes_buffer, 1, to - from, file) == to - from;
+}
+
+bool csv_to_dataset(char* const csv_filename, const char *dataset_filename,
+                    const char delimiter, size_t output_column, bool is_header) {
+    matrix_t *data = read_csv(csv_filename, delimiter, output_column, is_header);
+    if (data == NULL) {
+        return false;
+    }
+    matrix_t X = data[0];
+    matrix_t y = data[1];
+
+    dataset_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DATASET_MAGIC, sizeof(DATASET_MAGIC));
+    header.version = DATASET_VERSION;
+    header.num_tensors = 2;
+
+    uint64_t offset = align_up(sizeof(header));
+    matrix_t tensors[2] = {X, y};
+    for (size_t i = 0; i < 2; i++) {
+        header.tensors[i].dtype = DTYPE_FLOAT32;
+        header.tensors[i].rows = tensors[i].m;
+        header.tensors[i].cols = tensors[i].n;
+        header.tensors[i].offset = offset;
+        offset = align_up(offset + tensors[i].m * tensors[i].n * sizeof(float));
+    }
+
+    bool success = false;
+    FILE *file = fopen(dataset_filename, "wb");
+    if (file != NULL) {
+        success = fwrite(&header, sizeof(header), 1, file) == 1;
+        uint64_t position = sizeof(header);
+        for (size_t i = 0; i < 2 && success; i++) {
+            size_t count = tensors[i].m * tensors[i].n;
+            success = write_padding(file, position, header.tensors[i].offset);
+            // Without the row padding, the file is dense
+            for (size_t row = 0; row < tensors[i].m && success; row++) {
+                success = fwrite(matrix_row(tensors[i], row), sizeof(float), tensors[i].n, file) == tensors[i].n;
+            }
+            position = header.tensors[i].offset + count * sizeof(float);
+        }
+        success = (fclose(file) == 0) && success;
+    }
+
+    free_matrix(X);
+    free_matrix(y);
+    free(data);
+    return success;
+}
+
+// Unmaps the file, for load_dataset to return
+static bool invalid_dataset(const char *filename, const char *reason, dataset_t *dataset) {
+    fprintf(stderr, "%s: not a valid dataset (%s)\n", filename, reason);
+    close_dataset(dataset);
+    return false;
+}
+
+bool load_dataset(const char *filename, dataset_t *dataset) {
+    if (!map_file(filename, true, &dataset->file)) {
+        perror(filename);
+        return false;
+    }
+
+    if (dataset->file.size < sizeof(dataset_header_t)) {
+        return invalid_dataset(filename, "truncated header", dataset);
+    }
+    const dataset_header_t *header = (const dataset_header_t *)dataset->file.data;
+    if (memcmp(header->magic, DATASET_MAGIC, sizeof(DATASET_MAGIC)) != 0) {
+        return invalid_dataset(filename, "bad magic", dataset);
+    }
+    if (header->version != DATASET_VERSION || header->num_tensors != 2) {
+        return invalid_dataset(filename, "unsupported version", dataset);
+    }
+
+    matrix_t *tensors[2] = {&dataset->X, &dataset->y};
+    for (size_t i = 0; i < 2; i++) {
+        const tensor_descriptor_t *tensor = &header->tensors[i];
+        if (tensor->dtype != DTYPE_FLOAT32 || tensor->offset % DATASET_ALIGNMENT != 0) {
+            return invalid_dataset(filename, "unsupported tensor layout", dataset);
+        }
+        if (!tensor_in_file(tensor, sizeof(float), dataset->file.size)) {
+            return invalid_dataset(filename, "truncated payload", dataset);
+        }
+        tensors[i]->values = (float *)((char *)dataset->file.data + tensor->offset);
+        tensors[i]->m = tensor->rows;
+        tensors[i]->n = tensor->cols;
+        tensors[i]->stride = tensor->cols;
+        tensors[i]->padded = false;
+    }
+    if (dataset->X.m != dataset->y.m || dataset->y.n != 1) {
+        return invalid_dataset(filename, "X and y don't match", dataset);
+    }
+
+    return true;
+}
+
+void close_dataset(dataset_t *dataset) {
+    unmap_file(&dataset->file);
+    dataset->X.values = NULL;
+    dataset->y.values = NULL;
+}
@@ -0,0 +1,63 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "mapped_file.h"
+#include "matrix.h"
+
+// Binary dataset container, meant to be converted to once from a csv and then
+// mapped straight into memory on every load. Layout, all little endian:
+//
+//   dataset_header_t                  magic, version and one descriptor per tensor
+//   zero padding up to 64 bytes
+//   X payload, rows x cols floats     starts on a 64 byte boundary
+//   zero padding up to 64 bytes
+//   y payload, rows x 1 floats        starts on a 64 byte boundary
+
+#define DATASET_MAGIC "NNDATA"
+#define DATASET_VERSION 1
+#define DATASET_ALIGNMENT 64
+
+// Datasets are always float32, model files can also hold half precision weights
+typedef enum { DTYPE_FLOAT32 = 0, DTYPE_FLOAT16 = 1, DTYPE_BFLOAT16 = 2 } dtype_t;
+
+typedef struct {
+    uint32_t dtype;
+    uint32_t reserved;
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t offset; // From the start of the file, a multiple of DATASET_ALIGNMENT
+} tensor_descriptor_t;
+
+// True if the tensor's rows x cols values of element_size bytes lie inside a
+// file of file_size bytes. The fields come from the file, so this is checked
+// without any arithmetic that a crafted file could make wrap around.
+bool tensor_in_file(const tensor_descriptor_t *tensor, size_t element_size, size_t file_size);
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_tensors; // Always 2, X then y
+    tensor_descriptor_t tensors[2];
+} dataset_header_t;
+
+// X and y point straight into the mapped file. They are copy on write, so
+// modifying them (e.g. with normalise) only affects this process.
+typedef struct {
+    matrix_t X;
+    matrix_t y;
+    mapped_file_t file;
+} dataset_t;
+
+// Parses a csv with read_csv and writes it out as a binary dataset.
+// Returns false if the csv can't be read or the output file can't be written.
+bool csv_to_dataset(char* const csv_filename, const char *dataset_filename,
+                    const char delimiter, size_t output_column, bool is_header);
+
+// Maps a binary dataset into memory. Prints why and returns false if the file
+// is missing or malformed.
+bool load_dataset(const char *filename, dataset_t *dataset);
+void close_dataset(dataset_t *dataset);
+
+#endif
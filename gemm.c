@@ -0,0 +1,277 @@
+#include "gemm.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "kernels/kernels.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+// The loop structure follows the usual Goto/BLIS layout:
+//
+//   for each nc wide block of columns of B            (B block lives in L3)
+//     for each kc deep slice of the shared dimension
+//       pack B[kc x nc] into NR wide micro-panels
+//       for each mc tall block of rows of A, in parallel (A block lives in L2)
+//         pack A[mc x kc] into MR tall micro-panels
+//         for each NR wide micro-panel of B              (B micro-panel lives in L1)
+//           for each MR tall micro-panel of A
+//             micro-kernel: C[MR x NR] += A[MR x kc] * B[kc x NR] in registers
+//
+// Packing turns every access in the micro-kernel into a contiguous load, so the
+// inner loop is nothing but one broadcast and two FMAs per row of the tile.
+// The micro-kernel, its MR x NR tile shape and the B packing come from the
+// kernel table of the CPU's instruction set, the loops around them are shared.
+//
+// gemm_fused finishes each tile of C on the last kc slice: the bias is added
+// in registers and the activation runs on the tile right after it is stored,
+// so C is only written once.
+
+#define GEMM_DEFAULT_MC 120
+#define GEMM_DEFAULT_KC 256
+#define GEMM_DEFAULT_NC 4096
+#define GEMM_MAX_NC 8192
+
+gemm_blocking_t gemm_blocking = {GEMM_DEFAULT_MC, GEMM_DEFAULT_KC, GEMM_DEFAULT_NC};
+
+static inline size_t min_size(size_t x, size_t y) {
+    return (x < y) ? x : y;
+}
+
+static inline size_t round_up(size_t x, size_t multiple) {
+    return (x + multiple - 1) / multiple * multiple;
+}
+
+void gemm_set_blocking(size_t l1_size, size_t l2_size, size_t l3_size) {
+    const size_t mr = kernels()->gemm_mr;
+    const size_t nr = kernels()->gemm_nr;
+
+    // A kc x NR micro-panel of B takes up half of L1, the A micro-panel and C
+    // tile get the rest
+    if (l1_size != 0) {
+        size_t kc = (l1_size / 2) / (nr * sizeof(float));
+        gemm_blocking.kc = (kc / 8 * 8 > 0) ? kc / 8 * 8 : 8;
+    }
+    // The packed mc x kc block of A takes up half of L2
+    if (l2_size != 0) {
+        size_t mc = (l2_size / 2) / (gemm_blocking.kc * sizeof(float));
+        gemm_blocking.mc = (mc / mr * mr > 0) ? mc / mr * mr : mr;
+    }
+    // The packed kc x nc block of B takes up half of L3, it is shared by all threads
+    if (l3_size != 0) {
+        size_t nc = (l3_size / 2) / (gemm_blocking.kc * sizeof(float));
+        nc = min_size(nc, GEMM_MAX_NC);
+        gemm_blocking.nc = (nc / nr * nr > 0) ? nc / nr * nr : nr;
+    }
+}
+
+// Packs an mc x kc block of A into MR tall micro-panels. Within a panel the MR
+// values of each column are contiguous. Rows past the edge are zero padded.
+static void pack_a(size_t mr, size_t mc, size_t kc, const float *a, size_t lda, float *packed) {
+    for (size_t ir = 0; ir < mc; ir += mr) {
+        size_t rows = min_size(mr, mc - ir);
+        for (size_t p = 0; p < kc; p++) {
+            size_t r = 0;
+            for (; r < rows; r++) {
+                packed[p * mr + r] = a[(ir + r) * lda + p];
+            }
+            for (; r < mr; r++) {
+                packed[p * mr + r] = 0.0f;
+            }
+        }
+        packed += mr * kc;
+    }
+}
+
+typedef struct {
+    const kernel_table_t *kernels;
+    size_t kc;
+    size_t nc;
+    const float *b;
+    size_t ldb;
+    float *packed;
+} pack_b_args_t;
+
+// Packs NR wide micro-panels [start, end) of a kc x nc block of B. Within a
+// panel the NR values of each row are contiguous. Columns past the edge are
+// zero padded.
+static void pack_b(void *context, size_t start, size_t end) {
+    pack_b_args_t *args = (pack_b_args_t *)context;
+    size_t nr = args->kernels->gemm_nr;
+
+    for (size_t panel = start; panel < end; panel++) {
+        size_t jr = panel * nr;
+        args->kernels->gemm_pack_b(args->kc, min_size(nr, args->nc - jr), args->b + jr, args->ldb,
+                                   args->packed + jr * args->kc);
+    }
+}
+
+typedef struct {
+    const kernel_table_t *kernels;
+    size_t m;
+    size_t mc;      // Rows of A packed per task
+    size_t kc;
+    size_t nc;
+    const float *a; // Points at the first column of the current kc slice
+    size_t lda;
+    const float *packed_b;
+    float *c;       // Points at the first column of the current nc block
+    size_t ldc;
+    bool accumulate;
+    const gemm_epilogue_t *epilogue; // Only set for the last kc slice
+    const float *bias;               // Offset to the current nc block
+    size_t num_col_groups;
+    size_t col_group_width;
+} macro_args_t;
+
+// Each task is one mc tall block of rows of C, restricted to one group of
+// columns. Columns are only split up when there aren't enough row blocks to
+// keep every thread busy, which is the case for small batches.
+static void macro_kernel(void *context, size_t start, size_t end) {
+    macro_args_t *args = (macro_args_t *)context;
+    const kernel_table_t *k = args->kernels;
+    size_t mr = k->gemm_mr;
+    size_t nr = k->gemm_nr;
+    size_t mc_max = args->mc;
+    float *packed_a = thread_scratch(SCRATCH_GEMM_A, round_up(mc_max, mr) * args->kc * sizeof(float));
+
+    for (size_t task = start; task < end; task++) {
+        size_t ic = (task / args->num_col_groups) * mc_max;
+        size_t group = task % args->num_col_groups;
+        size_t mc = min_size(mc_max, args->m - ic);
+        size_t j_start = group * args->col_group_width;
+        size_t j_end = min_size(j_start + args->col_group_width, args->nc);
+
+        pack_a(mr, mc, args->kc, args->a + ic * args->lda, args->lda, packed_a);
+
+        for (size_t jr = j_start; jr < j_end; jr += nr) {
+            size_t cols = min_size(nr, j_end - jr);
+            const float *b_panel = args->packed_b + jr * args->kc;
+
+            const float *bias = (args->bias != NULL) ? args->bias + jr : NULL;
+
+            for (size_t ir = 0; ir < mc; ir += mr) {
+                size_t rows = min_size(mr, mc - ir);
+                const float *a_panel = packed_a + ir * args->kc;
+                float *c_tile = args->c + (ic + ir) * args->ldc + jr;
+
+                if (rows == mr && cols == nr) {
+                    k->gemm_micro_kernel(args->kc, a_panel, b_panel, c_tile, args->ldc, args->accumulate, bias);
+                } else {
+                    k->gemm_edge_kernel(args->kc, a_panel, b_panel, c_tile, args->ldc,
+                                        args->accumulate, bias, rows, cols);
+                }
+
+                // The tile was just written, so it is still in L1
+                if (args->epilogue != NULL && args->epilogue->activation != NULL) {
+                    for (size_t i = 0; i < rows; i++) {
+                        float *row = c_tile + i * args->ldc;
+                        args->epilogue->activation(row, row, cols);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void gemm(size_t m, size_t n, size_t k,
+          const float *a, size_t lda,
+          const float *b, size_t ldb,
+          float *c, size_t ldc) {
+    gemm_fused(m, n, k, a, lda, b, ldb, c, ldc, NULL, NULL);
+}
+
+void gemm_fused(size_t m, size_t n, size_t k,
+                const float *a, size_t lda,
+                const float *b, size_t ldb,
+                float *c, size_t ldc,
+                const gemm_epilogue_t *epilogue,
+                const gemm_blocking_t *blocking) {
+    if (m == 0 || n == 0) {
+        return;
+    }
+    if (k == 0) {
+        for (size_t i = 0; i < m; i++) {
+            float *row = c + i * ldc;
+            if (epilogue != NULL && epilogue->bias != NULL) {
+                memcpy(row, epilogue->bias, n * sizeof(float));
+            } else {
+                memset(row, 0, n * sizeof(float));
+            }
+            if (epilogue != NULL && epilogue->activation != NULL) {
+                epilogue->activation(row, row, n);
+            }
+        }
+        return;
+    }
+
+    if (blocking == NULL) {
+        blocking = &gemm_blocking;
+    }
+    double trace_start_time = trace_begin();
+    const kernel_table_t *kernel = kernels();
+    size_t nr = kernel->gemm_nr;
+    size_t mc_max = blocking->mc;
+    size_t kc_max = blocking->kc;
+    size_t nc_max = min_size(blocking->nc, GEMM_MAX_NC);
+    size_t num_threads = thread_pool_size();
+    size_t num_row_blocks = (m + mc_max - 1) / mc_max;
+
+    float *packed_b = thread_scratch(SCRATCH_GEMM_B, kc_max * round_up(nc_max, nr) * sizeof(float));
+
+    for (size_t jc = 0; jc < n; jc += nc_max) {
+        size_t nc = min_size(nc_max, n - jc);
+        size_t num_panels = (nc + nr - 1) / nr;
+
+        // Split the columns into enough groups that there is a task per thread
+        size_t num_col_groups = 1;
+        if (num_row_blocks < num_threads) {
+            num_col_groups = min_size((num_threads + num_row_blocks - 1) / num_row_blocks, num_panels);
+        }
+        size_t col_group_width = (num_panels + num_col_groups - 1) / num_col_groups * nr;
+        num_col_groups = (nc + col_group_width - 1) / col_group_width;
+
+        for (size_t pc = 0; pc < k; pc += kc_max) {
+            size_t kc = min_size(kc_max, k - pc);
+
+            pack_b_args_t pack_args;
+            pack_args.kernels = kernel;
+            pack_args.kc = kc;
+            pack_args.nc = nc;
+            pack_args.b = b + pc * ldb + jc;
+            pack_args.ldb = ldb;
+            pack_args.packed = packed_b;
+            parallel_for(num_panels, 0, pack_b, &pack_args);
+
+            macro_args_t args;
+            args.kernels = kernel;
+            args.m = m;
+            args.mc = mc_max;
+            args.kc = kc;
+            args.nc = nc;
+            args.a = a + pc;
+            args.lda = lda;
+            args.packed_b = packed_b;
+            args.c = c + jc;
+            args.ldc = ldc;
+            args.accumulate = (pc != 0);
+            bool last_slice = (pc + kc == k);
+            args.epilogue = last_slice ? epilogue : NULL;
+            args.bias = (last_slice && epilogue != NULL && epilogue->bias != NULL) ? epilogue->bias + jc : NULL;
+            args.num_col_groups = num_col_groups;
+            args.col_group_width = col_group_width;
+            parallel_for(num_row_blocks * num_col_groups, 1, macro_kernel, &args);
+        }
+    }
+
+    trace_end(trace_start_time, "gemm", gemm_trace_name(epilogue),
+              (trace_args_t){.m = m, .k = k, .n = n, .bytes = (m * k + k * n + m * n) * sizeof(float)});
+}
+
+const char *gemm_trace_name(const gemm_epilogue_t *epilogue) {
+    if (epilogue == NULL || epilogue->bias == NULL) {
+        return (epilogue != NULL && epilogue->activation != NULL) ? "gemm+activation" : "gemm";
+    }
+    return (epilogue->activation != NULL) ? "gemm+bias+activation" : "gemm+bias";
+}
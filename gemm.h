@@ -0,0 +1,50 @@
+#ifndef GEMM_H
+#define GEMM_H
+
+#include <stdlib.h>
+
+// Cache blocking parameters, see gemm.c for how each one is used
+typedef struct {
+    size_t mc; // Rows of A packed at once, sized for L2
+    size_t kc; // Depth of the packed panels, sized for L1
+    size_t nc; // Columns of B packed at once, sized for L3
+} gemm_blocking_t;
+
+// Defaults used when no blocking is passed in, set up by gemm_set_blocking
+extern gemm_blocking_t gemm_blocking;
+
+// Derives the blocking parameters from the cache sizes in bytes, for the
+// register tile of the kernels in use (see kernels/kernels.h).
+// A size of 0 means the level is unknown, and keeps the default for it.
+void gemm_set_blocking(size_t l1_size, size_t l2_size, size_t l3_size);
+
+// Work applied to each tile of C once its last slice has been accumulated,
+// while the tile is still in registers (bias) or in L1 (activation)
+typedef struct {
+    const float *bias; // n values added to every row of C, or NULL
+    // Applied to each finished row segment of C, or NULL. Called in place,
+    // with dst == src.
+    void (*activation)(float *dst, const float *src, size_t n);
+} gemm_epilogue_t;
+
+// C = A * B, where A is m x k, B is k x n and C is m x n, all row-major.
+// lda, ldb and ldc are the distances (in floats) between consecutive rows.
+void gemm(size_t m, size_t n, size_t k,
+          const float *a, size_t lda,
+          const float *b, size_t ldb,
+          float *c, size_t ldc);
+
+// C = activation(A * B + bias), in a single pass over C. epilogue may be
+// NULL for a plain product, and blocking NULL for the gemm_blocking defaults.
+void gemm_fused(size_t m, size_t n, size_t k,
+                const float *a, size_t lda,
+                const float *b, size_t ldb,
+                float *c, size_t ldc,
+                const gemm_epilogue_t *epilogue,
+                const gemm_blocking_t *blocking);
+
+// What a product with this epilogue is called in traces, "gemm" followed by
+// "+bias" and "+activation" for the parts of the epilogue it has
+const char *gemm_trace_name(const gemm_epilogue_t *epilogue);
+
+#endif
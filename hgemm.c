@@ -0,0 +1,204 @@
+#include "hgemm.h"
+
+#include <immintrin.h>
+#include <string.h>
+
+#include "thread_pool.h"
+#include "trace.h"
+
+// B is read straight from its row-major storage, there is no packing step.
+// With the small batches this is meant for, every weight is used by at most a
+// few rows of A, so packing would cost as much as the product itself. Each
+// micro-kernel call walks down one HGEMM_NR wide strip of B, widening 16
+// halves per row of the strip (one vcvtph2ps, or a zero extend and shift for
+// bf16), and multiplies them into HGEMM_MR rows of A. Tasks take strips in
+// order, so consecutive row tiles of a strip find it in L1/L2.
+//
+// The last strip is copied into a zero padded buffer when n isn't a multiple
+// of HGEMM_NR, so the micro-kernel never reads past the end of a row.
+
+static inline size_t round_up(size_t x, size_t multiple) {
+    return (x + multiple - 1) / multiple * multiple;
+}
+
+static inline uint16_t float_to_bfloat16(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000) {
+        return (uint16_t)((bits >> 16) | 0x40); // Keep NaNs quiet
+    }
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return (uint16_t)(bits >> 16);
+}
+
+void floats_to_half(const float *src, uint16_t *dst, size_t count, half_format_t format) {
+    size_t i = 0;
+    if (format == HALF_FLOAT16) {
+        for (; i + 8 <= count; i += 8) {
+            __m128i half = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+            _mm_storeu_si128((__m128i *)(dst + i), half);
+        }
+        for (; i < count; i++) {
+            dst[i] = _cvtss_sh(src[i], _MM_FROUND_TO_NEAREST_INT);
+        }
+    } else {
+        for (; i < count; i++) {
+            dst[i] = float_to_bfloat16(src[i]);
+        }
+    }
+}
+
+void half_to_floats(const uint16_t *src, float *dst, size_t count, half_format_t format) {
+    for (size_t i = 0; i < count; i++) {
+        if (format == HALF_FLOAT16) {
+            dst[i] = _cvtsh_ss(src[i]);
+        } else {
+            uint32_t bits = (uint32_t)src[i] << 16;
+            memcpy(&dst[i], &bits, sizeof(bits));
+        }
+    }
+}
+
+static inline __m256 widen(const uint16_t *half, half_format_t format) {
+    __m128i packed = _mm_loadu_si128((const __m128i *)half);
+    if (format == HALF_FLOAT16) {
+        return _mm256_cvtph_ps(packed);
+    }
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(packed), 16));
+}
+
+// Computes rows x HGEMM_NR of A * B into tile. a holds the start of each row
+// of the tile, b the top of the strip of B. Always inlined with constant rows
+// and format, so the accumulators stay in registers and a batch of one row
+// doesn't pay for HGEMM_MR.
+static inline void micro_kernel(size_t rows, size_t k, const float *a[HGEMM_MR], const uint16_t *b,
+                                size_t ldb, half_format_t format, float tile[HGEMM_MR * HGEMM_NR]) {
+    __m256 acc[HGEMM_MR][2];
+    for (size_t r = 0; r < rows; r++) {
+        acc[r][0] = _mm256_setzero_ps();
+        acc[r][1] = _mm256_setzero_ps();
+    }
+
+    for (size_t p = 0; p < k; p++) {
+        __m256 b0 = widen(b + p * ldb, format);
+        __m256 b1 = widen(b + p * ldb + 8, format);
+        for (size_t r = 0; r < rows; r++) {
+            __m256 a_broadcast = _mm256_broadcast_ss(a[r] + p);
+            acc[r][0] = _mm256_fmadd_ps(a_broadcast, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(a_broadcast, b1, acc[r][1]);
+        }
+    }
+
+    for (size_t r = 0; r < rows; r++) {
+        _mm256_storeu_ps(tile + r * HGEMM_NR, acc[r][0]);
+        _mm256_storeu_ps(tile + r * HGEMM_NR + 8, acc[r][1]);
+    }
+}
+
+// Picks the micro-kernel for the number of rows left in the tile
+static inline void tile_kernel(size_t rows, size_t k, const float *a[HGEMM_MR], const uint16_t *b,
+                               size_t ldb, half_format_t format, float tile[HGEMM_MR * HGEMM_NR]) {
+    switch (rows) {
+        case 1: micro_kernel(1, k, a, b, ldb, format, tile); break;
+        case 2: micro_kernel(2, k, a, b, ldb, format, tile); break;
+        case 3: micro_kernel(3, k, a, b, ldb, format, tile); break;
+        case 4: micro_kernel(4, k, a, b, ldb, format, tile); break;
+        case 5: micro_kernel(5, k, a, b, ldb, format, tile); break;
+        default: micro_kernel(HGEMM_MR, k, a, b, ldb, format, tile); break;
+    }
+}
+
+typedef struct {
+    size_t m, n, k;
+    const float *a;
+    size_t lda;
+    const uint16_t *b;
+    size_t ldb;
+    half_format_t format;
+    float *c;
+    size_t ldc;
+    const gemm_epilogue_t *epilogue;
+    size_t num_row_tiles;
+} hgemm_args_t;
+
+// Tasks are numbered row tile first, so consecutive tasks share a strip of B
+static void run_tiles(void *context, size_t start, size_t end) {
+    hgemm_args_t *args = (hgemm_args_t *)context;
+    float tile[HGEMM_MR * HGEMM_NR];
+    size_t padded_strip = (size_t)-1; // Column of the strip in the padded buffer
+    uint16_t *padded = NULL;
+
+    for (size_t task = start; task < end; task++) {
+        size_t i = (task % args->num_row_tiles) * HGEMM_MR;
+        size_t j = (task / args->num_row_tiles) * HGEMM_NR;
+        size_t rows = (args->m - i < HGEMM_MR) ? args->m - i : HGEMM_MR;
+        size_t cols = (args->n - j < HGEMM_NR) ? args->n - j : HGEMM_NR;
+
+        const uint16_t *strip = args->b + j;
+        size_t ldb = args->ldb;
+        if (cols < HGEMM_NR) {
+            if (padded_strip != j) {
+                padded = thread_scratch(SCRATCH_HGEMM_B, args->k * HGEMM_NR * sizeof(uint16_t));
+                for (size_t p = 0; p < args->k; p++) {
+                    memset(padded + p * HGEMM_NR, 0, HGEMM_NR * sizeof(uint16_t));
+                    memcpy(padded + p * HGEMM_NR, strip + p * ldb, cols * sizeof(uint16_t));
+                }
+                padded_strip = j;
+            }
+            strip = padded;
+            ldb = HGEMM_NR;
+        }
+
+        const float *a[HGEMM_MR];
+        for (size_t r = 0; r < rows; r++) {
+            a[r] = args->a + (i + r) * args->lda;
+        }
+        if (args->format == HALF_FLOAT16) {
+            tile_kernel(rows, args->k, a, strip, ldb, HALF_FLOAT16, tile);
+        } else {
+            tile_kernel(rows, args->k, a, strip, ldb, HALF_BFLOAT16, tile);
+        }
+
+        const float *bias = (args->epilogue != NULL) ? args->epilogue->bias : NULL;
+        for (size_t r = 0; r < rows; r++) {
+            float *row = args->c + (i + r) * args->ldc + j;
+            for (size_t col = 0; col < cols; col++) {
+                row[col] = tile[r * HGEMM_NR + col] + ((bias != NULL) ? bias[j + col] : 0.0f);
+            }
+            if (args->epilogue != NULL && args->epilogue->activation != NULL) {
+                args->epilogue->activation(row, row, cols);
+            }
+        }
+    }
+}
+
+void hgemm_fused(size_t m, size_t n, size_t k,
+                 const float *a, size_t lda,
+                 const uint16_t *b, size_t ldb, half_format_t format,
+                 float *c, size_t ldc,
+                 const gemm_epilogue_t *epilogue) {
+    if (m == 0 || n == 0) {
+        return;
+    }
+    double trace_start_time = trace_begin();
+    hgemm_args_t args;
+    args.m = m;
+    args.n = n;
+    args.k = k;
+    args.a = a;
+    args.lda = lda;
+    args.b = b;
+    args.ldb = ldb;
+    args.format = format;
+    args.c = c;
+    args.ldc = ldc;
+    args.epilogue = epilogue;
+    args.num_row_tiles = (m + HGEMM_MR - 1) / HGEMM_MR;
+    size_t num_strips = round_up(n, HGEMM_NR) / HGEMM_NR;
+
+    parallel_for(args.num_row_tiles * num_strips, 0, run_tiles, &args);
+
+    trace_end(trace_start_time, "hgemm", gemm_trace_name(epilogue),
+              (trace_args_t){.m = m, .k = k, .n = n,
+                             .bytes = (m * k + m * n) * sizeof(float) + k * n * sizeof(uint16_t)});
+}
@@ -0,0 +1,36 @@
+#ifndef HGEMM_H
+#define HGEMM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "gemm.h"
+
+// Matrix multiplication with half precision weights, for inference when the
+// batch is small and streaming the weights is the bottleneck. B is stored as
+// fp16 or bf16 and widened to fp32 in registers, A, C and the accumulation
+// stay fp32. Needs AVX2, FMA and F16C.
+
+// Shape of the register tile computed by the micro-kernel
+#define HGEMM_MR 6
+#define HGEMM_NR 16
+
+typedef enum {
+    HALF_FLOAT16,  // IEEE binary16, 11 bit significand, range +-65504
+    HALF_BFLOAT16  // Top half of a float, 8 bit significand, full float range
+} half_format_t;
+
+// Rounds count floats to the nearest half (ties to even)
+void floats_to_half(const float *src, uint16_t *dst, size_t count, half_format_t format);
+void half_to_floats(const uint16_t *src, float *dst, size_t count, half_format_t format);
+
+// C = activation(A * B + bias), where A is m x k floats, B is k x n halves
+// and C is m x n floats, all row-major with rows lda, ldb and ldc elements
+// apart. epilogue may be NULL for a plain product.
+void hgemm_fused(size_t m, size_t n, size_t k,
+                 const float *a, size_t lda,
+                 const uint16_t *b, size_t ldb, half_format_t format,
+                 float *c, size_t ldc,
+                 const gemm_epilogue_t *epilogue);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Small, seedable generator so shuffles don't depend on the global rand()
+static inline uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Fisher-Yates shuffle of n indices
+static inline void shuffle_indices(size_t *indices, size_t n, uint64_t *state) {
+    for (size_t i = n; i > 1; i--) {
+        size_t j = splitmix64(state) % i;
+        size_t temp = indices[i - 1];
+        indices[i - 1] = indices[j];
+        indices[j] = temp;
+    }
+}
+
+#endif // RANDOM_H
@@ -0,0 +1,143 @@
+#ifndef SIMD_MATH_H
+#define SIMD_MATH_H
+
+#include "vec.h"
+
+// Vectorised float32 exp, log, tanh and sigmoid, VEC_WIDTH lanes at a time, on
+// the vec_t of include/vec.h. Errors are the largest seen against double
+// precision libm over every float input with a normal float result, in units
+// in the last place of the result:
+//
+//                AVX-512 -Ofast   AVX2 -Ofast   AVX2 -O2   SSE2 -Ofast
+//   vec_exp      1.3 ulp          1.3 ulp       1.3 ulp    1.3 ulp
+//   vec_log      0.9 ulp          0.9 ulp       0.9 ulp    0.9 ulp    (normal positive inputs only)
+//   vec_tanh     1.4 ulp          2.2 ulp       1.4 ulp    2.2 ulp
+//   vec_sigmoid  3.2 ulp          4.5 ulp       3.2 ulp    4.5 ulp
+//
+// SSE2 has no FMA, so every multiply-add there rounds twice. The AVX-512 build
+// needs -mno-recip, or GCC turns every division into a 14 bit reciprocal and a
+// Newton step, which flushes reciprocals near FLT_MIN to 0.
+//
+// Nothing overflows to inf, since -ffast-math assumes there are no infinities:
+// exp saturates within 0.002% of FLT_MAX above 88.72 and goes through
+// denormals to 0 below -87.3 (flushed to 0 if linked with -Ofast), tanh
+// saturates within an ulp of +-1, and sigmoid within an ulp of 1 and 0.001%
+// above FLT_MIN. -ffast-math also assumes there are no NaNs, and reorders the
+// clamps freely, so what NaN inputs give depends on the instruction set.
+//
+// make check (tools/check.c) measures all of this for each instruction set.
+
+// exp(x) = 2^n * exp(r), with n = round(x / ln 2) and |r| <= ln(2) / 2.
+// exp(r) is the minimax polynomial from Cephes expf. 2^n is applied as two
+// halves so that n down to -149 (denormal results) and up to 128 both work.
+static inline vec_t vec_exp(vec_t x) {
+    const vec_t log2e = vec_set1(1.44269504088896341f);
+    const vec_t ln2_hi = vec_set1(0.693359375f);
+    const vec_t ln2_lo = vec_set1(-2.12194440e-4f);
+
+    x = vec_min(vec_set1(88.7228317f), x);
+    x = vec_max(vec_set1(-103.972084f), x);
+
+    // Rounds to nearest, the clamp above keeps n well inside int32
+    veci_t e = vec_cvt_int(vec_mul(x, log2e));
+    vec_t n = vec_cvt_float(e);
+    // Cody-Waite reduction. The barrier keeps -ffast-math from folding the two
+    // steps into one, which FMA used to prevent but SSE2 doesn't have.
+    vec_t r = vec_fnmadd(n, ln2_hi, x);
+    vec_barrier(r);
+    r = vec_fnmadd(n, ln2_lo, r);
+
+    vec_t p = vec_set1(1.9875691500e-4f);
+    p = vec_fmadd(p, r, vec_set1(1.3981999507e-3f));
+    p = vec_fmadd(p, r, vec_set1(8.3334519073e-3f));
+    p = vec_fmadd(p, r, vec_set1(4.1665795894e-2f));
+    p = vec_fmadd(p, r, vec_set1(1.6666665459e-1f));
+    p = vec_fmadd(p, r, vec_set1(5.0000001201e-1f));
+    vec_t r2 = vec_mul(r, r);
+    p = vec_fmadd(p, r2, vec_add(r, vec_set1(1.0f)));
+
+    // The first half goes straight into the exponent bits of p, which is
+    // close to 1, so -ffast-math can't reassociate the two scalings into one
+    // that overflows
+    veci_t e1 = veci_srai(e, 1);
+    veci_t e2 = veci_sub(e, e1);
+    p = vec_as_float(veci_add(vec_as_int(p), veci_slli(e1, 23)));
+    vec_t scale = vec_as_float(veci_slli(veci_add(e2, veci_set1(127)), 23));
+    return vec_mul(p, scale);
+}
+
+// log(x) = e * ln 2 + log(m), with x = m * 2^e and m in [sqrt(0.5), sqrt(2)).
+// log(m) is the polynomial from Cephes logf. Only meant for normal positive x,
+// callers clamp their inputs to at least FLT_MIN.
+static inline vec_t vec_log(vec_t x) {
+    const vec_t one = vec_set1(1.0f);
+    veci_t bits = vec_as_int(x);
+    vec_t e = vec_cvt_float(veci_sub(veci_srli(bits, 23), veci_set1(126)));
+    // m in [0.5, 1)
+    vec_t m = vec_as_float(veci_or(veci_and(bits, veci_set1(0x007fffff)), veci_set1(0x3f000000)));
+
+    // Below sqrt(0.5), use 2m and e - 1 instead so m - 1 stays small
+    vmask_t below = vec_cmp_lt(m, vec_set1(0.707106781186547524f));
+    e = vec_sub(e, vec_mask_zero(below, one));
+    m = vec_sub(vec_add(m, vec_mask_zero(below, m)), one);
+
+    vec_t z = vec_mul(m, m);
+    vec_t p = vec_set1(7.0376836292e-2f);
+    p = vec_fmadd(p, m, vec_set1(-1.1514610310e-1f));
+    p = vec_fmadd(p, m, vec_set1(1.1676998740e-1f));
+    p = vec_fmadd(p, m, vec_set1(-1.2420140846e-1f));
+    p = vec_fmadd(p, m, vec_set1(1.4249322787e-1f));
+    p = vec_fmadd(p, m, vec_set1(-1.6668057665e-1f));
+    p = vec_fmadd(p, m, vec_set1(2.0000714765e-1f));
+    p = vec_fmadd(p, m, vec_set1(-2.4999993993e-1f));
+    p = vec_fmadd(p, m, vec_set1(3.3333331174e-1f));
+    vec_t y = vec_mul(vec_mul(p, z), m);
+    y = vec_fmadd(e, vec_set1(-2.12194440e-4f), y);
+    y = vec_fnmadd(z, vec_set1(0.5f), y);
+    // Same as in exp, e * ln 2 must stay split in two, and the small terms
+    // summed before the large one. Without FMA the barrier has to be on the
+    // sum, or -ffast-math adds e * ln2_hi to m first.
+    vec_t sum = vec_add(m, y);
+    vec_barrier(sum);
+    return vec_fmadd(e, vec_set1(0.693359375f), sum);
+}
+
+// Past +-ln(FLT_MIN) exp(-x) or the sigmoid itself would be denormal, which
+// costs a microcode assist per lane unless the process runs with flush to zero
+#define SIGMOID_LIMIT 87.3365402f
+
+// 1 / (1 + exp(-x)), on x clamped to +-SIGMOID_LIMIT. The result saturates at
+// 1 and at FLT_MIN, never passing through inf or denormals.
+static inline vec_t vec_sigmoid(vec_t x) {
+    const vec_t one = vec_set1(1.0f);
+    x = vec_min(vec_set1(SIGMOID_LIMIT), x);
+    x = vec_max(vec_set1(-SIGMOID_LIMIT), x);
+    vec_t e = vec_exp(vec_sub(vec_zero(), x));
+    return vec_div(one, vec_add(one, e));
+}
+
+// Odd, so it is computed on |x| and the sign copied back. Small inputs use the
+// Cephes tanhf polynomial, where 1 - 2 / (exp(2x) + 1) would cancel.
+static inline vec_t vec_tanh(vec_t x) {
+    const vec_t sign_mask = vec_set1(-0.0f);
+    const vec_t one = vec_set1(1.0f);
+    vec_t sign = vec_and(x, sign_mask);
+    // tanh rounds to 1 above 9, clamping keeps exp(2x) finite
+    vec_t abs_x = vec_min(vec_set1(9.0f), vec_andnot(sign_mask, x));
+
+    vec_t z = vec_mul(abs_x, abs_x);
+    vec_t p = vec_set1(-5.70498872745e-3f);
+    p = vec_fmadd(p, z, vec_set1(2.06390887954e-2f));
+    p = vec_fmadd(p, z, vec_set1(-5.37397155531e-2f));
+    p = vec_fmadd(p, z, vec_set1(1.33314422036e-1f));
+    p = vec_fmadd(p, z, vec_set1(-3.33332819422e-1f));
+    vec_t small = vec_fmadd(vec_mul(p, z), abs_x, abs_x);
+
+    vec_t e = vec_exp(vec_add(abs_x, abs_x));
+    vec_t large = vec_sub(one, vec_div(vec_set1(2.0f), vec_add(e, one)));
+
+    vmask_t is_small = vec_cmp_lt(abs_x, vec_set1(0.625f));
+    return vec_or(vec_select(is_small, large, small), sign);
+}
+
+#endif // SIMD_MATH_H
@@ -52,9 +52,29 @@ do { \
 
 #define THREAD_CLOSE(thread) CloseHandle(thread)
 
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+
+#define MUTEX_INIT(mutex) InitializeCriticalSection(&(mutex))
+#define MUTEX_LOCK(mutex) EnterCriticalSection(&(mutex))
+#define MUTEX_UNLOCK(mutex) LeaveCriticalSection(&(mutex))
+#define MUTEX_DESTROY(mutex) DeleteCriticalSection(&(mutex))
+
+#define COND_INIT(cond) InitializeConditionVariable(&(cond))
+#define COND_WAIT(cond, mutex) SleepConditionVariableCS(&(cond), &(mutex), INFINITE)
+#define COND_SIGNAL(cond) WakeConditionVariable(&(cond))
+#define COND_BROADCAST(cond) WakeAllConditionVariable(&(cond))
+#define COND_DESTROY(cond)
+// Waits for at most the given number of seconds, may wake up early
+#define COND_TIMEDWAIT(cond, mutex, seconds) \
+    SleepConditionVariableCS(&(cond), &(mutex), (DWORD)((seconds) * 1000.0))
+
+#define THREAD_YIELD() SwitchToThread()
+
 #else
 #include <errno.h>
 #include <pthread.h>
+#include <time.h>
 
 typedef pthread_t thread_t;
 typedef void *thread_func_return_t;
@@ -89,6 +109,34 @@ do { \
 #define THREAD_EXIT pthread_exit(NULL)
 
 #define THREAD_CLOSE(thread)
+
+#include <sched.h>
+
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+
+#define MUTEX_INIT(mutex) pthread_mutex_init(&(mutex), NULL)
+#define MUTEX_LOCK(mutex) pthread_mutex_lock(&(mutex))
+#define MUTEX_UNLOCK(mutex) pthread_mutex_unlock(&(mutex))
+#define MUTEX_DESTROY(mutex) pthread_mutex_destroy(&(mutex))
+
+#define COND_INIT(cond) pthread_cond_init(&(cond), NULL)
+#define COND_WAIT(cond, mutex) pthread_cond_wait(&(cond), &(mutex))
+#define COND_SIGNAL(cond) pthread_cond_signal(&(cond))
+#define COND_BROADCAST(cond) pthread_cond_broadcast(&(cond))
+#define COND_DESTROY(cond) pthread_cond_destroy(&(cond))
+// Waits for at most the given number of seconds, may wake up early
+#define COND_TIMEDWAIT(cond, mutex, seconds) \
+do { \
+    struct timespec deadline_; \
+    clock_gettime(CLOCK_REALTIME, &deadline_); \
+    long long nanoseconds_ = (long long)((seconds) * 1e9) + deadline_.tv_nsec; \
+    deadline_.tv_sec += (time_t)(nanoseconds_ / 1000000000LL); \
+    deadline_.tv_nsec = (long)(nanoseconds_ % 1000000000LL); \
+    pthread_cond_timedwait(&(cond), &(mutex), &deadline_); \
+} while (0)
+
+#define THREAD_YIELD() sched_yield()
 #endif
 
 #endif // THREADS_H
@@ -0,0 +1,26 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#ifdef _WIN32
+#include <windows.h>
+
+// Returns a monotonic timestamp in seconds, only meaningful as a difference
+static inline double timer_seconds(void) {
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+#else
+#include <time.h>
+
+// Returns a monotonic timestamp in seconds, only meaningful as a difference
+static inline double timer_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+#endif
+
+#endif // TIMER_H
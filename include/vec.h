@@ -0,0 +1,339 @@
+#ifndef VEC_H
+#define VEC_H
+
+#include <immintrin.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// A thin layer over the float intrinsics of one instruction set, so the
+// kernels in kernels/impl.h are written once and compiled once per ISA. The
+// instruction set is whatever the including file is compiled for:
+//
+//   -mavx512f -mavx512dq   16 lanes, __m512, FMA, opmask registers
+//   -mavx2 -mfma           8 lanes, __m256, FMA
+//   (nothing)              4 lanes, __m128, SSE2 only, which every x86-64 CPU has
+//
+// vec_t holds VEC_WIDTH floats, veci_t the same number of int32s, and vmask_t
+// the result of a comparison, one bit (AVX-512) or set/clear lane per float.
+
+#if defined(__AVX2__) && defined(__FMA__)
+
+// Transposes the 8 x 8 block at src into dst
+static inline void transpose8x8_ps(const float *src, size_t lds, float *dst, size_t ldd) {
+    __m256 r0 = _mm256_loadu_ps(src + 0 * lds), r1 = _mm256_loadu_ps(src + 1 * lds);
+    __m256 r2 = _mm256_loadu_ps(src + 2 * lds), r3 = _mm256_loadu_ps(src + 3 * lds);
+    __m256 r4 = _mm256_loadu_ps(src + 4 * lds), r5 = _mm256_loadu_ps(src + 5 * lds);
+    __m256 r6 = _mm256_loadu_ps(src + 6 * lds), r7 = _mm256_loadu_ps(src + 7 * lds);
+
+    __m256 t0 = _mm256_unpacklo_ps(r0, r1), t1 = _mm256_unpackhi_ps(r0, r1);
+    __m256 t2 = _mm256_unpacklo_ps(r2, r3), t3 = _mm256_unpackhi_ps(r2, r3);
+    __m256 t4 = _mm256_unpacklo_ps(r4, r5), t5 = _mm256_unpackhi_ps(r4, r5);
+    __m256 t6 = _mm256_unpacklo_ps(r6, r7), t7 = _mm256_unpackhi_ps(r6, r7);
+
+    r0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    r1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    r2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    r3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    r4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    r5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    r6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    r7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+    _mm256_storeu_ps(dst + 0 * ldd, _mm256_permute2f128_ps(r0, r4, 0x20));
+    _mm256_storeu_ps(dst + 1 * ldd, _mm256_permute2f128_ps(r1, r5, 0x20));
+    _mm256_storeu_ps(dst + 2 * ldd, _mm256_permute2f128_ps(r2, r6, 0x20));
+    _mm256_storeu_ps(dst + 3 * ldd, _mm256_permute2f128_ps(r3, r7, 0x20));
+    _mm256_storeu_ps(dst + 4 * ldd, _mm256_permute2f128_ps(r0, r4, 0x31));
+    _mm256_storeu_ps(dst + 5 * ldd, _mm256_permute2f128_ps(r1, r5, 0x31));
+    _mm256_storeu_ps(dst + 6 * ldd, _mm256_permute2f128_ps(r2, r6, 0x31));
+    _mm256_storeu_ps(dst + 7 * ldd, _mm256_permute2f128_ps(r3, r7, 0x31));
+}
+#endif
+
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+
+#define VEC_WIDTH 16
+
+typedef __m512 vec_t;
+typedef __m512i veci_t;
+typedef __mmask16 vmask_t;
+
+#define vec_load(p) _mm512_loadu_ps(p)
+#define vec_load_aligned(p) _mm512_load_ps(p)
+#define vec_store(p, v) _mm512_storeu_ps(p, v)
+#define vec_store_aligned(p, v) _mm512_store_ps(p, v)
+#define vec_set1(x) _mm512_set1_ps(x)
+#define vec_zero() _mm512_setzero_ps()
+#define vec_broadcast(p) _mm512_set1_ps(*(p))
+
+#define vec_add(a, b) _mm512_add_ps(a, b)
+#define vec_sub(a, b) _mm512_sub_ps(a, b)
+#define vec_mul(a, b) _mm512_mul_ps(a, b)
+#define vec_div(a, b) _mm512_div_ps(a, b)
+#define vec_min(a, b) _mm512_min_ps(a, b)
+#define vec_max(a, b) _mm512_max_ps(a, b)
+#define vec_fmadd(a, b, c) _mm512_fmadd_ps(a, b, c)
+#define vec_fnmadd(a, b, c) _mm512_fnmadd_ps(a, b, c)
+#define vec_fmsub(a, b, c) _mm512_fmsub_ps(a, b, c)
+
+// The float bitwise ops are AVX512DQ
+#define vec_and(a, b) _mm512_and_ps(a, b)
+#define vec_andnot(a, b) _mm512_andnot_ps(a, b)
+#define vec_or(a, b) _mm512_or_ps(a, b)
+
+// Comparisons go to opmask registers rather than vectors
+#define vec_cmp_gt(a, b) _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ)
+#define vec_cmp_lt(a, b) _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ)
+#define vec_select(mask, if_false, if_true) _mm512_mask_blend_ps(mask, if_false, if_true)
+#define vec_mask_zero(mask, v) _mm512_maskz_mov_ps(mask, v)
+
+#define vec_cvt_int(v) _mm512_cvtps_epi32(v)
+#define vec_cvt_float(v) _mm512_cvtepi32_ps(v)
+#define vec_as_int(v) _mm512_castps_si512(v)
+#define vec_as_float(v) _mm512_castsi512_ps(v)
+#define veci_set1(x) _mm512_set1_epi32(x)
+#define veci_add(a, b) _mm512_add_epi32(a, b)
+#define veci_sub(a, b) _mm512_sub_epi32(a, b)
+#define veci_and(a, b) _mm512_and_si512(a, b)
+#define veci_or(a, b) _mm512_or_si512(a, b)
+#define veci_slli(v, n) _mm512_slli_epi32(v, n)
+#define veci_srli(v, n) _mm512_srli_epi32(v, n)
+#define veci_srai(v, n) _mm512_srai_epi32(v, n)
+
+// Lanes [0, n) set, for n <= VEC_WIDTH
+static inline vmask_t vec_tail_mask(size_t n) {
+    return (vmask_t)((1u << n) - 1);
+}
+
+// Masked lanes are neither read nor written, so tails need no special casing
+static inline vec_t vec_load_partial(const float *p, size_t n) {
+    return _mm512_maskz_loadu_ps(vec_tail_mask(n), p);
+}
+
+static inline void vec_store_partial(float *p, vec_t v, size_t n) {
+    _mm512_mask_storeu_ps(p, vec_tail_mask(n), v);
+}
+
+// Halves first, then the same order as the 8 lane reductions
+static inline float vec_reduce_sum(vec_t v) {
+    __m256 h = _mm256_add_ps(_mm512_castps512_ps256(v), _mm512_extractf32x8_ps(v, 1));
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(h), _mm256_extractf128_ps(h, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+static inline float vec_reduce_max(vec_t v) {
+    __m256 h = _mm256_max_ps(_mm512_castps512_ps256(v), _mm512_extractf32x8_ps(v, 1));
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(h), _mm256_extractf128_ps(h, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_movehdup_ps(m));
+    return _mm_cvtss_f32(m);
+}
+
+// As four 8 x 8 blocks
+static inline void vec_transpose(const float *src, size_t lds, float *dst, size_t ldd) {
+    transpose8x8_ps(src, lds, dst, ldd);
+    transpose8x8_ps(src + 8, lds, dst + 8 * ldd, ldd);
+    transpose8x8_ps(src + 8 * lds, lds, dst + 8, ldd);
+    transpose8x8_ps(src + 8 * lds + 8, lds, dst + 8 * ldd + 8, ldd);
+}
+
+#elif defined(__AVX2__) && defined(__FMA__)
+
+#define VEC_WIDTH 8
+
+typedef __m256 vec_t;
+typedef __m256i veci_t;
+typedef __m256 vmask_t;
+
+#define vec_load(p) _mm256_loadu_ps(p)
+#define vec_load_aligned(p) _mm256_load_ps(p)
+#define vec_store(p, v) _mm256_storeu_ps(p, v)
+#define vec_store_aligned(p, v) _mm256_store_ps(p, v)
+#define vec_set1(x) _mm256_set1_ps(x)
+#define vec_zero() _mm256_setzero_ps()
+#define vec_broadcast(p) _mm256_broadcast_ss(p)
+
+#define vec_add(a, b) _mm256_add_ps(a, b)
+#define vec_sub(a, b) _mm256_sub_ps(a, b)
+#define vec_mul(a, b) _mm256_mul_ps(a, b)
+#define vec_div(a, b) _mm256_div_ps(a, b)
+#define vec_min(a, b) _mm256_min_ps(a, b)
+#define vec_max(a, b) _mm256_max_ps(a, b)
+// a * b + c, c - a * b and a * b - c
+#define vec_fmadd(a, b, c) _mm256_fmadd_ps(a, b, c)
+#define vec_fnmadd(a, b, c) _mm256_fnmadd_ps(a, b, c)
+#define vec_fmsub(a, b, c) _mm256_fmsub_ps(a, b, c)
+
+#define vec_and(a, b) _mm256_and_ps(a, b)
+#define vec_andnot(a, b) _mm256_andnot_ps(a, b)
+#define vec_or(a, b) _mm256_or_ps(a, b)
+
+#define vec_cmp_gt(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define vec_cmp_lt(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+// Lanes of if_true where mask is set, of if_false elsewhere
+#define vec_select(mask, if_false, if_true) _mm256_blendv_ps(if_false, if_true, mask)
+// v where mask is set, 0 elsewhere
+#define vec_mask_zero(mask, v) _mm256_and_ps(mask, v)
+
+// Round to nearest, and back
+#define vec_cvt_int(v) _mm256_cvtps_epi32(v)
+#define vec_cvt_float(v) _mm256_cvtepi32_ps(v)
+#define vec_as_int(v) _mm256_castps_si256(v)
+#define vec_as_float(v) _mm256_castsi256_ps(v)
+#define veci_set1(x) _mm256_set1_epi32(x)
+#define veci_add(a, b) _mm256_add_epi32(a, b)
+#define veci_sub(a, b) _mm256_sub_epi32(a, b)
+#define veci_and(a, b) _mm256_and_si256(a, b)
+#define veci_or(a, b) _mm256_or_si256(a, b)
+#define veci_slli(v, n) _mm256_slli_epi32(v, n)
+#define veci_srli(v, n) _mm256_srli_epi32(v, n)
+#define veci_srai(v, n) _mm256_srai_epi32(v, n)
+
+static inline __m256i vec_tail_bits(size_t n) {
+    static const int32_t mask[16] = {-1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0};
+    return _mm256_loadu_si256((const __m256i *)(mask + 8 - n));
+}
+
+// Lanes [0, n) set, for n <= VEC_WIDTH
+static inline vmask_t vec_tail_mask(size_t n) {
+    return _mm256_castsi256_ps(vec_tail_bits(n));
+}
+
+// The first n lanes, the rest are 0 and nothing past p + n is touched
+static inline vec_t vec_load_partial(const float *p, size_t n) {
+    return _mm256_maskload_ps(p, vec_tail_bits(n));
+}
+
+static inline void vec_store_partial(float *p, vec_t v, size_t n) {
+    _mm256_maskstore_ps(p, vec_tail_bits(n), v);
+}
+
+// Horizontal sum and max, always combining the lanes in the same order
+static inline float vec_reduce_sum(vec_t v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+static inline float vec_reduce_max(vec_t v) {
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_movehdup_ps(m));
+    return _mm_cvtss_f32(m);
+}
+
+// Transposes the VEC_WIDTH x VEC_WIDTH block at src into dst
+static inline void vec_transpose(const float *src, size_t lds, float *dst, size_t ldd) {
+    transpose8x8_ps(src, lds, dst, ldd);
+}
+
+#else
+
+#define VEC_WIDTH 4
+
+typedef __m128 vec_t;
+typedef __m128i veci_t;
+typedef __m128 vmask_t;
+
+#define vec_load(p) _mm_loadu_ps(p)
+#define vec_load_aligned(p) _mm_load_ps(p)
+#define vec_store(p, v) _mm_storeu_ps(p, v)
+#define vec_store_aligned(p, v) _mm_store_ps(p, v)
+#define vec_set1(x) _mm_set1_ps(x)
+#define vec_zero() _mm_setzero_ps()
+#define vec_broadcast(p) _mm_load1_ps(p)
+
+#define vec_add(a, b) _mm_add_ps(a, b)
+#define vec_sub(a, b) _mm_sub_ps(a, b)
+#define vec_mul(a, b) _mm_mul_ps(a, b)
+#define vec_div(a, b) _mm_div_ps(a, b)
+#define vec_min(a, b) _mm_min_ps(a, b)
+#define vec_max(a, b) _mm_max_ps(a, b)
+// No FMA, so these round twice
+#define vec_fmadd(a, b, c) _mm_add_ps(_mm_mul_ps(a, b), c)
+#define vec_fnmadd(a, b, c) _mm_sub_ps(c, _mm_mul_ps(a, b))
+#define vec_fmsub(a, b, c) _mm_sub_ps(_mm_mul_ps(a, b), c)
+
+#define vec_and(a, b) _mm_and_ps(a, b)
+#define vec_andnot(a, b) _mm_andnot_ps(a, b)
+#define vec_or(a, b) _mm_or_ps(a, b)
+
+#define vec_cmp_gt(a, b) _mm_cmpgt_ps(a, b)
+#define vec_cmp_lt(a, b) _mm_cmplt_ps(a, b)
+#define vec_select(mask, if_false, if_true) \
+    _mm_or_ps(_mm_and_ps(mask, if_true), _mm_andnot_ps(mask, if_false))
+#define vec_mask_zero(mask, v) _mm_and_ps(mask, v)
+
+#define vec_cvt_int(v) _mm_cvtps_epi32(v)
+#define vec_cvt_float(v) _mm_cvtepi32_ps(v)
+#define vec_as_int(v) _mm_castps_si128(v)
+#define vec_as_float(v) _mm_castsi128_ps(v)
+#define veci_set1(x) _mm_set1_epi32(x)
+#define veci_add(a, b) _mm_add_epi32(a, b)
+#define veci_sub(a, b) _mm_sub_epi32(a, b)
+#define veci_and(a, b) _mm_and_si128(a, b)
+#define veci_or(a, b) _mm_or_si128(a, b)
+#define veci_slli(v, n) _mm_slli_epi32(v, n)
+#define veci_srli(v, n) _mm_srli_epi32(v, n)
+#define veci_srai(v, n) _mm_srai_epi32(v, n)
+
+static inline vmask_t vec_tail_mask(size_t n) {
+    static const int32_t mask[8] = {-1, -1, -1, -1, 0, 0, 0, 0};
+    return _mm_castsi128_ps(_mm_loadu_si128((const __m128i *)(mask + 4 - n)));
+}
+
+// SSE2 has no masked loads and stores, the tail goes through a buffer
+static inline vec_t vec_load_partial(const float *p, size_t n) {
+    float buffer[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    for (size_t i = 0; i < n; i++) {
+        buffer[i] = p[i];
+    }
+    return _mm_loadu_ps(buffer);
+}
+
+static inline void vec_store_partial(float *p, vec_t v, size_t n) {
+    float buffer[4];
+    _mm_storeu_ps(buffer, v);
+    for (size_t i = 0; i < n; i++) {
+        p[i] = buffer[i];
+    }
+}
+
+static inline float vec_reduce_sum(vec_t v) {
+    __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(s);
+}
+
+static inline float vec_reduce_max(vec_t v) {
+    __m128 m = _mm_max_ps(v, _mm_movehl_ps(v, v));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(m);
+}
+
+static inline void vec_transpose(const float *src, size_t lds, float *dst, size_t ldd) {
+    __m128 r0 = _mm_loadu_ps(src + 0 * lds), r1 = _mm_loadu_ps(src + 1 * lds);
+    __m128 r2 = _mm_loadu_ps(src + 2 * lds), r3 = _mm_loadu_ps(src + 3 * lds);
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    _mm_storeu_ps(dst + 0 * ldd, r0);
+    _mm_storeu_ps(dst + 1 * ldd, r1);
+    _mm_storeu_ps(dst + 2 * ldd, r2);
+    _mm_storeu_ps(dst + 3 * ldd, r3);
+}
+
+#endif
+
+#define vec_abs(v) vec_andnot(vec_set1(-0.0f), v)
+
+// Stops the compiler from looking through v, so -ffast-math can't reassociate
+// the steps on either side of it
+#if defined(__GNUC__) || defined(__clang__)
+#define vec_barrier(v) __asm__("" : "+x"(v))
+#else
+#define vec_barrier(v) ((void)0)
+#endif
+
+#endif // VEC_H
@@ -0,0 +1,10 @@
+// Haswell and later, compiled with -mavx2 -mfma (see the makefile)
+#if !defined(__AVX2__) || !defined(__FMA__)
+#error "kernels/avx2.c must be compiled with -mavx2 -mfma"
+#endif
+
+#define KERNEL_TABLE kernels_avx2
+#define KERNEL_ISA ISA_AVX2
+#define KERNEL_NAME "avx2"
+
+#include "impl.h"
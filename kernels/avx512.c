@@ -0,0 +1,11 @@
+// Skylake-SP and later, compiled with -mavx512f -mavx512dq -mavx512bw
+// -mavx512vl -mfma -mno-recip (see the makefile)
+#if !defined(__AVX512F__) || !defined(__AVX512DQ__) || !defined(__FMA__)
+#error "kernels/avx512.c must be compiled with -mavx512f -mavx512dq -mavx512bw -mavx512vl -mfma"
+#endif
+
+#define KERNEL_TABLE kernels_avx512
+#define KERNEL_ISA ISA_AVX512
+#define KERNEL_NAME "avx512"
+
+#include "impl.h"
@@ -0,0 +1,138 @@
+#include "kernels.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+// Compiled for plain x86-64 like everything outside kernels/, so it can run
+// the checks on any CPU before picking a table.
+
+static const char *const isa_names[NUM_ISAS] = {"sse2", "avx2", "avx512"};
+
+// The table built for each ISA
+static const kernel_table_t *const tables[NUM_ISAS] = {&kernels_sse2, &kernels_avx2, &kernels_avx512};
+
+static _Atomic(const kernel_table_t *) selected = NULL;
+
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+    #ifdef _MSC_VER
+    int info[4];
+    __cpuidex(info, (int)leaf, (int)subleaf);
+    for (int i = 0; i < 4; i++) {
+        regs[i] = (uint32_t)info[i];
+    }
+    #else
+    regs[0] = regs[1] = regs[2] = regs[3] = 0;
+    __get_cpuid_count(leaf, subleaf, &regs[0], &regs[1], &regs[2], &regs[3]);
+    #endif
+}
+
+// Which register states the OS saves on a context switch
+static uint64_t xgetbv(void) {
+    #ifdef _MSC_VER
+    return _xgetbv(0);
+    #else
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+    #endif
+}
+
+static isa_t detect_isa(void) {
+    uint32_t leaf0[4], leaf1[4], leaf7[4];
+    cpuid(0, 0, leaf0);
+    uint32_t max_leaf = leaf0[0];
+    cpuid(1, 0, leaf1);
+    if (max_leaf >= 7) {
+        cpuid(7, 0, leaf7);
+    } else {
+        leaf7[0] = leaf7[1] = leaf7[2] = leaf7[3] = 0;
+    }
+
+    bool osxsave = (leaf1[2] >> 27) & 1;
+    if (!osxsave) {
+        return ISA_SSE2;
+    }
+    uint64_t xcr0 = xgetbv();
+
+    // XMM and YMM state (bits 1, 2), AVX, FMA, F16C and AVX2
+    bool ymm = (xcr0 & 0x6) == 0x6;
+    bool avx2 = ymm && ((leaf1[2] >> 28) & 1) && ((leaf1[2] >> 12) & 1) && ((leaf1[2] >> 29) & 1) &&
+                ((leaf7[1] >> 5) & 1);
+    if (!avx2) {
+        return ISA_SSE2;
+    }
+
+    // Opmask and ZMM state (bits 5, 6, 7), AVX-512 F, DQ, BW and VL
+    bool zmm = (xcr0 & 0xe6) == 0xe6;
+    bool avx512 = zmm && ((leaf7[1] >> 16) & 1) && ((leaf7[1] >> 17) & 1) && ((leaf7[1] >> 30) & 1) &&
+                  ((leaf7[1] >> 31) & 1);
+    return avx512 ? ISA_AVX512 : ISA_AVX2;
+}
+
+isa_t cpu_isa(void) {
+    static atomic_int detected = -1;
+    int isa = atomic_load(&detected);
+    if (isa < 0) {
+        isa = (int)detect_isa();
+        atomic_store(&detected, isa);
+    }
+    return (isa_t)isa;
+}
+
+const char *isa_name(isa_t isa) {
+    return (isa < NUM_ISAS) ? isa_names[isa] : "unknown";
+}
+
+// NN_ISA can only lower the ISA, running instructions the CPU lacks would crash
+static isa_t requested_isa(isa_t supported) {
+    const char *env = getenv("NN_ISA");
+    if (env == NULL || env[0] == '\0') {
+        return supported;
+    }
+    for (int isa = 0; isa < NUM_ISAS; isa++) {
+        if (strcmp(env, isa_names[isa]) == 0) {
+            if ((isa_t)isa > supported) {
+                fprintf(stderr, "NN_ISA=%s isn't available on this CPU, using %s\n", env, isa_name(supported));
+                return supported;
+            }
+            return (isa_t)isa;
+        }
+    }
+    fprintf(stderr, "Unknown NN_ISA=%s (expected sse2, avx2 or avx512), using %s\n", env, isa_name(supported));
+    return supported;
+}
+
+const kernel_table_t *kernels(void) {
+    const kernel_table_t *table = atomic_load_explicit(&selected, memory_order_acquire);
+    if (table != NULL) {
+        return table;
+    }
+
+    // Threads racing here all pick the same table
+    table = tables[requested_isa(cpu_isa())];
+    atomic_store_explicit(&selected, table, memory_order_release);
+    return table;
+}
+
+const kernel_table_t *select_kernels(isa_t isa) {
+    if (isa > cpu_isa()) {
+        isa = cpu_isa();
+    }
+    atomic_store_explicit(&selected, tables[isa], memory_order_release);
+    return tables[isa];
+}
+
+void require_isa(isa_t isa, const char *feature) {
+    if (cpu_isa() < isa) {
+        fprintf(stderr, "%s needs %s, this CPU only supports %s\n", feature, isa_name(isa), isa_name(cpu_isa()));
+        exit(1);
+    }
+}
@@ -0,0 +1,465 @@
+// The kernels behind kernel_table_t, written against include/vec.h. Included
+// by one file per instruction set, which defines KERNEL_TABLE, KERNEL_ISA and
+// KERNEL_NAME and is compiled with that instruction set's flags. Everything
+// here is static, so each build gets its own copy.
+
+#include <assert.h>
+#include <float.h>
+#include <stdbool.h>
+
+#include "kernels.h"
+#include "../include/simd_math.h"
+
+#if !defined(KERNEL_TABLE) || !defined(KERNEL_ISA) || !defined(KERNEL_NAME)
+#error "Define KERNEL_TABLE, KERNEL_ISA and KERNEL_NAME before including kernels/impl.h"
+#endif
+
+// Two vectors wide. Six rows tall gives 12 accumulators, which with two panel
+// loads and a broadcast fit in the 16 vector registers of SSE2 and AVX2.
+// AVX-512 has 32, enough for twelve rows.
+#if VEC_WIDTH == 16
+#define MR 12
+#else
+#define MR 6
+#endif
+#define NR (2 * VEC_WIDTH)
+
+#define LEAKY_RELU_ALPHA 0.01f
+#define HUBLER_THRESHOLD 0.01f
+
+// GEMM
+
+// The product of the first rows of an MR tall panel of A and the first halves
+// (1 or 2) vectors of an NR wide panel of B. Always inlined with constant rows
+// and halves, and the loops fully unrolled, so the accumulators stay in
+// registers.
+static inline __attribute__((always_inline)) void gemm_tile(size_t kc, const float *a, const float *b,
+                                                            vec_t acc[MR][2], size_t rows, size_t halves) {
+    #pragma GCC unroll 16
+    for (size_t i = 0; i < MR; i++) {
+        acc[i][0] = vec_zero();
+        acc[i][1] = vec_zero();
+    }
+
+    for (size_t p = 0; p < kc; p++) {
+        vec_t b0 = vec_load_aligned(b);
+        vec_t b1 = (halves == 2) ? vec_load_aligned(b + VEC_WIDTH) : vec_zero();
+
+        #pragma GCC unroll 16
+        for (size_t i = 0; i < rows; i++) {
+            vec_t a_broadcast = vec_broadcast(a + i);
+            acc[i][0] = vec_fmadd(a_broadcast, b0, acc[i][0]);
+            if (halves == 2) {
+                acc[i][1] = vec_fmadd(a_broadcast, b1, acc[i][1]);
+            }
+        }
+
+        a += MR;
+        b += NR;
+    }
+}
+
+static void gemm_micro_kernel(size_t kc, const float *a, const float *b,
+                              float *c, size_t ldc, bool accumulate, const float *bias) {
+    vec_t acc[MR][2];
+    gemm_tile(kc, a, b, acc, MR, 2);
+
+    if (accumulate) {
+        #pragma GCC unroll 16
+        for (size_t i = 0; i < MR; i++) {
+            acc[i][0] = vec_add(acc[i][0], vec_load(c + i * ldc));
+            acc[i][1] = vec_add(acc[i][1], vec_load(c + i * ldc + VEC_WIDTH));
+        }
+    }
+
+    if (bias != NULL) {
+        vec_t bias0 = vec_load(bias);
+        vec_t bias1 = vec_load(bias + VEC_WIDTH);
+        #pragma GCC unroll 16
+        for (size_t i = 0; i < MR; i++) {
+            acc[i][0] = vec_add(acc[i][0], bias0);
+            acc[i][1] = vec_add(acc[i][1], bias1);
+        }
+    }
+
+    #pragma GCC unroll 16
+    for (size_t i = 0; i < MR; i++) {
+        vec_store(c + i * ldc, acc[i][0]);
+        vec_store(c + i * ldc + VEC_WIDTH, acc[i][1]);
+    }
+}
+
+// The same for the tiles on the bottom and right edges of C, of which only
+// rows x cols is written. A and B are zero padded, so the whole tile can be
+// computed and the edge only applied on the way out, with partial loads and
+// stores for the columns. Single rows (batch 1 inference) and narrow edges
+// (a 10 class output layer) skip the work that would be thrown away.
+static void gemm_edge_kernel(size_t kc, const float *a, const float *b, float *c, size_t ldc,
+                             bool accumulate, const float *bias, size_t rows, size_t cols) {
+    vec_t acc[MR][2];
+    if (rows == 1) {
+        if (cols <= VEC_WIDTH) {
+            gemm_tile(kc, a, b, acc, 1, 1);
+        } else {
+            gemm_tile(kc, a, b, acc, 1, 2);
+        }
+    } else if (cols <= VEC_WIDTH) {
+        gemm_tile(kc, a, b, acc, MR, 1);
+    } else {
+        gemm_tile(kc, a, b, acc, MR, 2);
+    }
+
+    // Lanes in each of the two vectors of a row
+    size_t n0 = (cols < VEC_WIDTH) ? cols : VEC_WIDTH;
+    size_t n1 = cols - n0;
+    vec_t bias0 = vec_zero(), bias1 = vec_zero();
+    if (bias != NULL) {
+        bias0 = vec_load_partial(bias, n0);
+        bias1 = (n1 > 0) ? vec_load_partial(bias + VEC_WIDTH, n1) : vec_zero();
+    }
+
+    #pragma GCC unroll 16
+    for (size_t i = 0; i < MR; i++) {
+        if (i < rows) {
+            float *row = c + i * ldc;
+            if (accumulate) {
+                acc[i][0] = vec_add(acc[i][0], vec_load_partial(row, n0));
+            }
+            if (bias != NULL) {
+                acc[i][0] = vec_add(acc[i][0], bias0);
+            }
+            vec_store_partial(row, acc[i][0], n0);
+
+            if (n1 > 0) {
+                if (accumulate) {
+                    acc[i][1] = vec_add(acc[i][1], vec_load_partial(row + VEC_WIDTH, n1));
+                }
+                if (bias != NULL) {
+                    acc[i][1] = vec_add(acc[i][1], bias1);
+                }
+                vec_store_partial(row + VEC_WIDTH, acc[i][1], n1);
+            }
+        }
+    }
+}
+
+static void gemm_pack_b(size_t kc, size_t cols, const float *b, size_t ldb, float *packed) {
+    if (cols == NR) {
+        for (size_t p = 0; p < kc; p++) {
+            vec_store_aligned(packed + p * NR, vec_load(b + p * ldb));
+            vec_store_aligned(packed + p * NR + VEC_WIDTH, vec_load(b + p * ldb + VEC_WIDTH));
+        }
+        return;
+    }
+
+    // Partial loads leave the padding lanes 0
+    size_t n0 = (cols < VEC_WIDTH) ? cols : VEC_WIDTH;
+    size_t n1 = cols - n0;
+    for (size_t p = 0; p < kc; p++) {
+        vec_store_aligned(packed + p * NR, vec_load_partial(b + p * ldb, n0));
+        vec_store_aligned(packed + p * NR + VEC_WIDTH,
+                          (n1 > 0) ? vec_load_partial(b + p * ldb + VEC_WIDTH, n1) : vec_zero());
+    }
+}
+
+// Bias and transpose
+
+static void add_bias(float *dst, const float *src, const float *bias, size_t n) {
+    size_t i = 0;
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        vec_store(dst + i, vec_add(vec_load(src + i), vec_load(bias + i)));
+    }
+    if (i < n) {
+        vec_store_partial(dst + i, vec_add(vec_load_partial(src + i, n - i),
+                                           vec_load_partial(bias + i, n - i)), n - i);
+    }
+}
+
+// VEC_WIDTH square blocks, walking along a strip of rows of src so the reads
+// stay sequential and each block's writes go to VEC_WIDTH rows of dst
+static void transpose_block(size_t rows, size_t cols, const float *src, size_t lds, float *dst, size_t ldd) {
+    size_t i = 0;
+    for (; i + VEC_WIDTH <= rows; i += VEC_WIDTH) {
+        size_t j = 0;
+        for (; j + VEC_WIDTH <= cols; j += VEC_WIDTH) {
+            vec_transpose(src + i * lds + j, lds, dst + j * ldd + i, ldd);
+        }
+        for (; j < cols; j++) {
+            for (size_t r = i; r < i + VEC_WIDTH; r++) {
+                dst[j * ldd + r] = src[r * lds + j];
+            }
+        }
+    }
+    for (; i < rows; i++) {
+        for (size_t j = 0; j < cols; j++) {
+            dst[j * ldd + i] = src[i * lds + j];
+        }
+    }
+}
+
+// Activations, branch free on the data
+
+// s'(x) = s(x) * (1 - s(x)), with 1 - s(x) = e * s(x) for e = exp(-x), which
+// doesn't cancel when s(x) is close to 1. Clamped like vec_sigmoid.
+static inline vec_t d_sigmoid(vec_t x) {
+    x = vec_min(vec_set1(SIGMOID_LIMIT), x);
+    x = vec_max(vec_set1(-SIGMOID_LIMIT), x);
+    vec_t e = vec_exp(vec_sub(vec_zero(), x));
+    vec_t s = vec_div(vec_set1(1.0f), vec_add(vec_set1(1.0f), e));
+    return vec_mul(s, vec_mul(e, s));
+}
+
+// x / (1 + |x|)
+static inline vec_t softsign(vec_t x) {
+    return vec_div(x, vec_add(vec_set1(1.0f), vec_abs(x)));
+}
+
+// 1 / (1 + |x|)^2
+static inline vec_t d_softsign(vec_t x) {
+    vec_t denominator = vec_add(vec_set1(1.0f), vec_abs(x));
+    return vec_div(vec_set1(1.0f), vec_mul(denominator, denominator));
+}
+
+static inline vec_t relu(vec_t x) {
+    return vec_max(x, vec_zero());
+}
+
+static inline vec_t d_relu(vec_t x) {
+    return vec_mask_zero(vec_cmp_gt(x, vec_zero()), vec_set1(1.0f));
+}
+
+// 1 - tanh(x)^2 = 4e / (1 + e)^2 for e = exp(-2|x|), which doesn't cancel
+// when tanh(x) is close to +-1
+static inline vec_t d_tanh(vec_t x) {
+    vec_t e = vec_exp(vec_mul(vec_abs(x), vec_set1(-2.0f)));
+    vec_t denominator = vec_add(vec_set1(1.0f), e);
+    return vec_div(vec_mul(e, vec_set1(4.0f)), vec_mul(denominator, denominator));
+}
+
+// max(x, alpha * x), which is leaky relu for any alpha below 1
+static inline vec_t leaky_relu(vec_t x) {
+    return vec_max(x, vec_mul(x, vec_set1(LEAKY_RELU_ALPHA)));
+}
+
+static inline vec_t d_leaky_relu(vec_t x) {
+    return vec_select(vec_cmp_gt(x, vec_zero()), vec_set1(LEAKY_RELU_ALPHA), vec_set1(1.0f));
+}
+
+#define DEFINE_SPAN(name, op)                                                    \
+    static void name(float *dst, const float *src, size_t n) {                  \
+        size_t i = 0;                                                            \
+        for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {                             \
+            vec_store(dst + i, op(vec_load(src + i)));                           \
+        }                                                                        \
+        if (i < n) {                                                             \
+            vec_store_partial(dst + i, op(vec_load_partial(src + i, n - i)), n - i); \
+        }                                                                        \
+    }
+
+DEFINE_SPAN(span_sigmoid, vec_sigmoid)
+DEFINE_SPAN(span_d_sigmoid, d_sigmoid)
+DEFINE_SPAN(span_softsign, softsign)
+DEFINE_SPAN(span_d_softsign, d_softsign)
+DEFINE_SPAN(span_relu, relu)
+DEFINE_SPAN(span_d_relu, d_relu)
+DEFINE_SPAN(span_tanh, vec_tanh)
+DEFINE_SPAN(span_d_tanh, d_tanh)
+DEFINE_SPAN(span_leaky_relu, leaky_relu)
+DEFINE_SPAN(span_d_leaky_relu, d_leaky_relu)
+DEFINE_SPAN(span_exp, vec_exp)
+DEFINE_SPAN(span_log, vec_log)
+
+static size_t argmax(const float *src, size_t n, float *max) {
+    assert(n > 0);
+    vec_t lanes = vec_set1(-FLT_MAX);
+    size_t i = 0;
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        lanes = vec_max(lanes, vec_load(src + i));
+    }
+    if (i < n) {
+        vec_t tail = vec_load_partial(src + i, n - i);
+        lanes = vec_max(lanes, vec_select(vec_tail_mask(n - i), lanes, tail));
+    }
+    float largest = vec_reduce_max(lanes);
+
+    size_t index = 0;
+    while (index < n - 1 && src[index] != largest) {
+        index++;
+    }
+    if (max != NULL) {
+        *max = largest;
+    }
+    return index;
+}
+
+// exp(x - max) is at most 1, so nothing overflows however large the inputs are
+static size_t softmax(float *dst, const float *src, size_t n) {
+    float largest;
+    size_t index = argmax(src, n, &largest);
+    vec_t max = vec_set1(largest);
+
+    vec_t sum = vec_zero();
+    size_t i = 0;
+    for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        vec_t e = vec_exp(vec_sub(vec_load(src + i), max));
+        vec_store(dst + i, e);
+        sum = vec_add(sum, e);
+    }
+    if (i < n) {
+        vec_t e = vec_exp(vec_sub(vec_load_partial(src + i, n - i), max));
+        e = vec_mask_zero(vec_tail_mask(n - i), e);
+        vec_store_partial(dst + i, e, n - i);
+        sum = vec_add(sum, e);
+    }
+
+    vec_t scale = vec_set1(1.0f / vec_reduce_sum(sum));
+    for (i = 0; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+        vec_store(dst + i, vec_mul(vec_load(dst + i), scale));
+    }
+    if (i < n) {
+        vec_store_partial(dst + i, vec_mul(vec_load_partial(dst + i, n - i), scale), n - i);
+    }
+    return index;
+}
+
+// Losses. Each takes expected values y and actual values p, returns the loss
+// of each lane, and puts the gradient with respect to p, times scale, into
+// gradient.
+
+static inline vec_t sign(vec_t x) {
+    vec_t one = vec_set1(1.0f);
+    return vec_sub(vec_mask_zero(vec_cmp_gt(x, vec_zero()), one),
+                   vec_mask_zero(vec_cmp_lt(x, vec_zero()), one));
+}
+
+// (p - y)^2
+static inline vec_t loss_mse(vec_t y, vec_t p, vec_t scale, vec_t *gradient) {
+    vec_t difference = vec_sub(p, y);
+    *gradient = vec_mul(vec_add(scale, scale), difference);
+    return vec_mul(difference, difference);
+}
+
+// |p - y|
+static inline vec_t loss_mae(vec_t y, vec_t p, vec_t scale, vec_t *gradient) {
+    vec_t difference = vec_sub(p, y);
+    *gradient = vec_mul(scale, sign(difference));
+    return vec_abs(difference);
+}
+
+// Quadratic above the threshold, linear below it
+static inline vec_t loss_hubler(vec_t y, vec_t p, vec_t scale, vec_t *gradient) {
+    const vec_t threshold = vec_set1(HUBLER_THRESHOLD);
+    vec_t error = vec_sub(y, p);
+    vmask_t quadratic = vec_cmp_gt(vec_abs(error), threshold);
+
+    vec_t quadratic_loss = vec_mul(vec_mul(error, error), vec_set1(0.5f));
+    vec_t linear_loss = vec_fmsub(threshold, vec_abs(error),
+                                  vec_set1(HUBLER_THRESHOLD * HUBLER_THRESHOLD / 2.0f));
+    vec_t quadratic_gradient = vec_sub(vec_zero(), error);
+    vec_t linear_gradient = vec_mul(vec_set1(-HUBLER_THRESHOLD), sign(error));
+    *gradient = vec_mul(scale, vec_select(quadratic, linear_gradient, quadratic_gradient));
+    return vec_select(quadratic, linear_loss, quadratic_loss);
+}
+
+// y log(p) + (1 - y) log(1 - p). p is kept inside (0, 1) so both logs are finite.
+static inline vec_t loss_log(vec_t y, vec_t p, vec_t scale, vec_t *gradient) {
+    const vec_t one = vec_set1(1.0f);
+    p = vec_max(p, vec_set1(FLT_MIN));
+    p = vec_min(p, vec_set1(1.0f - FLT_EPSILON / 2.0f));
+    vec_t q = vec_sub(one, p);
+    *gradient = vec_mul(scale, vec_div(vec_sub(p, y), vec_mul(p, q)));
+    return vec_fmadd(y, vec_log(p), vec_mul(vec_sub(one, y), vec_log(q)));
+}
+
+// y log(p), with p at least FLT_MIN so zero probabilities stay finite
+static inline vec_t loss_categorical(vec_t y, vec_t p, vec_t scale, vec_t *gradient) {
+    p = vec_max(p, vec_set1(FLT_MIN));
+    *gradient = vec_mul(scale, vec_div(y, p));
+    return vec_mul(y, vec_log(p));
+}
+
+// Softmax + cross entropy, the gradient with respect to the logits is p - y
+static inline vec_t loss_categorical_softmax(vec_t y, vec_t p, vec_t scale, vec_t *gradient) {
+    *gradient = vec_mul(scale, vec_sub(p, y));
+    return vec_mul(y, vec_log(vec_max(p, vec_set1(FLT_MIN))));
+}
+
+// Sums the loss of n elements in lane order and writes their gradient, unless
+// gradient is NULL. The loop is written out twice so the loss only pass
+// doesn't compute the gradient at all.
+#define DEFINE_CHUNK(name, op)                                                           \
+    static float name(const float *y, const float *p, float *gradient, size_t n,       \
+                      float scale_value) {                                               \
+        vec_t scale = vec_set1(scale_value);                                             \
+        vec_t sum = vec_zero();                                                          \
+        vec_t lane_gradient;                                                             \
+        size_t i = 0;                                                                    \
+        if (gradient != NULL) {                                                          \
+            for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {                                 \
+                sum = vec_add(sum, op(vec_load(y + i), vec_load(p + i), scale, &lane_gradient)); \
+                vec_store(gradient + i, lane_gradient);                                  \
+            }                                                                            \
+        } else {                                                                         \
+            for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {                                 \
+                sum = vec_add(sum, op(vec_load(y + i), vec_load(p + i), scale, &lane_gradient)); \
+            }                                                                            \
+        }                                                                                \
+        if (i < n) {                                                                     \
+            vec_t loss = op(vec_load_partial(y + i, n - i), vec_load_partial(p + i, n - i), \
+                            scale, &lane_gradient);                                      \
+            sum = vec_add(sum, vec_mask_zero(vec_tail_mask(n - i), loss));               \
+            if (gradient != NULL) {                                                      \
+                vec_store_partial(gradient + i, lane_gradient, n - i);                   \
+            }                                                                            \
+        }                                                                                \
+        return vec_reduce_sum(sum);                                                      \
+    }
+
+DEFINE_CHUNK(chunk_mse, loss_mse)
+DEFINE_CHUNK(chunk_mae, loss_mae)
+DEFINE_CHUNK(chunk_hubler, loss_hubler)
+DEFINE_CHUNK(chunk_log, loss_log)
+DEFINE_CHUNK(chunk_categorical, loss_categorical)
+DEFINE_CHUNK(chunk_categorical_softmax, loss_categorical_softmax)
+
+const kernel_table_t KERNEL_TABLE = {
+    .isa = KERNEL_ISA,
+    .name = KERNEL_NAME,
+
+    .gemm_mr = MR,
+    .gemm_nr = NR,
+    .gemm_micro_kernel = gemm_micro_kernel,
+    .gemm_edge_kernel = gemm_edge_kernel,
+    .gemm_pack_b = gemm_pack_b,
+
+    .add_bias = add_bias,
+    .transpose = transpose_block,
+
+    .activation = {
+        [SIGMOID] = span_sigmoid,
+        [SOFTSIGN] = span_softsign,
+        [RELU] = span_relu,
+        [TANH] = span_tanh,
+        [LEAKY_RELU] = span_leaky_relu,
+    },
+    .activation_derivative = {
+        [SIGMOID] = span_d_sigmoid,
+        [SOFTSIGN] = span_d_softsign,
+        [RELU] = span_d_relu,
+        [TANH] = span_d_tanh,
+        [LEAKY_RELU] = span_d_leaky_relu,
+    },
+    .exp = span_exp,
+    .log = span_log,
+    .argmax = argmax,
+    .softmax = softmax,
+
+    .loss = {
+        [MSE] = chunk_mse,
+        [MAE] = chunk_mae,
+        [HUBLER] = chunk_hubler,
+        [LOG] = chunk_log,
+        [CATEGORICAL] = chunk_categorical,
+    },
+    .loss_softmax = chunk_categorical_softmax,
+};
@@ -0,0 +1,88 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "../train/activation.h"
+#include "../train/loss.h"
+
+// The hot kernels are written once, in kernels/impl.h, and compiled once per
+// instruction set (kernels/sse2.c, avx2.c, avx512.c), each with its own flags.
+// The rest of the code is built for plain x86-64 and calls them through the
+// table returned by kernels(), which is picked on first use from what the CPU
+// supports. Setting NN_ISA to sse2, avx2 or avx512 forces a lower variant.
+
+// In order of preference
+typedef enum { ISA_SSE2, ISA_AVX2, ISA_AVX512, NUM_ISAS } isa_t;
+
+#define NUM_ACTIVATIONS (LEAKY_RELU + 1)
+#define NUM_LOSSES (CATEGORICAL + 1)
+
+// Sums the loss of n values, and writes their gradient times scale into
+// gradient unless it is NULL
+typedef float (*loss_chunk_t)(const float *y, const float *p, float *gradient, size_t n, float scale);
+
+typedef struct {
+    isa_t isa;
+    const char *name;
+
+    // Packed GEMM, see gemm.c. The micro-kernel computes a full mr x nr tile of
+    // C from an mr tall panel of A and an nr wide panel of B, adding it to C
+    // when accumulate is set, and adding bias (nr values) unless it is NULL.
+    size_t gemm_mr;
+    size_t gemm_nr;
+    void (*gemm_micro_kernel)(size_t kc, const float *a, const float *b, float *c, size_t ldc,
+                              bool accumulate, const float *bias);
+    // The same for a tile on the edge of C, writing only its top left rows x
+    // cols. The panels are zero padded past the edge, as gemm_pack_b leaves them.
+    void (*gemm_edge_kernel)(size_t kc, const float *a, const float *b, float *c, size_t ldc,
+                             bool accumulate, const float *bias, size_t rows, size_t cols);
+    // Packs cols (at most nr) columns of a kc deep slice of B into one nr wide
+    // panel, zero padding the rest. packed is 64 byte aligned.
+    void (*gemm_pack_b)(size_t kc, size_t cols, const float *b, size_t ldb, float *packed);
+
+    // dst = src + bias over n values, dst may equal src
+    void (*add_bias)(float *dst, const float *src, const float *bias, size_t n);
+    // Writes the transpose of the rows x cols block at src into dst
+    void (*transpose)(size_t rows, size_t cols, const float *src, size_t lds, float *dst, size_t ldd);
+
+    // Element-wise, see train/activation.h
+    activation_span_t activation[NUM_ACTIVATIONS];
+    activation_span_t activation_derivative[NUM_ACTIVATIONS];
+    // vec_exp and vec_log of include/simd_math.h, which the activations, softmax
+    // and losses are built on. Only called directly by tools/check.c.
+    activation_span_t exp;
+    activation_span_t log;
+    size_t (*argmax)(const float *src, size_t n, float *max);
+    size_t (*softmax)(float *dst, const float *src, size_t n);
+
+    // Indexed by loss_func_t. loss_softmax is CATEGORICAL with the gradient
+    // taken with respect to the logits of a softmax output.
+    loss_chunk_t loss[NUM_LOSSES];
+    loss_chunk_t loss_softmax;
+} kernel_table_t;
+
+extern const kernel_table_t kernels_sse2;
+extern const kernel_table_t kernels_avx2;
+extern const kernel_table_t kernels_avx512;
+
+// The kernels in use, chosen the first time this is called
+const kernel_table_t *kernels(void);
+
+// Switches to the kernels for isa, or for the best ISA the CPU has if it lacks
+// isa, and returns them. Only for when nothing else is running: benchmarks and
+// tests comparing ISAs. The GEMM blocking depends on the register tile, so
+// gemm_set_blocking needs calling again after switching.
+const kernel_table_t *select_kernels(isa_t isa);
+
+// The best instruction set the CPU and OS support, ignoring NN_ISA
+isa_t cpu_isa(void);
+
+const char *isa_name(isa_t isa);
+
+// Exits with a message naming the feature if the CPU doesn't support isa. For
+// code outside the dispatched kernels that is only built for one ISA.
+void require_isa(isa_t isa, const char *feature);
+
+#endif
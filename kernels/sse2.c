@@ -0,0 +1,6 @@
+// The baseline build, for any x86-64 CPU. Compiled without extra flags.
+#define KERNEL_TABLE kernels_sse2
+#define KERNEL_ISA ISA_SSE2
+#define KERNEL_NAME "sse2"
+
+#include "impl.h"
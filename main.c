@@ -1,24 +1,29 @@
 #include "matrix.h"
 #include "neural_network.h"
 #include "parse_csv.h"
+#include "thread_pool.h"
 #include "train/activation.h"
 
 int main() {
     determine_cache(); 
+    thread_pool_init(0);
     size_t num_parameters = 784;
     size_t num_samples = 10000;
     size_t num_classes = 10;
+    size_t max_batch_size = 1024;
     
     size_t layer_info[] = {num_parameters, 256, 128, num_classes};
     size_t num_layers = sizeof(layer_info) / sizeof(size_t);
 
 
-    create_network(layer_info, num_layers);
+    network_t *network = create_network(layer_info, num_layers, max_batch_size);
 
     printf("Created network\n");
 
     matrix_t inputs = random_matrix(num_samples, num_parameters);
-    result_t* predictions = predict(inputs);
+    result_t *predictions = malloc(num_samples * sizeof(result_t));
+    float *distributions = malloc(num_samples * num_classes * sizeof(float));
+    predict(network, inputs, predictions, distributions);
 
     for (size_t i = 0; i < num_samples; i++) {
         printf("%zu\n", predictions[i].prediction);
@@ -28,5 +33,10 @@ int main() {
         printf("\n");
     }
 
+    free_matrix(inputs);
+    free(predictions);
+    free(distributions);
+    free_network(network);
+    thread_pool_shutdown();
     return 0;
 }
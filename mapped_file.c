@@ -0,0 +1,99 @@
+#include "mapped_file.h"
+
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+bool map_file(const char *filename, bool copy_on_write, mapped_file_t *file) {
+    file->data = NULL;
+    file->size = 0;
+    file->mapping = NULL;
+    file->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file->file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file->file, &size)) {
+        CloseHandle(file->file);
+        return false;
+    }
+    file->size = (size_t)size.QuadPart;
+    if (file->size == 0) {
+        return true; // Nothing to map
+    }
+
+    file->mapping = CreateFileMappingA(file->file, NULL,
+                                       copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY,
+                                       0, 0, NULL);
+    if (file->mapping == NULL) {
+        CloseHandle(file->file);
+        return false;
+    }
+    file->data = MapViewOfFile(file->mapping, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+    if (file->data == NULL) {
+        CloseHandle(file->mapping);
+        CloseHandle(file->file);
+        return false;
+    }
+    return true;
+}
+
+void unmap_file(mapped_file_t *file) {
+    if (file->data != NULL) {
+        UnmapViewOfFile(file->data);
+    }
+    if (file->mapping != NULL) {
+        CloseHandle(file->mapping);
+    }
+    CloseHandle(file->file);
+    file->data = NULL;
+    file->size = 0;
+}
+#else
+bool map_file(const char *filename, bool copy_on_write, mapped_file_t *file) {
+    file->data = NULL;
+    file->size = 0;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return false;
+    }
+    file->size = (size_t)info.st_size;
+    if (file->size == 0) {
+        close(fd);
+        return true; // Nothing to map
+    }
+
+    int protection = copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *data = mmap(NULL, file->size, protection, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps its own reference to the file
+    if (data == MAP_FAILED) {
+        file->size = 0;
+        return false;
+    }
+    file->data = data;
+    return true;
+}
+
+void unmap_file(mapped_file_t *file) {
+    if (file->data != NULL) {
+        munmap(file->data, file->size);
+    }
+    file->data = NULL;
+    file->size = 0;
+}
+#endif
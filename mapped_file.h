@@ -0,0 +1,28 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// A whole file mapped into memory
+typedef struct {
+    void *data;
+    size_t size;
+    #ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+    #endif
+} mapped_file_t;
+
+// Maps filename into memory. Read only mappings share their pages with the
+// page cache. Copy on write mappings share them too, until a page is written,
+// at which point it becomes private to this process and the file is untouched.
+// Returns false (with errno/GetLastError set) if the file can't be mapped.
+bool map_file(const char *filename, bool copy_on_write, mapped_file_t *file);
+void unmap_file(mapped_file_t *file);
+
+#endif
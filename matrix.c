@@ -1,15 +1,18 @@
 #include "matrix.h"
 
 #include <assert.h>
-#include <immintrin.h>
 #include <math.h>
-#include "include/threads.h"
+#include "gemm.h"
+#include "kernels/kernels.h"
+#include "numa.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include <immintrin.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <stdint.h>
 
-extern size_t tile_size;
-
 // Structure to pass arguments to the thread function.
 // Struct originally designed for use in 1 function,
 // but now we are using it in multiple, with some struct
@@ -22,35 +25,81 @@ typedef struct {
     size_t start_col;
 } thread_args_t;
 
-// Returns an m x n matrix, initialised to zero
-matrix_t zeroes(const size_t m, const size_t n) {
+matrix_t matrix_view(float *values, size_t m, size_t n, size_t stride) {
+    assert(stride >= n || m <= 1);
+    matrix_t view;
+    view.values = values;
+    view.m = m;
+    view.n = n;
+    view.stride = stride;
+    view.padded = false;
+    return view;
+}
+
+matrix_t matrix_rows(matrix_t matrix, size_t first, size_t count) {
+    assert(first + count <= matrix.m);
+    matrix_t rows = matrix_view(matrix_row(matrix, first), count, matrix.n, matrix.stride);
+    rows.padded = matrix.padded;
+    return rows;
+}
+
+matrix_t matrix_columns(matrix_t matrix, size_t first, size_t count) {
+    assert(first + count <= matrix.n);
+    return matrix_view(matrix.values + first, matrix.m, count, matrix.stride);
+}
+
+matrix_t matrix_alloc(const size_t m, const size_t n) {
     matrix_t matrix;
     matrix.m = m;
     matrix.n = n;
-    matrix.values = (float *)calloc(m * n, sizeof(float));
+    matrix.stride = matrix_padded_stride(n);
+    matrix.padded = true;
+    size_t count = m * matrix.stride;
+    matrix.values = (float *)_mm_malloc((count > 0 ? count : 1) * sizeof(float), MATRIX_ALIGNMENT);
     assert(matrix.values != NULL);
 
+    // Whole padded rows go through the element-wise kernels, keep what they
+    // read there finite
+    if (matrix.stride > n) {
+        for (size_t i = 0; i < m; i++) {
+            memset(matrix_row(matrix, i) + n, 0, (matrix.stride - n) * sizeof(float));
+        }
+    }
     return matrix;
 }
 
-// Returns an m x n matrix initialised to random values between -1 and 1
-matrix_t random_matrix(const size_t m, const size_t n) {
-    srand(time(NULL));
-
+// Returns an m x n matrix, initialised to zero. Large matrices are placed
+// on the NUMA nodes by NN_NUMA (see numa.h).
+matrix_t zeroes(const size_t m, const size_t n) {
     matrix_t matrix;
     matrix.m = m;
     matrix.n = n;
-    matrix.values = (float *)malloc(m * n * sizeof(float));
+    matrix.stride = matrix_padded_stride(n);
+    matrix.padded = true;
+    matrix.values = (float *)placed_calloc(m * matrix.stride, sizeof(float));
     assert(matrix.values != NULL);
 
+    return matrix;
+}
+
+// Returns an m x n matrix initialised to random values between -1 and 1
+matrix_t random_matrix(const size_t m, const size_t n) {
+    srand(time(NULL));
+
+    matrix_t matrix = matrix_alloc(m, n);
     for (size_t i = 0; i < m; i++) {
+        float *row = matrix_row(matrix, i);
         for (size_t j = 0; j < n; j++) {
-            matrix.values[i * n + j] = (float)rand() / (float)RAND_MAX;
+            row[j] = (float)rand() / (float)RAND_MAX;
         }
     }
     return matrix;
 }
 
+void free_matrix(matrix_t matrix) {
+    _mm_free(matrix.values);
+}
+
 // Private helper function
 static inline float float_abs(float num) {
     return (num < 0) ? -num : num;
@@ -61,8 +110,9 @@ void normalise(matrix_t matrix) {
     float max = float_abs(matrix.values[0]);
 
     for (size_t i = 0; i < matrix.m; i++) {
+        const float *row = matrix_row(matrix, i);
         for (size_t j = 0; j < matrix.n; j++) {
-            float num = float_abs(matrix.values[i * matrix.n + j]);
+            float num = float_abs(row[j]);
             max = (num > max) ? num : max;
         }
     }
@@ -70,195 +120,95 @@ void normalise(matrix_t matrix) {
         return;
     }
     for (size_t i = 0; i < matrix.m; i++) {
+        float *row = matrix_row(matrix, i);
         for (size_t j = 0; j < matrix.n; j++) {
-            matrix.values[i * matrix.n + j] /= max;
+            row[j] /= max;
         }
     }
 }
 
-static THREAD_ENTRY parallel_row_adder(thread_func_param_t arg) {
-    thread_args_t args = *(thread_args_t *)arg;
-    float* matrix_values = args.a->values;
-    float* vector_values = args.b->values;
-    float* result_values = args.c->values;
+static void parallel_row_adder(void *context, size_t start, size_t end) {
+    thread_args_t args = *(thread_args_t *)context;
+    const kernel_table_t *kernel = kernels();
+
+    // When all three own the same padding, whole rows are added with no tail
     size_t n = args.a->n;                      // Equivalent to args.b->n
-    size_t starting_cell = args.start_row * n; // The row to apply the addition on
-    
-    /*
-    for (size_t i = 0; i < n; i++) {
-        result_values[starting_cell + i] = matrix_values[starting_cell + i] + vector_values[i];
-    }
-    */
-    // size_t end_cell = (args.start_row + 1) * n;
-    // size_t i = args.start_row * n;
-    size_t i = 0;
-    for (; i < n - 7; i += 8) {
-        size_t offset = starting_cell + i;
-        result_values[offset] = matrix_values[offset] + vector_values[i];
-        result_values[offset + 1] = matrix_values[offset + 1] + vector_values[i + 1];
-        result_values[offset + 2] = matrix_values[offset + 2] + vector_values[i + 2];
-        result_values[offset + 3] = matrix_values[offset + 3] + vector_values[i + 3];
-        result_values[offset + 4] = matrix_values[offset + 4] += vector_values[i + 4];
-        result_values[offset + 5] = matrix_values[offset + 5] + vector_values[i + 5];
-        result_values[offset + 6] = matrix_values[offset + 6] += vector_values[i + 6];
-        result_values[offset + 7] = matrix_values[offset + 7] += vector_values[i + 7];
+    if (matrix_flat_size(*args.a, *args.c) == args.a->m * args.a->stride &&
+        args.b->padded && args.b->stride == args.a->stride) {
+        n = args.a->stride;
     }
 
-    for (; i < n; i++) {
-        result_values[starting_cell + i] = matrix_values[starting_cell + i] + vector_values[i];
+    for (size_t row = start; row < end; row++) {
+        kernel->add_bias(matrix_row(*args.c, row), matrix_row(*args.a, row), args.b->values, n);
     }
-    
-    return (thread_func_return_t)(uintptr_t)NULL;
 }
 
-// Add a vector row-wise to a matrix, to each row
-matrix_t matrix_add_vector(matrix_t matrix, matrix_t vector) {
+void matrix_add_vector_into(matrix_t dst, matrix_t matrix, matrix_t vector) {
     assert((matrix.n == vector.n) && vector.m == 1);
+    assert(dst.m == matrix.m && dst.n == matrix.n);
 
-    #ifdef _WIN32
-    thread_t *threads =  malloc(matrix.m *sizeof(thread_t));
-    thread_args_t *args =  malloc(matrix.m * sizeof(thread_args_t));
-    #else
-    thread_t threads[matrix.m];
-    thread_args_t args[matrix.m];
-    #endif
-
-    matrix_t result = zeroes(matrix.m, matrix.n);
-    for (size_t i = 0; i < matrix.m; i++) {
-        args[i].a = &matrix;
-        args[i].b = &vector;
-        args[i].c = &result; 
-        args[i].start_row = i;
-        args[i].start_col = -1; // We don't need this
-        
-        THREAD_CREATE(threads[i], parallel_row_adder, &args[i]);
-    }
-
-    THREAD_JOIN_AND_CLOSE(threads, matrix.m);
+    double trace_start_time = trace_begin();
+    thread_args_t args;
+    args.a = &matrix;
+    args.b = &vector;
+    args.c = &dst;
+    args.start_row = 0; // We don't need these, the pool hands out the rows
+    args.start_col = 0;
 
-    printf("Broke out\n");
+    parallel_for(matrix.m, 0, parallel_row_adder, &args);
 
-    #ifdef _WIN32
-    free(threads);
-    free(args);
-    #endif
+    trace_end(trace_start_time, "bias", "bias",
+              (trace_args_t){.m = matrix.m, .n = matrix.n, .bytes = (2 * matrix.m + 1) * matrix.n * sizeof(float)});
+}
 
+// Add a vector row-wise to a matrix, to each row
+matrix_t matrix_add_vector(matrix_t matrix, matrix_t vector) {
+    matrix_t result = matrix_alloc(matrix.m, matrix.n);
+    matrix_add_vector_into(result, matrix, vector);
     return result;
 }
 
-// Returns the transpose of a matrix
-matrix_t transpose(matrix_t original) {
-    matrix_t transposed = zeroes(original.n, original.m);
+// Rows of the original per parallel_for chunk, transposed a block at a time
+#define TRANSPOSE_GRAIN 64
 
-    for (size_t i = 0; i < original.m; i++) {
-        for (size_t j = 0; j < original.n; j++) {
-            transposed.values[j * transposed.n + i] =
-                original.values[i * original.n + j];
-        }
-    }
-    return transposed;
+static void parallel_transposer(void *context, size_t start, size_t end) {
+    thread_args_t args = *(thread_args_t *)context;
+    kernels()->transpose(end - start, args.a->n, matrix_row(*args.a, start), args.a->stride,
+                         args.c->values + start, args.c->stride);
 }
 
-// Function to compute the product of a tile using AVX
-static THREAD_ENTRY compute_tile(thread_func_param_t arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    matrix_t *c = args->c;
-    size_t start_row = args->start_row;
-    size_t start_col = args->start_col;
-
-    // Compute the product of the tile
-    for (size_t i = start_row; i < start_row + tile_size && i < a->m; i++) {
-        for (size_t j = start_col; j < start_col + tile_size && j < b->n; j++) {
-            __m256 sum_vec = _mm256_setzero_ps(); // Initialize AVX vector for accumulation
-            float sum = 0.0f;
-
-            // Process 8 elements at a time using AVX
-            size_t k = 0;
-            for (; k <= a->n - 8; k += 8) {
-                __m256 a_vec = _mm256_loadu_ps(
-                    &a->values[i * a->n + k]); // Load 8 elements from matrix A
-                __m256 b_vec = _mm256_set_ps(
-                    b->values[(k + 7) * b->n + j],
-                    b->values[(k + 6) * b->n + j],
-                    b->values[(k + 5) * b->n + j],
-                    b->values[(k + 4) * b->n + j],
-                    b->values[(k + 3) * b->n + j],
-                    b->values[(k + 2) * b->n + j],
-                    b->values[(k + 1) * b->n + j],
-                    b->values[k * b->n + j]); // Load 8 elements from matrix B
-                sum_vec = _mm256_fmadd_ps(
-                    a_vec, b_vec,
-                    sum_vec); //_mm256_fmadd_ps(a_vec, b_vec,
-                              // sum_vec); // Multiply and accumulate
-            }
-
-            // Sum the elements of the AVX vector
-            float temp[8];
-            _mm256_storeu_ps(temp, sum_vec);
-            for (size_t t = 0; t < 8; t++) {
-                sum += temp[t];
-            }
+void transpose_into(matrix_t dst, matrix_t original) {
+    assert(dst.m == original.n && dst.n == original.m);
+    assert(dst.values != original.values || original.m * original.n == 0);
 
-            // Process remaining elements
-            for (; k < a->n; k++) {
-                sum += a->values[i * a->n + k] * b->values[k * b->n + j];
-            }
+    thread_args_t args;
+    args.a = &original;
+    args.b = NULL;
+    args.c = &dst;
+    args.start_row = 0;
+    args.start_col = 0;
 
-            c->values[i * c->n + j] = sum; // Store the result
-        }
-    }
+    parallel_for(original.m, TRANSPOSE_GRAIN, parallel_transposer, &args);
+}
 
-    return (thread_func_return_t)(uintptr_t)NULL;
+// Returns the transpose of a matrix
+matrix_t transpose(matrix_t original) {
+    matrix_t transposed = matrix_alloc(original.n, original.m);
+    transpose_into(transposed, original);
+    return transposed;
 }
 
-// Function to multiply two matrices using tiles, threads, and AVX
-matrix_t matrix_tile_multiply(matrix_t a, matrix_t b) {
-    // printf("%zu %zu |  %zu %zu\n", a.n, a.m, b.n, b.m);
+void matrix_tile_multiply_into(matrix_t c, matrix_t a, matrix_t b) {
     assert(a.n == b.m);
+    assert(c.m == a.m && c.n == b.n);
+    gemm(a.m, b.n, a.n, a.values, a.stride, b.values, b.stride, c.values, c.stride);
+}
 
+// Multiplies two matrices with the packed, cache blocked GEMM in gemm.c
+matrix_t matrix_tile_multiply(matrix_t a, matrix_t b) {
     // Create the result matrix
-    matrix_t c;
-    c.m = a.m;
-    c.n = b.n;
-    c.values = (float *)malloc(c.m * c.n * sizeof(float));
-    assert(c.values != NULL);
-
-    // Calculate the number of tiles
-    size_t num_tiles_row = (a.m + tile_size - 1) / tile_size;
-    size_t num_tiles_col = (b.n + tile_size - 1) / tile_size;
-
-    // Create threads for each tile
-    #ifdef _WIN32
-    thread_t *threads = malloc(num_tiles_row * num_tiles_col *sizeof(thread_t));
-    thread_args_t *args = malloc(num_tiles_row * num_tiles_col * sizeof(thread_args_t));
-    #else
-    thread_t threads[num_tiles_row * num_tiles_col];
-    thread_args_t args[num_tiles_row * num_tiles_col];
-    #endif
-
-    // Initialize thread arguments and create threads
-    for (size_t i = 0; i < num_tiles_row; i++) {
-        for (size_t j = 0; j < num_tiles_col; j++) {
-            // Create the thread arguments
-            args[i * num_tiles_col + j].a = &a;
-            args[i * num_tiles_col + j].b = &b;
-            args[i * num_tiles_col + j].c = &c;
-            args[i * num_tiles_col + j].start_row = i * tile_size;
-            args[i * num_tiles_col + j].start_col = j * tile_size;
-
-            THREAD_CREATE(threads[i * num_tiles_col + j],  compute_tile, &args[i * num_tiles_col + j]);
-        }
-    }
-
-    THREAD_JOIN_AND_CLOSE(threads, num_tiles_row * num_tiles_col);
-
-    #ifdef _WIN32
-    free(threads);
-    free(args);
-    #endif
-
+    matrix_t c = matrix_alloc(a.m, b.n);
+    matrix_tile_multiply_into(c, a, b);
     return c;
 }
 
@@ -270,30 +220,53 @@ float multiply(float x, float y) {
     return x * y;
 }
 
-// Takes in either 1 or 2 matrices (pass in b as NULL if only passing in 1 matrix).
-// Scalar ignored if 2 matrices passed in
-matrix_t matrix_apply(matrix_t* a, matrix_t* b, const float scalar, float (*function)(float, float)) {
+void matrix_apply_into(matrix_t result, matrix_t* a, matrix_t* b, const float scalar,
+                       float (*function)(float, float)) {
     assert(a != NULL);
-    matrix_t result = zeroes(a->m, a->n);
+    assert(result.m == a->m && result.n == a->n);
 
     // We want to do a scalar multiplication, or addition of a constant to the whole matrix
+    size_t flat = matrix_flat_size(*a, result);
+    if (b == NULL && flat != 0) {
+        for (size_t i = 0; i < flat; i++) {
+            result.values[i] = function(a->values[i], scalar);
+        }
+        return;
+    }
     if (b == NULL) {
         for (size_t i = 0; i < a->m; i++) {
+            const float *a_row = matrix_row(*a, i);
+            float *result_row = matrix_row(result, i);
             for (size_t j = 0; j < a->n; j++) {
-                size_t index = i * a->n + j;
-                result.values[index] = function(a->values[index], scalar);
+                result_row[j] = function(a_row[j], scalar);
             }
         }
-        return result;
+        return;
     }
 
     assert((a-> m == b->m) && (a->n == b->n));
+    if (flat != 0 && matrix_flat_size(*b, result) == flat) {
+        for (size_t i = 0; i < flat; i++) {
+            result.values[i] = function(a->values[i], b->values[i]);
+        }
+        return;
+    }
     for (size_t i = 0; i < a->m; i++) {
+        const float *a_row = matrix_row(*a, i);
+        const float *b_row = matrix_row(*b, i);
+        float *result_row = matrix_row(result, i);
         for (size_t j = 0; j < a->n; j++) {
-            size_t index = i * a->n + j;
-            result.values[index] = function(a->values[index], b->values[index]);
+            result_row[j] = function(a_row[j], b_row[j]);
         }
     }
+}
+
+// Takes in either 1 or 2 matrices (pass in b as NULL if only passing in 1 matrix).
+// Scalar ignored if 2 matrices passed in
+matrix_t matrix_apply(matrix_t* a, matrix_t* b, const float scalar, float (*function)(float, float)) {
+    assert(a != NULL);
+    matrix_t result = matrix_alloc(a->m, a->n);
+    matrix_apply_into(result, a, b, scalar, function);
     return result;
 }
 
@@ -303,9 +276,9 @@ void print_matrix(matrix_t matrix) {
         printf("| ");
         for (size_t j = 0; j < matrix.n; j++) {
             if (j < matrix.n - 1) {
-                printf("%.2f   ", matrix.values[i * matrix.n + j]);
+                printf("%.2f   ", matrix_row(matrix, i)[j]);
             } else {
-                printf("%.2f ", matrix.values[i * matrix.n + j]);
+                printf("%.2f ", matrix_row(matrix, i)[j]);
             }
         }
         printf("|\n");
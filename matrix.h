@@ -1,16 +1,76 @@
 #ifndef MATRIX_H
 #define MATRIX_H
 
+#include <stdbool.h>
 #include <stdlib.h>
 
+// Matrices allocated here start on a 64 byte boundary (a cache line, and one
+// AVX-512 vector), and their rows are padded to stride = matrix_padded_stride(n)
+#define MATRIX_ALIGNMENT 64
+
 typedef struct {
     float* values; // Using a 1D array to simulate a matrix
     size_t m; // Number of rows
     size_t n; // Number of columns
+    size_t stride; // Floats from the start of one row to the next, at least n
+    bool padded; // Columns n to stride belong to this matrix, kernels may overwrite them
 } matrix_t;
 
+// Rows of more than 8 floats are rounded up to whole cache lines (16 floats),
+// so every row starts aligned and none shares a line with the next. Narrower
+// rows are rounded up to a power of two instead, so m x 1 vectors stay dense.
+static inline size_t matrix_padded_stride(size_t n) {
+    if (n > 8) {
+        return (n + 15) / 16 * 16;
+    }
+    size_t stride = (n > 0) ? 1 : 0;
+    while (stride < n) {
+        stride *= 2;
+    }
+    return stride;
+}
+
+// Row i of a matrix
+static inline float *matrix_row(matrix_t matrix, size_t i) {
+    return matrix.values + i * matrix.stride;
+}
+
+// Whether the rows follow each other with no gaps, so the values can be
+// treated as one array of m * n
+static inline bool matrix_is_contiguous(matrix_t matrix) {
+    return matrix.stride == matrix.n || matrix.m <= 1;
+}
+
+// Values element-wise kernels can sweep over a and b (the same shape) as flat
+// arrays: m * n when both are contiguous, or m * stride when both own the
+// padding of the same stride, which leaves no tail on the vector loops.
+// 0 when the rows have to be visited one at a time.
+static inline size_t matrix_flat_size(matrix_t a, matrix_t b) {
+    if (a.padded && b.padded && a.stride == b.stride) {
+        return a.m * a.stride;
+    }
+    if (matrix_is_contiguous(a) && matrix_is_contiguous(b)) {
+        return a.m * a.n;
+    }
+    return 0;
+}
+
+// Views look into the values of another matrix without copying them, and are
+// never freed themselves. Every function taking a matrix_t accepts views.
+// Rows of a padded matrix keep its padding, other views don't have any.
+matrix_t matrix_view(float *values, size_t m, size_t n, size_t stride);
+// Rows [first, first + count) of a matrix
+matrix_t matrix_rows(matrix_t matrix, size_t first, size_t count);
+// Columns [first, first + count) of a matrix
+matrix_t matrix_columns(matrix_t matrix, size_t first, size_t count);
+
+// Matrices returned by this library are aligned and padded, and freed with
+// free_matrix. matrix_alloc leaves the values uninitialised (the padding is
+// zeroed).
+matrix_t matrix_alloc(const size_t m, const size_t n);
 matrix_t zeroes(const size_t m, const size_t n);
 matrix_t random_matrix(const size_t m, const size_t n);
+void free_matrix(matrix_t matrix);
 void normalise(matrix_t matrix);
 matrix_t matrix_add_vector(matrix_t matrix, matrix_t vector);
 matrix_t transpose(matrix_t matrix);
@@ -18,6 +78,18 @@ matrix_t matrix_tile_multiply(matrix_t a, matrix_t b);
 float add(float x, float y);
 float multiply(float x, float y);
 matrix_t matrix_apply(matrix_t* a, matrix_t* b, const float scalar, float (*function)(float, float));
+
+// The same operations into dst, which has to have the shape of the result,
+// so loops can reuse their buffers instead of allocating every time. dst can
+// be a view. matrix_add_vector_into and matrix_apply_into work in place (dst
+// being matrix, a or b itself), but dst must not overlap the inputs in any
+// other way. transpose_into and matrix_tile_multiply_into need a dst of its
+// own.
+void matrix_add_vector_into(matrix_t dst, matrix_t matrix, matrix_t vector);
+void transpose_into(matrix_t dst, matrix_t matrix);
+void matrix_tile_multiply_into(matrix_t dst, matrix_t a, matrix_t b);
+void matrix_apply_into(matrix_t dst, matrix_t* a, matrix_t* b, const float scalar,
+                       float (*function)(float, float));
 void print_matrix(matrix_t matrix);
 void determine_cache(void);
 #endif
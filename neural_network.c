@@ -1,49 +1,139 @@
 #include "neural_network.h"
 #include <assert.h>
+#include <immintrin.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "dataset.h"
+#include "gemm.h"
+#include "hgemm.h"
+#include "include/random.h"
+#include "include/threads.h"
+#include "include/timer.h"
+#include "kernels/kernels.h"
+#include "mapped_file.h"
+#include "qgemm.h"
+#include "thread_pool.h"
+#include "trace.h"
 #include "train/activation.h"
-
-#define TILE_SIZE 8
+#include "train/loss.h"
+#include "tune.h"
 
 // Private struct for representing a single NN layer
 typedef struct {
-    matrix_t weights;
+    matrix_t weights;        // values is NULL while the weights are stored as halves
     matrix_t biases;
+    uint16_t *half_weights;  // weights.m x weights.n, unless the network is WEIGHTS_FLOAT32
 } layer_t;
 
-size_t tile_size = TILE_SIZE;
+// Int8 copy of a layer made by quantize_network
+typedef struct {
+    qweights_t weights;
+    float input_scale; // The layer's input is quantized as round(x / input_scale)
+} quantized_layer_t;
+
+// Scratch space for one predict call. Each network keeps a free list of
+// these, so concurrent calls each get their own, and steady state inference
+// doesn't touch the heap.
+typedef struct workspace {
+    float *buffers[2];      // Layer outputs ping-pong between these, max_batch x widest layer
+    int16_t *quantized_input; // Layer input of the int8 path, allocated on first use
+    struct workspace *next; // Next free workspace
+} workspace_t;
+
+struct network {
+    layer_t *layers;
+    size_t num_layers; // The number of layers, excluding input layer
+    activation_func_t activation;
+    weight_format_t weight_format;
+    tiling_t tiling;
+
+    size_t max_batch;  // Rows predict pushes through the layers at once
+    size_t max_width;  // Widest layer, sizes the workspace buffers
+    mutex_t workspace_lock;
+    workspace_t *free_workspaces;
 
-static layer_t *layers;
-static size_t num_layers = 0; // The number of layers, excluding input layer
-static activation_func_t activation = LEAKY_RELU;
+    // Set when the weights and biases point into a model loaded with load_network
+    mapped_file_t model_file;
+    bool weights_mapped;
+
+    // Set by quantize_network, predict then runs every layer in int8
+    quantized_layer_t *quantized;
+};
+
+// Model file layout, all little endian. Tensors use the same descriptors and
+// alignment as dataset.h, so the payloads can be used straight from the mapping:
+//
+//   model_header_t
+//   tensor_descriptor_t x 2 * num_layers   weights then biases of each layer
+//   zero padding up to 64 bytes
+//   each payload, rows x cols floats       starts on a 64 byte boundary
+#define MODEL_MAGIC "NNMODEL"
+#define MODEL_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_layers;  // Excluding the input layer
+    uint32_t activation;  // activation_func_t of the hidden layers
+    uint32_t reserved;
+} model_header_t;
 
-void create_network(size_t *layer_info, const size_t size_layer_info) {
+// Allocates a network around already filled in layers
+static network_t *wrap_layers(layer_t *layers, size_t num_layers, activation_func_t activation,
+                              weight_format_t weight_format, size_t max_batch_size) {
+    network_t *network = calloc(1, sizeof(network_t));
+    assert(network != NULL);
+    network->layers = layers;
+    network->num_layers = num_layers;
+    network->activation = activation;
+    network->weight_format = weight_format;
+    network->tiling.gemm = gemm_blocking;
+    network->tiling.elementwise_grain = current_tuning().elementwise_grain;
+
+    network->max_batch = max_batch_size;
+    network->max_width = 0;
+    for (size_t i = 0; i < num_layers; i++) {
+        size_t width = layers[i].weights.n;
+        network->max_width = (width > network->max_width) ? width : network->max_width;
+    }
+    MUTEX_INIT(network->workspace_lock);
+    network->free_workspaces = NULL;
+    network->weights_mapped = false;
+    network->quantized = NULL;
+    return network;
+}
+
+network_t *create_network(size_t *layer_info, const size_t size_layer_info, const size_t max_batch_size) {
     assert(size_layer_info >= 2); // Ensure there are at least input and output layers
+    assert(max_batch_size > 0);
 
-    num_layers = size_layer_info - 1;
+    size_t num_layers = size_layer_info - 1;
     // Subtract one because we don't need to store the input layer
-    layers = (layer_t *)malloc(num_layers * sizeof(layer_t)); // Allocate memory for layers
-    
+    layer_t *layers = (layer_t *)malloc(num_layers * sizeof(layer_t)); // Allocate memory for layers
+
     assert(layers != NULL);
 
     for (size_t i = 0; i < num_layers; i++) {
         // Create Biases - 1 column
-        layers[i].biases = zeroes(1, layer_info[i + 1]);  
+        layers[i].biases = zeroes(1, layer_info[i + 1]);
         assert(layers[i].biases.values != NULL);
 
         // Create weights matrix
         layers[i].weights = zeroes(layer_info[i], layer_info[i + 1]);
         assert(layers[i].weights.values != NULL);
- 
+        layers[i].half_weights = NULL;
+
         float stddev = sqrt(2.0 / layer_info[i]);  // Standard deviation for the initialization
         size_t num_rows = layers[i].weights.m;
         size_t num_cols = layers[i].weights.n;
 
         for (size_t j = 0; j < num_rows; j++) {
             for (size_t k = 0; k < num_cols; k++) {
-                layers[i].weights.values[j * num_cols + k] = 
+                matrix_row(layers[i].weights, j)[k] =
                     ((float)rand() / RAND_MAX) * 2.0 * stddev - stddev;
                 // layers[i].biases.values[k] = ((float) rand() / RAND_MAX) * 2
                 // * stddev - stddev;
@@ -60,105 +150,980 @@ void create_network(size_t *layer_info, const size_t size_layer_info) {
         }
         */
     }
+
+    return wrap_layers(layers, num_layers, LEAKY_RELU, WEIGHTS_FLOAT32, max_batch_size);
+}
+
+void free_network(network_t *network) {
+    if (network == NULL) {
+        return;
+    }
+    if (network->weights_mapped) {
+        unmap_file(&network->model_file);
+    } else {
+        for (size_t i = 0; i < network->num_layers; i++) {
+            free_matrix(network->layers[i].weights);
+            free(network->layers[i].half_weights);
+            free_matrix(network->layers[i].biases);
+        }
+    }
+    free(network->layers);
+    clear_quantization(network);
+
+    while (network->free_workspaces != NULL) {
+        workspace_t *workspace = network->free_workspaces;
+        network->free_workspaces = workspace->next;
+        _mm_free(workspace->buffers[0]);
+        _mm_free(workspace->buffers[1]);
+        free(workspace->quantized_input);
+        free(workspace);
+    }
+    MUTEX_DESTROY(network->workspace_lock);
+    free(network);
+}
+
+size_t network_num_inputs(const network_t *network) {
+    return network->layers[0].weights.m;
+}
+
+size_t network_num_classes(const network_t *network) {
+    return network->layers[network->num_layers - 1].weights.n;
+}
+
+tiling_t network_tiling(const network_t *network) {
+    return network->tiling;
+}
+
+void network_set_tiling(network_t *network, tiling_t tiling) {
+    assert(tiling.gemm.mc > 0 && tiling.gemm.kc > 0 && tiling.gemm.nc > 0 && tiling.elementwise_grain > 0);
+    network->tiling = tiling;
+}
+
+static size_t weight_element_size(weight_format_t format) {
+    return (format == WEIGHTS_FLOAT32) ? sizeof(float) : sizeof(uint16_t);
+}
+
+static half_format_t half_format(weight_format_t format) {
+    assert(format != WEIGHTS_FLOAT32);
+    return (format == WEIGHTS_FLOAT16) ? HALF_FLOAT16 : HALF_BFLOAT16;
+}
+
+// Tensor i of a model file, the weights then the biases of each layer
+static const void *tensor_values(const network_t *network, size_t i, size_t *element_size, uint32_t *dtype) {
+    const layer_t *layer = &network->layers[i / 2];
+    if (i % 2 == 1 || network->weight_format == WEIGHTS_FLOAT32) {
+        *element_size = sizeof(float);
+        *dtype = DTYPE_FLOAT32;
+        return (i % 2 == 0) ? layer->weights.values : layer->biases.values;
+    }
+    *element_size = sizeof(uint16_t);
+    *dtype = (network->weight_format == WEIGHTS_FLOAT16) ? DTYPE_FLOAT16 : DTYPE_BFLOAT16;
+    return layer->half_weights;
+}
+
+static inline uint64_t align_up(uint64_t offset) {
+    return (offset + DATASET_ALIGNMENT - 1) / DATASET_ALIGNMENT * DATASET_ALIGNMENT;
+}
+
+bool save_network(const network_t *network, const char *filename) {
+    model_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+    header.version = MODEL_VERSION;
+    header.num_layers = (uint32_t)network->num_layers;
+    header.activation = (uint32_t)network->activation;
+
+    size_t num_tensors = 2 * network->num_layers;
+    tensor_descriptor_t *tensors = calloc(num_tensors, sizeof(tensor_descriptor_t));
+    assert(tensors != NULL);
+    uint64_t offset = align_up(sizeof(header) + num_tensors * sizeof(tensor_descriptor_t));
+    for (size_t i = 0; i < num_tensors; i++) {
+        const layer_t *layer = &network->layers[i / 2];
+        const matrix_t *tensor = (i % 2 == 0) ? &layer->weights : &layer->biases;
+        size_t element_size;
+        tensor_values(network, i, &element_size, &tensors[i].dtype);
+        tensors[i].rows = tensor->m;
+        tensors[i].cols = tensor->n;
+        tensors[i].offset = offset;
+        offset = align_up(offset + tensor->m * tensor->n * element_size);
+    }
+
+    static const char padding[DATASET_ALIGNMENT] = {0};
+    bool success = false;
+    FILE *file = fopen(filename, "wb");
+    if (file != NULL) {
+        success = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                  fwrite(tensors, sizeof(tensor_descriptor_t), num_tensors, file) == num_tensors;
+        uint64_t position = sizeof(header) + num_tensors * sizeof(tensor_descriptor_t);
+        for (size_t i = 0; i < num_tensors && success; i++) {
+            size_t count = tensors[i].rows * tensors[i].cols;
+            size_t element_size;
+            uint32_t dtype;
+            const void *values = tensor_values(network, i, &element_size, &dtype);
+            size_t pad = tensors[i].offset - position;
+            success = fwrite(padding, 1, pad, file) == pad;
+            if (dtype == DTYPE_FLOAT32) {
+                // Float tensors are matrices, written without their row padding
+                const layer_t *layer = &network->layers[i / 2];
+                matrix_t tensor = (i % 2 == 0) ? layer->weights : layer->biases;
+                for (size_t row = 0; row < tensor.m && success; row++) {
+                    success = fwrite(matrix_row(tensor, row), sizeof(float), tensor.n, file) == tensor.n;
+                }
+            } else {
+                success = success && fwrite(values, element_size, count, file) == count;
+            }
+            position = tensors[i].offset + count * element_size;
+        }
+        success = (fclose(file) == 0) && success;
+    }
+    free(tensors);
+    return success;
+}
+
+// Unmaps the file and frees the layers read so far, for load_network to return
+static network_t *invalid_model(const char *filename, const char *reason, mapped_file_t *model_file,
+                                layer_t *layers) {
+    fprintf(stderr, "%s: not a valid model (%s)\n", filename, reason);
+    free(layers);
+    unmap_file(model_file);
+    return NULL;
+}
+
+// The file is mapped read only, and the layers point straight at its pages.
+// Nothing is parsed or copied, so startup cost doesn't depend on the size of
+// the model, and every process that loads the same file shares one copy of
+// the weights in the page cache.
+network_t *load_network(const char *filename, const size_t max_batch_size) {
+    assert(max_batch_size > 0);
+
+    mapped_file_t model_file;
+    if (!map_file(filename, false, &model_file)) {
+        perror(filename);
+        return NULL;
+    }
+    const char *data = (const char *)model_file.data;
+    if (model_file.size < sizeof(model_header_t)) {
+        return invalid_model(filename, "truncated header", &model_file, NULL);
+    }
+    const model_header_t *header = (const model_header_t *)data;
+    if (memcmp(header->magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0) {
+        return invalid_model(filename, "bad magic", &model_file, NULL);
+    }
+    if (header->version != MODEL_VERSION) {
+        return invalid_model(filename, "unsupported version", &model_file, NULL);
+    }
+    if (header->num_layers == 0 || header->activation > LEAKY_RELU) {
+        return invalid_model(filename, "bad network description", &model_file, NULL);
+    }
+    size_t num_tensors = 2 * (size_t)header->num_layers;
+    if (model_file.size < sizeof(model_header_t) + num_tensors * sizeof(tensor_descriptor_t)) {
+        return invalid_model(filename, "truncated header", &model_file, NULL);
+    }
+    const tensor_descriptor_t *tensors = (const tensor_descriptor_t *)(data + sizeof(model_header_t));
+
+    // Biases are always float32, the weights of every layer share one format
+    weight_format_t weight_format = WEIGHTS_FLOAT32;
+    if (tensors[0].dtype == DTYPE_FLOAT16) {
+        weight_format = WEIGHTS_FLOAT16;
+    } else if (tensors[0].dtype == DTYPE_BFLOAT16) {
+        weight_format = WEIGHTS_BFLOAT16;
+    }
+    if (weight_format != WEIGHTS_FLOAT32 && cpu_isa() < ISA_AVX2) {
+        fprintf(stderr, "%s: fp16/bf16 weights need %s, this CPU only supports %s\n", filename,
+                isa_name(ISA_AVX2), isa_name(cpu_isa()));
+        unmap_file(&model_file);
+        return NULL;
+    }
+
+    layer_t *layers = malloc(header->num_layers * sizeof(layer_t));
+    assert(layers != NULL);
+    for (size_t i = 0; i < num_tensors; i++) {
+        const tensor_descriptor_t *tensor = &tensors[i];
+        bool is_weights = (i % 2 == 0);
+        uint32_t expected = DTYPE_FLOAT32;
+        if (is_weights && weight_format != WEIGHTS_FLOAT32) {
+            expected = (weight_format == WEIGHTS_FLOAT16) ? DTYPE_FLOAT16 : DTYPE_BFLOAT16;
+        }
+        if (tensor->dtype != expected || tensor->offset % DATASET_ALIGNMENT != 0) {
+            return invalid_model(filename, "unsupported tensor layout", &model_file, layers);
+        }
+        size_t element_size = is_weights ? weight_element_size(weight_format) : sizeof(float);
+        if (!tensor_in_file(tensor, element_size, model_file.size)) {
+            return invalid_model(filename, "truncated payload", &model_file, layers);
+        }
+        matrix_t *matrix = is_weights ? &layers[i / 2].weights : &layers[i / 2].biases;
+        matrix->values = (float *)(data + tensor->offset);
+        matrix->m = tensor->rows;
+        matrix->n = tensor->cols;
+        matrix->stride = tensor->cols;
+        matrix->padded = false;
+        if (is_weights) {
+            layers[i / 2].half_weights = NULL;
+            if (weight_format != WEIGHTS_FLOAT32) {
+                layers[i / 2].half_weights = (uint16_t *)(data + tensor->offset);
+                matrix->values = NULL;
+            }
+        }
+    }
+    for (size_t i = 0; i < header->num_layers; i++) {
+        bool biases_match = layers[i].biases.m == 1 && layers[i].biases.n == layers[i].weights.n;
+        bool chained = (i == 0) || layers[i].weights.m == layers[i - 1].weights.n;
+        if (!biases_match || !chained) {
+            return invalid_model(filename, "layer shapes don't match", &model_file, layers);
+        }
+    }
+
+    network_t *network = wrap_layers(layers, header->num_layers,
+                                     (activation_func_t)header->activation, weight_format, max_batch_size);
+    network->model_file = model_file;
+    network->weights_mapped = true;
+    return network;
 }
 
-static size_t argmax(float *distribution, size_t num_classes) {
-    size_t result = 0;
-    float max_prob = distribution[0];
+// Training writes to the weights, so a mapped model is copied to the heap
+// first. The file itself is never modified.
+static void copy_mapped_weights(network_t *network) {
+    if (!network->weights_mapped) {
+        return;
+    }
+    for (size_t i = 0; i < 2 * network->num_layers; i++) {
+        layer_t *layer = &network->layers[i / 2];
+        const matrix_t *tensor = (i % 2 == 0) ? &layer->weights : &layer->biases;
+        size_t element_size;
+        uint32_t dtype;
+        const void *mapped = tensor_values(network, i, &element_size, &dtype);
+        if (dtype == DTYPE_FLOAT32) {
+            // Into an aligned, padded matrix like the ones create_network makes
+            matrix_t copy = matrix_alloc(tensor->m, tensor->n);
+            for (size_t row = 0; row < tensor->m; row++) {
+                memcpy(matrix_row(copy, row), matrix_row(*tensor, row), tensor->n * sizeof(float));
+            }
+            if (i % 2 == 1) {
+                layer->biases = copy;
+            } else {
+                layer->weights = copy;
+            }
+        } else {
+            layer->half_weights = malloc(tensor->m * tensor->n * element_size);
+            assert(layer->half_weights != NULL);
+            memcpy(layer->half_weights, mapped, tensor->m * tensor->n * element_size);
+        }
+    }
+    unmap_file(&network->model_file);
+    network->weights_mapped = false;
+}
+
+weight_format_t network_weight_format(const network_t *network) {
+    return network->weight_format;
+}
 
-    for (size_t i = 0; i < num_classes; i++) {
-        if (distribution[i] > max_prob) {
-            max_prob = distribution[i];
-            result = i;
+void set_weight_format(network_t *network, weight_format_t format) {
+    if (format == network->weight_format) {
+        return;
+    }
+    // hgemm.c is only built for AVX2 + F16C
+    require_isa(ISA_AVX2, "fp16/bf16 weights");
+    copy_mapped_weights(network);
+    for (size_t i = 0; i < network->num_layers; i++) {
+        layer_t *layer = &network->layers[i];
+        size_t rows = layer->weights.m, cols = layer->weights.n;
+        // Half to half goes through float32, which is exact. Half weights
+        // are dense, float ones padded.
+        if (network->weight_format != WEIGHTS_FLOAT32) {
+            layer->weights = matrix_alloc(rows, cols);
+            for (size_t row = 0; row < rows; row++) {
+                half_to_floats(layer->half_weights + row * cols, matrix_row(layer->weights, row), cols,
+                               half_format(network->weight_format));
+            }
+            free(layer->half_weights);
+            layer->half_weights = NULL;
+        }
+        if (format != WEIGHTS_FLOAT32) {
+            layer->half_weights = malloc(rows * cols * sizeof(uint16_t));
+            assert(layer->half_weights != NULL);
+            for (size_t row = 0; row < rows; row++) {
+                floats_to_half(matrix_row(layer->weights, row), layer->half_weights + row * cols, cols,
+                               half_format(format));
+            }
+            free_matrix(layer->weights);
+            layer->weights.values = NULL;
         }
     }
-    return result;
+    network->weight_format = format;
 }
 
-static float *softmax_regression(matrix_t input, size_t row_number) {
-    float *distribution = malloc(input.n * sizeof(float));
-    float sum = 0.0;
-    for (size_t i = 0; i < input.n; i++) {
-        distribution[i] = exp(input.values[input.n * row_number + i]);
-        sum += distribution[i]; // Calculate the sum of the distribution,
-                                // simultaneously
+// Computes activation(input * weights + biases) for a single layer into output.
+// The bias and activation are applied to each tile of the product as soon as
+// it is computed, so the output is written once and there are no temporaries.
+static matrix_t dense_forward(const network_t *network, matrix_t input, const layer_t *layer,
+                              bool apply_activation, float *output_buffer) {
+    matrix_t output;
+    output.m = input.m;
+    output.n = layer->weights.n;
+    output.stride = matrix_padded_stride(output.n);
+    output.padded = true;
+    output.values = output_buffer;
+
+    gemm_epilogue_t epilogue;
+    epilogue.bias = layer->biases.values;
+    epilogue.activation = apply_activation ? activation_span(network->activation) : NULL;
+
+    if (network->weight_format == WEIGHTS_FLOAT32) {
+        gemm_fused(input.m, output.n, input.n,
+                   input.values, input.stride,
+                   layer->weights.values, layer->weights.stride,
+                   output.values, output.stride, &epilogue, &network->tiling.gemm);
+    } else {
+        hgemm_fused(input.m, output.n, input.n,
+                    input.values, input.stride,
+                    layer->half_weights, layer->weights.n, half_format(network->weight_format),
+                    output.values, output.stride, &epilogue);
     }
-    for (size_t i = 0; i < input.n; i++) {
-        distribution[i] /= sum; // Normalize the distribution
+    return output;
+}
+
+// Same as dense_forward, with the layer's int8 weights. The input is
+// quantized with the scale found by calibration, multiplied in int32 and
+// scaled back to floats before the bias and activation.
+static matrix_t quantized_forward(const network_t *network, matrix_t input, size_t layer_index,
+                                  bool apply_activation, int16_t *quantized_input,
+                                  float *output_buffer) {
+    const layer_t *layer = &network->layers[layer_index];
+    const quantized_layer_t *quantized = &network->quantized[layer_index];
+    matrix_t output;
+    output.m = input.m;
+    output.n = layer->weights.n;
+    output.stride = matrix_padded_stride(output.n);
+    output.padded = true;
+    output.values = output_buffer;
+
+    gemm_epilogue_t epilogue;
+    epilogue.bias = layer->biases.values;
+    epilogue.activation = apply_activation ? activation_span(network->activation) : NULL;
+
+    quantize_activations(input.m, input.n, input.values, input.stride, quantized->input_scale, quantized_input);
+    qgemm_fused(input.m, quantized_input, quantized->input_scale, &quantized->weights,
+                output.values, output.stride, &epilogue);
+    return output;
+}
+
+// Widest padded layer input, sizes the int8 input buffer of a workspace
+static size_t max_padded_inputs(const network_t *network) {
+    size_t max = 0;
+    for (size_t i = 0; i < network->num_layers; i++) {
+        size_t k = qgemm_padded_k(network->layers[i].weights.m);
+        max = (k > max) ? k : max;
     }
-    return distribution;
+    return max;
 }
 
-result_t *predict(matrix_t X) {
-    matrix_t input = X;
-    for (size_t i = 0; i < num_layers; i++) {
-        printf("Layer: %zu\n", i);
-        matrix_t output = matrix_tile_multiply(input, layers[i].weights);
-        matrix_t temp = matrix_add_vector(output, layers[i].biases);
-        free(output.values); 
-        output = temp;
+// Takes a workspace off the free list, or allocates one if every workspace
+// is in use by another thread. The lock is only held to unlink it.
+static workspace_t *acquire_workspace(network_t *network) {
+    MUTEX_LOCK(network->workspace_lock);
+    workspace_t *workspace = network->free_workspaces;
+    if (workspace != NULL) {
+        network->free_workspaces = workspace->next;
+    }
+    MUTEX_UNLOCK(network->workspace_lock);
+
+    if (workspace == NULL) {
+        workspace = malloc(sizeof(workspace_t));
+        assert(workspace != NULL);
+        for (size_t i = 0; i < 2; i++) {
+            workspace->buffers[i] = (float *)_mm_malloc(network->max_batch * matrix_padded_stride(network->max_width) *
+                                                        sizeof(float), MATRIX_ALIGNMENT);
+            assert(workspace->buffers[i] != NULL);
+        }
+        workspace->quantized_input = NULL;
+    }
+    return workspace;
+}
+
+static void release_workspace(network_t *network, workspace_t *workspace) {
+    MUTEX_LOCK(network->workspace_lock);
+    workspace->next = network->free_workspaces;
+    network->free_workspaces = workspace;
+    MUTEX_UNLOCK(network->workspace_lock);
+}
 
-        printf("Success on %zu\n", i);
+// Runs the rows of input through every layer, and returns the logits of the
+// last layer. They are left in one of the workspace buffers.
+static matrix_t forward_logits(network_t *network, workspace_t *workspace, matrix_t input) {
+    if (network->quantized != NULL && workspace->quantized_input == NULL) {
+        workspace->quantized_input = malloc(network->max_batch * max_padded_inputs(network) * sizeof(int16_t));
+        assert(workspace->quantized_input != NULL);
+    }
 
-        if (i == num_layers - 1) {
-            input = output; // In this case, 'input' is the raw values from the
-                            // final layer
+    for (size_t i = 0; i < network->num_layers; i++) {
+        double trace_start_time = trace_begin();
+        trace_args_t trace_args = {.m = input.m, .k = input.n, .n = network->layers[i].weights.n, .layer = i};
+        // The final layer keeps its raw values, softmax is applied by the caller
+        bool apply_activation = i != network->num_layers - 1;
+        if (network->quantized != NULL) {
+            input = quantized_forward(network, input, i, apply_activation,
+                                      workspace->quantized_input, workspace->buffers[i % 2]);
         } else {
-            input = matrix_activation(output, activation, false);
-            free(output.values);
+            input = dense_forward(network, input, &network->layers[i], apply_activation,
+                                  workspace->buffers[i % 2]);
+        }
+        trace_end(trace_start_time, "layer", "layer", trace_args);
+    }
+    return input;
+}
+
+// Rows batch_start onwards of X, as many as fit in a workspace
+static matrix_t predict_batch(const network_t *network, matrix_t X, size_t batch_start) {
+    size_t rows = (batch_start + network->max_batch < X.m) ? network->max_batch : X.m - batch_start;
+    return matrix_rows(X, batch_start, rows);
+}
+
+void predict(network_t *network, matrix_t X, result_t *results, float *distributions) {
+    assert(X.n == network_num_inputs(network));
+    size_t num_classes = network_num_classes(network);
+    double trace_start_time = trace_begin();
+    workspace_t *workspace = acquire_workspace(network);
+
+    // Push X through in batches that fit in the workspace
+    for (size_t batch_start = 0; batch_start < X.m; batch_start += network->max_batch) {
+        matrix_t logits = forward_logits(network, workspace, predict_batch(network, X, batch_start));
+
+        double output_start_time = trace_begin();
+        for (size_t i = 0; i < logits.m; i++) {
+            result_t *result = &results[batch_start + i];
+            const float *row = matrix_row(logits, i);
+            if (distributions != NULL) {
+                result->distribution = &distributions[(batch_start + i) * num_classes];
+                result->prediction = softmax_span(result->distribution, row, num_classes);
+            } else {
+                result->distribution = NULL;
+                result->prediction = argmax_span(row, num_classes, NULL);
+            }
+        }
+        trace_end(output_start_time, "softmax", (distributions != NULL) ? "softmax" : "argmax",
+                  (trace_args_t){.m = logits.m, .n = num_classes,
+                                 .bytes = ((distributions != NULL) ? 2 : 1) * logits.m * num_classes * sizeof(float)});
+    }
+
+    release_workspace(network, workspace);
+    trace_end(trace_start_time, "network", "predict", (trace_args_t){.m = X.m, .k = X.n, .n = num_classes});
+}
+
+// Indices of the k largest of n values, largest first. Insertion into a
+// sorted list of k, since k and the number of classes are both small.
+static void select_top_k(const float *values, size_t n, size_t k, size_t *labels) {
+    size_t count = 0;
+    for (size_t j = 0; j < n; j++) {
+        if (count == k && values[j] <= values[labels[k - 1]]) {
+            continue;
+        }
+        size_t position = (count < k) ? count++ : k - 1;
+        while (position > 0 && values[j] > values[labels[position - 1]]) {
+            labels[position] = labels[position - 1];
+            position--;
         }
-        printf("Success on activation %zu\n", i);
+        labels[position] = j;
     }
-    result_t *predictions = (result_t *)malloc(input.m * sizeof(result_t));
+}
+
+void predict_top_k(network_t *network, matrix_t X, size_t k, size_t *labels, float *probabilities) {
+    assert(X.n == network_num_inputs(network));
+    size_t num_classes = network_num_classes(network);
+    assert(k > 0 && k <= num_classes);
+    double trace_start_time = trace_begin();
+    workspace_t *workspace = acquire_workspace(network);
 
-    for (size_t i = 0; i < input.m; i++) {
-        predictions[i].distribution = softmax_regression(input, i);
-        predictions[i].prediction = argmax(predictions[i].distribution, input.n);
+    for (size_t batch_start = 0; batch_start < X.m; batch_start += network->max_batch) {
+        matrix_t logits = forward_logits(network, workspace, predict_batch(network, X, batch_start));
+
+        double output_start_time = trace_begin();
+        for (size_t i = 0; i < logits.m; i++) {
+            // Softmax keeps the order, so the labels alone come from the logits
+            float *row = matrix_row(logits, i);
+            if (probabilities != NULL) {
+                softmax_span(row, row, num_classes);
+            }
+            size_t *row_labels = &labels[(batch_start + i) * k];
+            select_top_k(row, num_classes, k, row_labels);
+            if (probabilities != NULL) {
+                for (size_t j = 0; j < k; j++) {
+                    probabilities[(batch_start + i) * k + j] = row[row_labels[j]];
+                }
+            }
+        }
+        trace_end(output_start_time, "softmax", (probabilities != NULL) ? "softmax+top_k" : "top_k",
+                  (trace_args_t){.m = logits.m, .n = num_classes, .bytes = logits.m * num_classes * sizeof(float)});
     }
-    return predictions;
+
+    release_workspace(network, workspace);
+    trace_end(trace_start_time, "network", "predict_top_k", (trace_args_t){.m = X.m, .k = X.n, .n = num_classes});
+}
+
+static float max_magnitude(const float *values, size_t count, float max) {
+    for (size_t i = 0; i < count; i++) {
+        float value = fabsf(values[i]);
+        max = (value > max) ? value : max;
+    }
+    return max;
+}
+
+// Calibration runs the calibration rows through the float layers and records
+// the largest magnitude that reaches each layer. That becomes 127 when the
+// layer's input is quantized, so nothing in the calibration set clips.
+void quantize_network(network_t *network, matrix_t calibration) {
+    assert(calibration.n == network_num_inputs(network));
+    assert(calibration.m > 0);
+    // qgemm.c is only built for AVX2
+    require_isa(ISA_AVX2, "int8 quantization");
+    clear_quantization(network);
+
+    float *max_inputs = calloc(network->num_layers, sizeof(float));
+    assert(max_inputs != NULL);
+    workspace_t *workspace = acquire_workspace(network);
+    for (size_t batch_start = 0; batch_start < calibration.m; batch_start += network->max_batch) {
+        size_t rows = (batch_start + network->max_batch < calibration.m) ? network->max_batch
+                                                                        : calibration.m - batch_start;
+        matrix_t input = matrix_rows(calibration, batch_start, rows);
+
+        for (size_t i = 0; i < network->num_layers; i++) {
+            for (size_t r = 0; r < input.m; r++) {
+                max_inputs[i] = max_magnitude(matrix_row(input, r), input.n, max_inputs[i]);
+            }
+            input = dense_forward(network, input, &network->layers[i], i != network->num_layers - 1,
+                                  workspace->buffers[i % 2]);
+        }
+    }
+    release_workspace(network, workspace);
+
+    quantized_layer_t *quantized = malloc(network->num_layers * sizeof(quantized_layer_t));
+    assert(quantized != NULL);
+    for (size_t i = 0; i < network->num_layers; i++) {
+        matrix_t weights = network->layers[i].weights;
+        if (network->weight_format != WEIGHTS_FLOAT32) {
+            weights = matrix_alloc(weights.m, weights.n);
+            for (size_t row = 0; row < weights.m; row++) {
+                half_to_floats(network->layers[i].half_weights + row * weights.n, matrix_row(weights, row),
+                               weights.n, half_format(network->weight_format));
+            }
+        }
+        quantized[i].weights = quantize_weights(weights);
+        if (weights.values != network->layers[i].weights.values) {
+            free_matrix(weights);
+        }
+        quantized[i].input_scale = (max_inputs[i] > 0) ? max_inputs[i] / 127.0f : 1.0f;
+    }
+    free(max_inputs);
+    network->quantized = quantized;
+}
+
+void clear_quantization(network_t *network) {
+    if (network->quantized == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < network->num_layers; i++) {
+        free_qweights(&network->quantized[i].weights);
+    }
+    free(network->quantized);
+    network->quantized = NULL;
+}
+
+bool network_is_quantized(const network_t *network) {
+    return network->quantized != NULL;
+}
+
+size_t network_weight_bytes(const network_t *network) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < network->num_layers; i++) {
+        const layer_t *layer = &network->layers[i];
+        if (network->quantized != NULL) {
+            bytes += qweights_bytes(&network->quantized[i].weights);
+        } else {
+            bytes += layer->weights.m * layer->weights.n * weight_element_size(network->weight_format);
+        }
+        bytes += layer->biases.n * sizeof(float);
+    }
+    return bytes;
+}
+
+// Everything the training loop keeps around for one minibatch. Allocated once
+// per call to train, and reused for every batch.
+typedef struct {
+    matrix_t X;                 // Input rows of the batch, a view of the caller's rows
+    matrix_t Y;                 // One-hot labels of the batch
+    matrix_t *pre_activations;  // Z for each layer, input * weights + biases. The
+                                // backward pass overwrites it with activation'(Z).
+    matrix_t *activations;      // A for each layer, activation(Z). Softmax for the last.
+    matrix_t *deltas;           // Gradient of the loss with respect to each Z
+    matrix_t *weight_gradients; // dW for each layer
+    matrix_t *weights_t;        // W^T for each layer but the first
+    matrix_t inputs_t;          // A layer's input transposed, widest input x batch size
+    float **bias_gradients;     // One row of column sums per layer
+} batch_cache_t;
+
+// Shrinks a cached matrix to the rows of the current batch, the last batch
+// of an epoch can be smaller than the others
+static inline matrix_t batch_rows(matrix_t matrix, size_t rows) {
+    matrix.m = rows;
+    return matrix;
+}
+
+typedef struct {
+    float *params;
+    const float *gradient;
+    float learning_rate;
+} sgd_args_t;
+
+static void sgd_step(void *context, size_t start, size_t end) {
+    sgd_args_t *args = (sgd_args_t *)context;
+    for (size_t i = start; i < end; i++) {
+        args->params[i] -= args->learning_rate * args->gradient[i];
+    }
+}
+
+// params -= learning_rate * gradient
+static void sgd_update(float *params, const float *gradient, size_t count, float learning_rate, size_t grain) {
+    sgd_args_t args;
+    args.params = params;
+    args.gradient = gradient;
+    args.learning_rate = learning_rate;
+    parallel_for(count, grain, sgd_step, &args);
+}
+
+// C = A * B with the network's blocking
+static void network_multiply_into(const network_t *network, matrix_t c, matrix_t a, matrix_t b) {
+    assert(a.n == b.m && c.m == a.m && c.n == b.n);
+    gemm_fused(a.m, b.n, a.n, a.values, a.stride, b.values, b.stride, c.values, c.stride,
+               NULL, &network->tiling.gemm);
+}
+
+// Forward pass over one batch, keeping Z and A of every layer for backprop
+static void forward_cached(const network_t *network, batch_cache_t *cache, size_t rows) {
+    matrix_t input = batch_rows(cache->X, rows);
+    for (size_t i = 0; i < network->num_layers; i++) {
+        matrix_t z = batch_rows(cache->pre_activations[i], rows);
+        matrix_t a = batch_rows(cache->activations[i], rows);
+
+        gemm_epilogue_t epilogue;
+        epilogue.bias = network->layers[i].biases.values;
+        epilogue.activation = NULL;
+        gemm_fused(rows, z.n, input.n,
+                   input.values, input.stride,
+                   network->layers[i].weights.values, network->layers[i].weights.stride,
+                   z.values, z.stride, &epilogue, &network->tiling.gemm);
+
+        if (i == network->num_layers - 1) {
+            double trace_start_time = trace_begin();
+            for (size_t r = 0; r < rows; r++) {
+                softmax_span(matrix_row(a, r), matrix_row(z, r), a.n);
+            }
+            trace_end(trace_start_time, "softmax", "softmax",
+                      (trace_args_t){.m = rows, .n = z.n, .bytes = 2 * rows * z.n * sizeof(float)});
+        } else {
+            matrix_activation_into(a, z, network->activation, false, network->tiling.elementwise_grain);
+        }
+        input = a;
+    }
+}
+
+// Backward pass over one batch followed by the SGD update. Returns the loss.
+static float backward_update(network_t *network, batch_cache_t *cache, size_t rows, float learning_rate) {
+    matrix_t Y = batch_rows(cache->Y, rows);
+    matrix_t output = batch_rows(cache->activations[network->num_layers - 1], rows);
+
+    // Softmax + cross entropy collapses to (p - y). The loss averages y * log(p)
+    // over every element, so it is negated and scaled by the number of classes
+    // to get the mean cross entropy per sample. The gradient is divided by
+    // every element rather than by the batch, the step is rescaled to match.
+    matrix_t delta = batch_rows(cache->deltas[network->num_layers - 1], rows);
+    float loss = -matrix_loss_gradient(Y, output, CATEGORICAL, true, delta) * output.n;
+    float step = learning_rate * output.n;
+
+    for (size_t l = network->num_layers; l-- > 0;) {
+        matrix_t input = (l == 0) ? batch_rows(cache->X, rows)
+                                  : batch_rows(cache->activations[l - 1], rows);
+
+        // dW = input^T * delta, db = column sums of delta
+        matrix_t input_t = matrix_columns(batch_rows(cache->inputs_t, input.n), 0, rows);
+        matrix_t weight_gradient = cache->weight_gradients[l];
+        transpose_into(input_t, input);
+        network_multiply_into(network, weight_gradient, input_t, delta);
+
+        float *bias_gradient = cache->bias_gradients[l];
+        for (size_t j = 0; j < delta.n; j++) {
+            bias_gradient[j] = 0;
+        }
+        for (size_t r = 0; r < rows; r++) {
+            for (size_t j = 0; j < delta.n; j++) {
+                bias_gradient[j] += matrix_row(delta, r)[j];
+            }
+        }
+
+        // Propagate through the weights before they are updated:
+        // delta = (delta * W^T) .* activation'(Z), in place in the next delta.
+        // Z isn't needed after this, so its derivative overwrites it.
+        matrix_t next_delta = delta;
+        if (l > 0) {
+            next_delta = batch_rows(cache->deltas[l - 1], rows);
+            transpose_into(cache->weights_t[l], network->layers[l].weights);
+            network_multiply_into(network, next_delta, delta, cache->weights_t[l]);
+
+            matrix_t derivative = batch_rows(cache->pre_activations[l - 1], rows);
+            matrix_activation_into(derivative, derivative, network->activation, true,
+                                   network->tiling.elementwise_grain);
+            matrix_apply_into(next_delta, &next_delta, &derivative, 0, multiply);
+        }
+
+        // The weights and their gradient share the same padding
+        size_t flat = matrix_flat_size(network->layers[l].weights, weight_gradient);
+        assert(flat != 0);
+        size_t grain = network->tiling.elementwise_grain;
+        sgd_update(network->layers[l].weights.values, weight_gradient.values, flat, step, grain);
+        sgd_update(network->layers[l].biases.values, bias_gradient, delta.n, step, grain);
+        delta = next_delta;
+    }
+    return loss;
+}
+
+static batch_cache_t create_batch_cache(const network_t *network, size_t batch_size) {
+    batch_cache_t cache;
+    cache.X.values = NULL;
+    cache.X.m = 0;
+    cache.X.n = network->layers[0].weights.m;
+    cache.X.stride = cache.X.n;
+    cache.X.padded = false;
+    cache.Y = zeroes(batch_size, network->layers[network->num_layers - 1].weights.n);
+    cache.pre_activations = malloc(network->num_layers * sizeof(matrix_t));
+    cache.activations = malloc(network->num_layers * sizeof(matrix_t));
+    cache.deltas = malloc(network->num_layers * sizeof(matrix_t));
+    cache.weight_gradients = malloc(network->num_layers * sizeof(matrix_t));
+    cache.weights_t = malloc(network->num_layers * sizeof(matrix_t));
+    cache.bias_gradients = malloc(network->num_layers * sizeof(float *));
+    assert(cache.pre_activations != NULL && cache.activations != NULL && cache.deltas != NULL &&
+           cache.weight_gradients != NULL && cache.weights_t != NULL && cache.bias_gradients != NULL);
+    size_t widest_input = 0;
+    for (size_t i = 0; i < network->num_layers; i++) {
+        const matrix_t *weights = &network->layers[i].weights;
+        cache.pre_activations[i] = zeroes(batch_size, weights->n);
+        cache.activations[i] = zeroes(batch_size, weights->n);
+        cache.deltas[i] = zeroes(batch_size, weights->n);
+        cache.weight_gradients[i] = zeroes(weights->m, weights->n);
+        cache.weights_t[i] = (i > 0) ? zeroes(weights->n, weights->m) : matrix_view(NULL, 0, 0, 0);
+        cache.bias_gradients[i] = malloc(weights->n * sizeof(float));
+        assert(cache.bias_gradients[i] != NULL);
+        widest_input = (weights->m > widest_input) ? weights->m : widest_input;
+    }
+    cache.inputs_t = zeroes(widest_input, batch_size);
+    return cache;
+}
+
+static void free_batch_cache(const network_t *network, batch_cache_t *cache) {
+    for (size_t i = 0; i < network->num_layers; i++) {
+        free_matrix(cache->pre_activations[i]);
+        free_matrix(cache->activations[i]);
+        free_matrix(cache->deltas[i]);
+        free_matrix(cache->weight_gradients[i]);
+        free_matrix(cache->weights_t[i]);
+        free(cache->bias_gradients[i]);
+    }
+    free(cache->pre_activations);
+    free(cache->activations);
+    free(cache->deltas);
+    free(cache->weight_gradients);
+    free(cache->weights_t);
+    free(cache->bias_gradients);
+    free_matrix(cache->inputs_t);
+    free_matrix(cache->Y);
+}
+
+// One SGD step on the rows of X, with their labels in y. X must have no more
+// rows than the cache was created for. Returns the mean loss of the batch.
+static float train_batch(network_t *network, batch_cache_t *cache, matrix_t X, matrix_t y,
+                         float learning_rate) {
+    assert(X.n == network->layers[0].weights.m && X.m == y.m && y.n == 1);
+    size_t num_classes = cache->Y.n;
+
+    cache->X = X;
+    for (size_t r = 0; r < X.m; r++) {
+        float *one_hot = matrix_row(cache->Y, r);
+        memset(one_hot, 0, num_classes * sizeof(float));
+        size_t label = (size_t)matrix_row(y, r)[0];
+        assert(label < num_classes);
+        one_hot[label] = 1.0f;
+    }
+
+    double trace_start_time = trace_begin();
+    forward_cached(network, cache, X.m);
+    trace_end(trace_start_time, "network", "forward", (trace_args_t){.m = X.m, .k = X.n, .n = num_classes});
+
+    trace_start_time = trace_begin();
+    float loss = backward_update(network, cache, X.m, learning_rate);
+    trace_end(trace_start_time, "network", "backward", (trace_args_t){.m = X.m, .k = X.n, .n = num_classes});
+    return loss;
+}
+
+void train(network_t *network, matrix_t X, matrix_t y, size_t epochs, size_t batch_size,
+           float learning_rate, uint64_t seed) {
+    assert(network->num_layers > 0);
+    assert(X.m == y.m && y.n == 1);
+    assert(X.n == network->layers[0].weights.m);
+    assert(batch_size > 0);
+
+    if (batch_size > X.m) {
+        batch_size = X.m;
+    }
+
+    copy_mapped_weights(network);
+    set_weight_format(network, WEIGHTS_FLOAT32);
+    clear_quantization(network);
+    batch_cache_t cache = create_batch_cache(network, batch_size);
+    matrix_t batch_X = zeroes(batch_size, X.n);
+    matrix_t batch_y = zeroes(batch_size, 1);
+
+    size_t *permutation = malloc(X.m * sizeof(size_t));
+    assert(permutation != NULL);
+    for (size_t i = 0; i < X.m; i++) {
+        permutation[i] = i;
+    }
+    uint64_t rng_state = seed;
+
+    for (size_t epoch = 0; epoch < epochs; epoch++) {
+        double start = timer_seconds();
+        shuffle_indices(permutation, X.m, &rng_state);
+
+        float total_loss = 0;
+        for (size_t batch_start = 0; batch_start < X.m; batch_start += batch_size) {
+            size_t rows = (batch_start + batch_size < X.m) ? batch_size : X.m - batch_start;
+
+            // Gather the shuffled rows
+            for (size_t r = 0; r < rows; r++) {
+                size_t sample = permutation[batch_start + r];
+                memcpy(matrix_row(batch_X, r), matrix_row(X, sample), X.n * sizeof(float));
+                batch_y.values[r] = matrix_row(y, sample)[0];
+            }
+
+            total_loss += train_batch(network, &cache, batch_rows(batch_X, rows), batch_rows(batch_y, rows),
+                                      learning_rate) * rows;
+        }
+
+        double elapsed = timer_seconds() - start;
+        printf("Epoch %zu/%zu - loss: %.4f - %.0f samples/sec\n", epoch + 1, epochs,
+               total_loss / X.m, X.m / elapsed);
+    }
+
+    free(permutation);
+    free_matrix(batch_X);
+    free_matrix(batch_y);
+    free_batch_cache(network, &cache);
+}
+
+void train_loader(network_t *network, data_loader_t *loader, size_t epochs, float learning_rate) {
+    assert(network->num_layers > 0);
+    assert(loader_num_features(loader) == network->layers[0].weights.m);
+
+    copy_mapped_weights(network);
+    set_weight_format(network, WEIGHTS_FLOAT32);
+    clear_quantization(network);
+    batch_cache_t cache = create_batch_cache(network, loader_batch_size(loader));
+
+    for (size_t epoch = 0; epoch < epochs; epoch++) {
+        double start = timer_seconds();
+        float total_loss = 0;
+        size_t samples = 0;
+
+        matrix_t X, y;
+        while (loader_next(loader, &X, &y)) {
+            total_loss += train_batch(network, &cache, X, y, learning_rate) * X.m;
+            samples += X.m;
+        }
+
+        double elapsed = timer_seconds() - start;
+        printf("Epoch %zu/%zu - loss: %.4f - %.0f samples/sec\n", epoch + 1, epochs,
+               samples > 0 ? total_loss / samples : 0.0f, samples / elapsed);
+    }
+
+    free_batch_cache(network, &cache);
 }
 
 #ifdef _WIN32
 #include <windows.h>
 #elif defined(__APPLE__) 
 #include <sys/sysctl.h>
+#elif defined(__linux__)
+#include <string.h>
+
+// Returns the size in bytes of the data/unified cache at the given level, or 0
+static size_t linux_cache_size(int level) {
+    char path[64];
+    char buffer[16];
+    for (int index = 0; index < 8; index++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", index);
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL) {
+            break;
+        }
+        int cache_level = fgets(buffer, sizeof(buffer), fp) ? atoi(buffer) : 0;
+        fclose(fp);
+        if (cache_level != level) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", index);
+        fp = fopen(path, "r");
+        if (fp != NULL) {
+            bool instruction = fgets(buffer, sizeof(buffer), fp) && strncmp(buffer, "Instruction", 11) == 0;
+            fclose(fp);
+            if (instruction) {
+                continue;
+            }
+        }
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", index);
+        fp = fopen(path, "r");
+        if (fp == NULL) {
+            return 0;
+        }
+        size_t size = 0;
+        if (fgets(buffer, sizeof(buffer), fp)) {
+            char *suffix;
+            size = strtoul(buffer, &suffix, 10);
+            size *= (*suffix == 'M') ? 1024 * 1024 : 1024;
+        }
+        fclose(fp);
+        return size;
+    }
+    return 0;
+}
 #endif
 
 void determine_cache(void) {
     size_t cache_size = 0;
+    size_t l1_size = 0; // Only used to block the GEMM, 0 keeps its defaults
+    size_t l3_size = 0;
 
     #ifdef _WIN32
     DWORD bufferSize = 0;
     PSYSTEM_LOGICAL_PROCESSOR_INFORMATION buffer = NULL;
 
-    // Get the required buffer size
-    if (GetLogicalProcessorInformation(NULL, &bufferSize) != FALSE || GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
-        perror("GetLogicalProcessorInformation");
-        exit(1);
-    }
-
-    // Allocate memory for the processor information
-    buffer = malloc(bufferSize);
-    if (buffer == NULL) {
-        perror("malloc");
-        exit(1);
+    // Get the required buffer size, then the processor information
+    if (GetLogicalProcessorInformation(NULL, &bufferSize) == FALSE && GetLastError() == ERROR_INSUFFICIENT_BUFFER) {
+        buffer = malloc(bufferSize);
     }
-
-    // Retrieve the processor information
-    if (GetLogicalProcessorInformation(buffer, &bufferSize) == FALSE) {
-        perror("GetLogicalProcessorInformation");
+    if (buffer != NULL && GetLogicalProcessorInformation(buffer, &bufferSize) == FALSE) {
         free(buffer);
-        exit(1);
+        buffer = NULL;
     }
 
     // Parse the processor information to find the L2 cache size
     PSYSTEM_LOGICAL_PROCESSOR_INFORMATION ptr = buffer;
-    for (DWORD i = 0; i < bufferSize / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION); i++) {
+    for (DWORD i = 0; buffer != NULL && i < bufferSize / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION); i++) {
         if (ptr->Relationship == RelationCache) {
             CACHE_DESCRIPTOR cache = ptr->Cache;
-            if (cache.Level == 2) { // L2 Cache
+            if (cache.Level == 1 && cache.Type != CacheInstruction) {
+                l1_size = cache.Size;
+            } else if (cache.Level == 2) { // L2 Cache
                 cache_size = cache.Size;
-                break;
+            } else if (cache.Level == 3) {
+                l3_size = cache.Size;
             }
         }
         ptr++;
@@ -166,40 +1131,41 @@ void determine_cache(void) {
 
     free(buffer);
 
-    if (cache_size == 0) {
-        fprintf(stderr, "Failed to retrieve L2 cache size.\n");
-        exit(1);
-    }
-
     // Check if the system is macOS
     #elif __APPLE__
         // Use sysctl to get the cache size on macOS
         size_t len = sizeof(cache_size);
         if (sysctlbyname("hw.l3cachesize", &cache_size, &len, NULL, 0) != 0) {
-            perror("sysctlbyname");
-            exit(1);
+            cache_size = 0;
         }
+        l3_size = cache_size;
+        len = sizeof(l1_size);
+        sysctlbyname("hw.l1dcachesize", &l1_size, &len, NULL, 0);
 
     // Check if the system is Linux
     #elif __linux__
-        FILE *fp = fopen("/sys/devices/system/cpu/cpu0/cache/index2/size", "r");
-        if (fp != NULL) {
-            char buffer[16];
-            if (fgets(buffer, sizeof(buffer), fp)) {
-                cache_size = strtoul(buffer, NULL, 10) * 1024;
-            }
-            fclose(fp);
-        } else {
-            perror("fopen");
-            exit(1);
-        }
+        cache_size = linux_cache_size(2);
+        l1_size = linux_cache_size(1);
+        l3_size = linux_cache_size(3);
+
+    // Unsupported system, the tuning file or the defaults have to do
+    #endif
+
+    // Sandboxes and some VMs hide the cache sizes, the blocking defaults are
+    // a reasonable fit for most x86 caches
+    if (cache_size == 0) {
+        fprintf(stderr, "Couldn't find the cache sizes, using the default blocking\n");
+    }
 
-    // Unsupported system
+    #ifdef __APPLE__
+    gemm_set_blocking(l1_size, 0, l3_size); // cache_size is the L3 here
     #else
-        fprintf(stderr, "Cache size determination is not supported on this operating system.\n");
-        return;
+    gemm_set_blocking(l1_size, cache_size, l3_size);
     #endif
 
-    // Calculate tile size based on cache size
-    tile_size = (int)sqrt((cache_size / sizeof(float)) / 3);
+    // Values measured on this host by build/autotune win over the heuristics
+    tuning_t tuning = current_tuning();
+    if (load_tuning(tuning_path(), &tuning)) {
+        apply_tuning(&tuning);
+    }
 }
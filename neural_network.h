@@ -1,5 +1,9 @@
 #ifndef NEURAL_NETWORK_H
 #define NEURAL_NETWORK_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "data_loader.h"
+#include "gemm.h"
 #include "matrix.h"
 
 typedef struct {
@@ -7,6 +11,85 @@ typedef struct {
     size_t prediction;
 } result_t;
 
-void create_network(size_t* layer_info, const size_t size_layer_info);
-result_t *predict(matrix_t X);
+// A network owns its layers, activation, tiling parameters and scratch space,
+// so any number of networks can live side by side in one process.
+typedef struct network network_t;
+
+// How the weights of a network are stored. Biases are always float32.
+typedef enum {
+    WEIGHTS_FLOAT32,
+    WEIGHTS_FLOAT16,  // IEEE half precision
+    WEIGHTS_BFLOAT16  // Top 16 bits of a float32
+} weight_format_t;
+
+// Blocking parameters used by a network's kernels. New networks start from
+// the host defaults found by determine_cache (see tune.h).
+typedef struct {
+    gemm_blocking_t gemm;     // Cache blocking of the matrix products
+    size_t elementwise_grain; // Values per parallel_for chunk of the activations and SGD update
+} tiling_t;
+
+// max_batch_size is the number of rows predict pushes through the network at
+// once, it sizes the workspaces that are reused between calls
+network_t *create_network(size_t* layer_info, const size_t size_layer_info, const size_t max_batch_size);
+void free_network(network_t *network);
+
+size_t network_num_inputs(const network_t *network);
+size_t network_num_classes(const network_t *network);
+tiling_t network_tiling(const network_t *network);
+void network_set_tiling(network_t *network, tiling_t tiling);
+
+// Writes the layer sizes, activation, weights and biases of the network to a
+// versioned binary file. Returns false if the file can't be written.
+bool save_network(const network_t *network, const char *filename);
+
+// Creates a network from a file written by save_network. The weights are used
+// straight from a read only mapping of the file, see neural_network.c. Prints
+// why and returns NULL if the file is missing or malformed.
+network_t *load_network(const char *filename, const size_t max_batch_size);
+
+// Fills results with one prediction per row of X. Each distribution points
+// into distributions, which must hold X.m * network_num_classes floats. If
+// distributions is NULL only the labels are computed, and every distribution
+// is NULL. Nothing is allocated per row.
+// Any number of threads can call predict on the same network at once.
+void predict(network_t *network, matrix_t X, result_t *results, float *distributions);
+
+// The k most likely classes of each row of X, most likely first, into labels
+// (X.m * k). Their probabilities go into probabilities (X.m * k) unless it is
+// NULL, in which case the softmax is skipped. Ties go to the lower class.
+void predict_top_k(network_t *network, matrix_t X, size_t k, size_t *labels, float *probabilities);
+
+// Converts the weights to another format, in place. The half formats take
+// half the memory, and predict widens them to float32 in registers, so small
+// batches (which spend most of their time streaming weights) run faster.
+// save_network writes the weights in the current format. Training converts
+// them back to float32, but precision lost to rounding doesn't come back.
+// Must not run concurrently with predict on the same network.
+void set_weight_format(network_t *network, weight_format_t format);
+weight_format_t network_weight_format(const network_t *network);
+
+// Switches predict to int8 weights and activations. Each layer's weights get
+// one scale per output column, and each layer's input one scale found by
+// running the calibration rows (a few hundred representative inputs) through
+// the float network. The float weights are kept, training or
+// clear_quantization goes back to them. Must not run concurrently with
+// predict on the same network.
+void quantize_network(network_t *network, matrix_t calibration);
+void clear_quantization(network_t *network);
+bool network_is_quantized(const network_t *network);
+
+// Bytes of weights and biases predict reads, in the current format or int8 when quantized
+size_t network_weight_bytes(const network_t *network);
+
+// Trains the network with minibatch SGD on softmax + categorical cross entropy.
+// y holds one class label per row of X. Rows are shuffled every epoch with a
+// permutation drawn from seed. Prints the loss and throughput of each epoch.
+// The network must not be used by anything else while it is training.
+void train(network_t *network, matrix_t X, matrix_t y, size_t epochs, size_t batch_size,
+           float learning_rate, uint64_t seed);
+
+// Same as train, but streams batches from a loader instead of holding the
+// whole dataset in memory. The loader decides the batch size and shuffling.
+void train_loader(network_t *network, data_loader_t *loader, size_t epochs, float learning_rate);
 #endif
@@ -0,0 +1,264 @@
+#ifdef __linux__
+#define _GNU_SOURCE // sched_getcpu, CPU_SET and pthread_setaffinity_np
+#endif
+
+#include "numa.h"
+
+#include <immintrin.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "include/threads.h"
+#include "thread_pool.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define MPOL_INTERLEAVE 3
+#endif
+
+// Below this the OS's own placement is as good, and the parallel zeroing
+// costs more than it saves
+#define PLACEMENT_MIN_BYTES (1 << 20)
+#define PAGE_SIZE 4096
+#define PLACED_ALIGNMENT 64
+#define PAGES_PER_CHUNK 16
+
+#define MAX_CPUS 1024
+
+static struct {
+    size_t num_nodes;
+    int node_ids[NUMA_MAX_NODES];    // The OS's number for each node
+    uint8_t cpu_node[MAX_CPUS];      // Node index of each CPU
+    size_t cpu_order[MAX_CPUS];      // Allowed CPUs, grouped by node
+    size_t num_cpus;
+} topology;
+
+enum { TOPOLOGY_UNKNOWN, TOPOLOGY_DETECTING, TOPOLOGY_READY };
+static atomic_int topology_state = TOPOLOGY_UNKNOWN;
+
+static atomic_int placement_state = -1;
+
+#ifdef __linux__
+// Marks the CPUs of a cpulist such as "0-7,16-23" as being on node
+static void read_cpulist(const char *list, uint8_t node, bool *on_node) {
+    const char *p = list;
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        unsigned long first = strtoul(p, &end, 10);
+        unsigned long last = first;
+        if (end == p) {
+            return;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+        }
+        for (unsigned long cpu = first; cpu <= last && cpu < MAX_CPUS; cpu++) {
+            topology.cpu_node[cpu] = node;
+            on_node[cpu] = true;
+        }
+        p = (*end == ',') ? end + 1 : end;
+    }
+}
+#endif
+
+static void detect_topology(void) {
+    topology.num_nodes = 1;
+    topology.node_ids[0] = 0;
+    topology.num_cpus = 0;
+
+    #ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_ZERO(&allowed);
+        CPU_SET(0, &allowed);
+    }
+
+    // Nodes can be numbered sparsely, and some have no CPUs (memory only)
+    static bool on_node[NUMA_MAX_NODES][MAX_CPUS];
+    size_t num_nodes = 0;
+    for (int id = 0; id < 256 && num_nodes < NUMA_MAX_NODES; id++) {
+        char path[64], list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL) {
+            continue;
+        }
+        bool read = fgets(list, sizeof(list), fp) != NULL;
+        fclose(fp);
+        if (!read) {
+            continue;
+        }
+        read_cpulist(list, (uint8_t)num_nodes, on_node[num_nodes]);
+
+        bool has_allowed_cpu = false;
+        for (size_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+            has_allowed_cpu |= on_node[num_nodes][cpu] && CPU_ISSET(cpu, &allowed);
+        }
+        if (has_allowed_cpu) {
+            topology.node_ids[num_nodes++] = id;
+        }
+    }
+    topology.num_nodes = (num_nodes > 0) ? num_nodes : 1;
+
+    for (size_t node = 0; node < topology.num_nodes; node++) {
+        for (size_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && (num_nodes == 0 || on_node[node][cpu])) {
+                topology.cpu_order[topology.num_cpus++] = cpu;
+            }
+        }
+    }
+    #elif defined(_WIN32)
+    DWORD_PTR process_mask, system_mask;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask)) {
+        process_mask = 1;
+    }
+    for (size_t cpu = 0; cpu < sizeof(DWORD_PTR) * 8; cpu++) {
+        if ((process_mask >> cpu) & 1) {
+            topology.cpu_order[topology.num_cpus++] = cpu;
+        }
+    }
+    #endif
+
+    if (topology.num_cpus == 0) {
+        topology.cpu_order[topology.num_cpus++] = 0;
+    }
+}
+
+static void ensure_topology(void) {
+    if (atomic_load(&topology_state) == TOPOLOGY_READY) {
+        return;
+    }
+    int expected = TOPOLOGY_UNKNOWN;
+    if (!atomic_compare_exchange_strong(&topology_state, &expected, TOPOLOGY_DETECTING)) {
+        while (atomic_load(&topology_state) != TOPOLOGY_READY) {
+            THREAD_YIELD();
+        }
+        return;
+    }
+    detect_topology();
+    atomic_store(&topology_state, TOPOLOGY_READY);
+}
+
+size_t numa_num_nodes(void) {
+    ensure_topology();
+    return topology.num_nodes;
+}
+
+size_t numa_current_node(void) {
+    ensure_topology();
+    #ifdef __linux__
+    int cpu = sched_getcpu();
+    return (cpu >= 0 && cpu < MAX_CPUS) ? topology.cpu_node[cpu] : 0;
+    #else
+    return 0;
+    #endif
+}
+
+size_t numa_pin_thread(size_t index) {
+    ensure_topology();
+    size_t cpu = topology.cpu_order[index % topology.num_cpus];
+
+    #ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        return numa_current_node();
+    }
+    return topology.cpu_node[cpu];
+    #elif defined(_WIN32)
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+    return 0;
+    #else
+    (void)cpu;
+    return 0;
+    #endif
+}
+
+size_t numa_pin_node(size_t index) {
+    ensure_topology();
+    #ifdef __linux__
+    return topology.cpu_node[topology.cpu_order[index % topology.num_cpus]];
+    #else
+    (void)index;
+    return 0;
+    #endif
+}
+
+placement_t memory_placement(void) {
+    int placement = atomic_load(&placement_state);
+    if (placement < 0) {
+        const char *env = getenv("NN_NUMA");
+        placement = PLACEMENT_DEFAULT;
+        if (env != NULL && strcmp(env, "first_touch") == 0) {
+            placement = PLACEMENT_FIRST_TOUCH;
+        } else if (env != NULL && strcmp(env, "interleave") == 0) {
+            placement = PLACEMENT_INTERLEAVE;
+        } else if (env != NULL && env[0] != '\0') {
+            fprintf(stderr, "Unknown NN_NUMA=%s (expected first_touch or interleave), ignoring it\n", env);
+        }
+        atomic_store(&placement_state, placement);
+    }
+    return (placement_t)placement;
+}
+
+void set_memory_placement(placement_t placement) {
+    atomic_store(&placement_state, (int)placement);
+}
+
+typedef struct {
+    char *values;
+    size_t bytes;
+} zero_args_t;
+
+static void zero_pages(void *context, size_t start, size_t end) {
+    zero_args_t *args = (zero_args_t *)context;
+    size_t first = start * PAGE_SIZE;
+    size_t last = (end * PAGE_SIZE < args->bytes) ? end * PAGE_SIZE : args->bytes;
+    memset(args->values + first, 0, last - first);
+}
+
+void *placed_calloc(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    zero_args_t args;
+    args.bytes = count * size;
+    args.values = _mm_malloc((args.bytes > 0) ? args.bytes : 1, PLACED_ALIGNMENT);
+    if (args.values == NULL) {
+        return NULL;
+    }
+
+    placement_t placement = memory_placement();
+    if (placement == PLACEMENT_DEFAULT || args.bytes < PLACEMENT_MIN_BYTES || numa_num_nodes() == 1) {
+        memset(args.values, 0, args.bytes);
+        return args.values;
+    }
+
+    #ifdef __linux__
+    // Only the whole pages inside the allocation, and only pages not faulted
+    // in yet move (memory the heap is reusing stays where it is)
+    if (placement == PLACEMENT_INTERLEAVE) {
+        uintptr_t start = ((uintptr_t)args.values + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+        uintptr_t end = ((uintptr_t)args.values + args.bytes) & ~(uintptr_t)(PAGE_SIZE - 1);
+        unsigned long mask = 0;
+        for (size_t node = 0; node < topology.num_nodes; node++) {
+            mask |= (topology.node_ids[node] < 64) ? 1UL << topology.node_ids[node] : 0;
+        }
+        if (end > start) {
+            syscall(SYS_mbind, start, end - start, MPOL_INTERLEAVE, &mask, sizeof(mask) * 8, 0);
+        }
+    }
+    #endif
+
+    // With first touch each page lands on the node of the thread that zeroes
+    // it. parallel_for gives each node the same fraction of any range, so the
+    // pages line up with the rows later loops hand to that node.
+    parallel_for((args.bytes + PAGE_SIZE - 1) / PAGE_SIZE, PAGES_PER_CHUNK, zero_pages, &args);
+    return args.values;
+}
@@ -0,0 +1,57 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+// NUMA topology, thread pinning and page placement, without libnuma.
+//
+// With NN_PIN_THREADS=1 (or thread_pool_set_pinning) the pool pins its
+// threads to the CPUs the process may run on, filling one node before the
+// next. Once pinned on a machine with several nodes, parallel_for splits its
+// chunks into one contiguous range per node, sized by the node's share of the
+// threads. Threads work through their own node's range first and only then
+// take chunks from the others, so a GEMM's row blocks, and the rows of A and C
+// they touch, stay with one node.
+//
+// NN_NUMA picks where the pages of large matrices go (see placed_calloc):
+//   first_touch  each page is first written by a thread of the node whose
+//                range of a parallel_for over the matrix covers it
+//   interleave   pages are spread round robin over the nodes, for data every
+//                node reads, like the weights
+// Anything else, or a single node, leaves placement to the OS.
+//
+// Only Linux reports nodes, other systems are treated as a single node.
+// Pinning also works on Windows (the first 64 CPUs).
+
+#define NUMA_MAX_NODES 8
+
+typedef enum {
+    PLACEMENT_DEFAULT,
+    PLACEMENT_FIRST_TOUCH,
+    PLACEMENT_INTERLEAVE
+} placement_t;
+
+// Nodes with CPUs this process may run on, at least 1, at most NUMA_MAX_NODES
+size_t numa_num_nodes(void);
+
+// Node of the CPU the calling thread is running on
+size_t numa_current_node(void);
+
+// Pins the calling thread to the index-th allowed CPU (wrapping around), in
+// node order. Returns the node of that CPU, or the current node if pinning
+// isn't supported.
+size_t numa_pin_thread(size_t index);
+
+// The node numa_pin_thread(index) would pin to
+size_t numa_pin_node(size_t index);
+
+placement_t memory_placement(void);
+void set_memory_placement(placement_t placement);
+
+// calloc(count, size), 64 byte aligned, with the pages placed by
+// memory_placement when the allocation is large enough for placement to
+// matter. Freed with _mm_free().
+void *placed_calloc(size_t count, size_t size);
+
+#endif
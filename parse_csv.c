@@ -1,10 +1,279 @@
 #include "parse_csv.h"
 
-#define BUFFER_SIZE 16384
-#define FLOAT_LENGTH 16
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
 
-static size_t count_cols(FILE* data, const char delimiter);
-static size_t count_rows(FILE* data);
+#include "include/timer.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+// The file is split into this many newline aligned chunks per thread, so
+// chunks with longer lines can be balanced out
+#define CHUNKS_PER_THREAD 4
+#define MIN_CHUNK_SIZE (64 * 1024)
+// Mantissa digits beyond this are dropped, they can't change a float anyway
+#define MAX_MANTISSA_DIGITS 19
+
+typedef struct {
+    const char *data;    // Start of the first data row, after the header
+    const char *end;     // End of the file
+    char delimiter;
+    size_t num_cols;
+    size_t output_column;
+    size_t num_chunks;
+    const char **chunk_starts; // num_chunks + 1 boundaries, each at the start of a line
+    size_t *chunk_rows;        // Rows in each chunk, then prefix summed to the first row of each chunk
+    matrix_t *X;
+    matrix_t *y;
+    const char **row_starts;   // Filled in instead of X and y when indexing
+} csv_job_t;
+
+static const double powers_of_ten[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static inline bool is_digit(char c) {
+    return (unsigned)(c - '0') < 10;
+}
+
+// Parses a decimal number (optional sign, digits, fraction and exponent)
+// starting at *cursor and leaves the cursor on the first character after it.
+// Anything fancier (inf, nan, hex floats) is handed to strtod.
+static float parse_float(const char **cursor, const char *end, char delimiter) {
+    const char *p = *cursor;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        p++;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    const char *digits_start = p;
+
+    for (; p < end && is_digit(*p); p++) {
+        if (digits < MAX_MANTISSA_DIGITS) {
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+            digits += (mantissa != 0);
+        } else {
+            exponent++;
+        }
+    }
+    if (p < end && *p == '.') {
+        p++;
+        for (; p < end && is_digit(*p); p++) {
+            if (digits < MAX_MANTISSA_DIGITS) {
+                mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+                digits += (mantissa != 0);
+                exponent--;
+            }
+        }
+    }
+    if (p == digits_start || (p == digits_start + 1 && *digits_start == '.')) {
+        // No digits at all, let strtod deal with it
+        char buffer[64];
+        size_t length = 0;
+        for (const char *q = *cursor; q < end && length < sizeof(buffer) - 1; q++) {
+            if (*q == delimiter || *q == '\r') {
+                break;
+            }
+            buffer[length++] = *q;
+        }
+        buffer[length] = '\0';
+        char *parsed_end;
+        float value = strtof(buffer, &parsed_end);
+        *cursor += (parsed_end - buffer);
+        return value;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *exponent_start = p++;
+        bool negative_exponent = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative_exponent = (*p == '-');
+            p++;
+        }
+        if (p < end && is_digit(*p)) {
+            int explicit_exponent = 0;
+            for (; p < end && is_digit(*p); p++) {
+                if (explicit_exponent < 10000) {
+                    explicit_exponent = explicit_exponent * 10 + (*p - '0');
+                }
+            }
+            exponent += negative_exponent ? -explicit_exponent : explicit_exponent;
+        } else {
+            p = exponent_start; // Not an exponent after all
+        }
+    }
+    *cursor = p;
+
+    double value = (double)mantissa;
+    if (exponent < 0) {
+        value = (-exponent <= 22) ? value / powers_of_ten[-exponent] : value * pow(10.0, exponent);
+    } else if (exponent > 0) {
+        value = (exponent <= 22) ? value * powers_of_ten[exponent] : value * pow(10.0, exponent);
+    }
+    return negative ? (float)-value : (float)value;
+}
+
+// Returns the end of the line starting at p, either its newline or end
+static inline const char *line_end(const char *p, const char *end) {
+    const char *newline = memchr(p, '\n', end - p);
+    return (newline != NULL) ? newline : end;
+}
+
+// Blank lines (including a lone \r) don't count as rows
+static inline bool is_blank(const char *start, const char *stop) {
+    return start == stop || (stop - start == 1 && *start == '\r');
+}
+
+static void count_chunk_rows(void *context, size_t start, size_t end) {
+    csv_job_t *job = (csv_job_t *)context;
+    for (size_t chunk = start; chunk < end; chunk++) {
+        size_t rows = 0;
+        const char *p = job->chunk_starts[chunk];
+        const char *chunk_end = job->chunk_starts[chunk + 1];
+        while (p < chunk_end) {
+            const char *stop = line_end(p, job->end);
+            rows += !is_blank(p, stop);
+            p = stop + 1;
+        }
+        job->chunk_rows[chunk] = rows;
+    }
+}
+
+// Parses the fields of a single line into x (num_cols - 1 values) and y
+static void parse_row(const char *p, const char *stop, char delimiter, size_t num_cols,
+                      size_t output_column, float *x_row, float *y_value) {
+    size_t col = 0;
+    for (; col < num_cols && p < stop; col++) {
+        float value = parse_float(&p, stop, delimiter);
+        if (col == output_column) {
+            *y_value = value;
+        } else {
+            x_row[col - (size_t)(col > output_column)] = value;
+        }
+        // Skip to the next field, ignoring anything left over in this one
+        while (p < stop && *p != delimiter) {
+            p++;
+        }
+        p++;
+    }
+    // Short rows are left as zeroes
+    for (; col < num_cols; col++) {
+        if (col == output_column) {
+            *y_value = 0;
+        } else {
+            x_row[col - (size_t)(col > output_column)] = 0;
+        }
+    }
+}
+
+// Parses every row of a chunk straight into its final place in X and y
+static void parse_chunk_rows(void *context, size_t start, size_t end) {
+    csv_job_t *job = (csv_job_t *)context;
+
+    for (size_t chunk = start; chunk < end; chunk++) {
+        size_t row = job->chunk_rows[chunk];
+        const char *p = job->chunk_starts[chunk];
+        const char *chunk_end = job->chunk_starts[chunk + 1];
+
+        while (p < chunk_end) {
+            const char *stop = line_end(p, job->end);
+            if (!is_blank(p, stop)) {
+                parse_row(p, stop, job->delimiter, job->num_cols, job->output_column,
+                          matrix_row(*job->X, row), &job->y->values[row]);
+                row++;
+            }
+            p = stop + 1;
+        }
+    }
+}
+
+// Records where each row of a chunk starts, without parsing it
+static void index_chunk_rows(void *context, size_t start, size_t end) {
+    csv_job_t *job = (csv_job_t *)context;
+    for (size_t chunk = start; chunk < end; chunk++) {
+        size_t row = job->chunk_rows[chunk];
+        const char *p = job->chunk_starts[chunk];
+        const char *chunk_end = job->chunk_starts[chunk + 1];
+        while (p < chunk_end) {
+            const char *stop = line_end(p, job->end);
+            if (!is_blank(p, stop)) {
+                job->row_starts[row++] = p;
+            }
+            p = stop + 1;
+        }
+    }
+}
+
+// Splits the mapped file into newline aligned chunks and counts the rows in
+// each one, leaving chunk_rows as the index of the first row of each chunk.
+// Returns the total number of rows. The caller frees chunk_starts and chunk_rows.
+static size_t split_and_count(csv_job_t *job, const mapped_file_t *file, const char delimiter,
+                              size_t output_column, bool is_header) {
+    const char *data = (const char *)file->data;
+    const char *end = data + file->size;
+
+    // The first line decides the number of columns
+    const char *first_line_end = (file->size > 0) ? line_end(data, end) : end;
+    size_t num_cols = 1;
+    for (const char *p = data; p < first_line_end; p++) {
+        num_cols += (size_t)(*p == delimiter);
+    }
+    assert(output_column < num_cols);
+
+    if (is_header) {
+        data = (first_line_end < end) ? first_line_end + 1 : end;
+    }
+
+    job->data = data;
+    job->end = end;
+    job->delimiter = delimiter;
+    job->num_cols = num_cols;
+    job->output_column = output_column;
+    job->X = NULL;
+    job->y = NULL;
+    job->row_starts = NULL;
+
+    size_t size = end - data;
+    size_t num_chunks = thread_pool_size() * CHUNKS_PER_THREAD;
+    if (size / num_chunks < MIN_CHUNK_SIZE) {
+        num_chunks = size / MIN_CHUNK_SIZE + 1;
+    }
+    job->chunk_starts = malloc((num_chunks + 1) * sizeof(char *));
+    job->chunk_rows = malloc(num_chunks * sizeof(size_t));
+    assert(job->chunk_starts != NULL && job->chunk_rows != NULL);
+
+    // Move every boundary forward to the start of the next line
+    job->chunk_starts[0] = data;
+    for (size_t i = 1; i < num_chunks; i++) {
+        const char *boundary = data + size / num_chunks * i;
+        if (boundary < job->chunk_starts[i - 1]) {
+            boundary = job->chunk_starts[i - 1];
+        }
+        if (boundary > data && boundary[-1] != '\n') {
+            boundary = line_end(boundary, end);
+            boundary = (boundary < end) ? boundary + 1 : end;
+        }
+        job->chunk_starts[i] = boundary;
+    }
+    job->chunk_starts[num_chunks] = end;
+    job->num_chunks = num_chunks;
+
+    parallel_for(num_chunks, 1, count_chunk_rows, job);
+
+    size_t num_rows = 0;
+    for (size_t i = 0; i < num_chunks; i++) {
+        size_t rows = job->chunk_rows[i];
+        job->chunk_rows[i] = num_rows;
+        num_rows += rows;
+    }
+    return num_rows;
+}
 
 // Converts csv file into useable matrices
 // Returns an array of 2 matrix_t structs, X and y
@@ -13,86 +282,89 @@ static size_t count_rows(FILE* data);
 // output_column: the index of the column containing the dependent variable
 // is_header: true if the file contains a header row, false otherwise
 matrix_t* read_csv(char* const filename, const char delimiter, size_t output_column, bool is_header) {
-    FILE* data = fopen(filename, "a+");
-    assert(data != NULL);
-    // File must end in newline for function to work correctly
-    assert(fputc('\n', data) != EOF);
-    rewind(data);
-    size_t num_cols = count_cols(data, delimiter);
-    size_t num_rows = count_rows(data) - (size_t) is_header;
-
-    float* dataframe = malloc(num_rows * num_cols * sizeof(float));
-
-    // Skip to the second line if there is a header
-    char buffer[BUFFER_SIZE];
-    if (is_header) {
-        fgets(buffer, BUFFER_SIZE, data);
-    }
-
-    for (size_t m = 0; m < num_rows; m++) {
-        size_t n = 0;
-        fgets(buffer, BUFFER_SIZE, data);
-        char ascii_float[FLOAT_LENGTH];
-        size_t index = 0;
-        for (char* letter = (char*) buffer; *letter != '\0'; letter++) {
-            if (*letter == delimiter || *letter == '\n') {
-                ascii_float[index] = '\0';
-                dataframe[m * num_cols + n] = atof(ascii_float);
-                n++;
-                index = 0;
-                continue;
-            }
-            ascii_float[index++] = *letter;
-        }
-    }
-    fclose(data);
+    return read_csv_timed(filename, delimiter, output_column, is_header, NULL);
+}
 
-    matrix_t X = zeroes(num_rows, num_cols - 1);
-    for (size_t i = 0; i < num_rows; i++) {
-        for (size_t j = 0; j < num_cols; j++) {
-            if (j != output_column) {
-                X.values[i * (num_cols - 1) + (j - (size_t) (j > output_column))] = dataframe[i * num_cols + j];
-            }
-        }
+// The file is mapped rather than read, then split into newline aligned chunks.
+// A quick parallel scan counts the rows in each chunk, which gives every chunk
+// the index of its first row. The chunks are then parsed in parallel, each
+// writing its rows directly into X and y.
+matrix_t* read_csv_timed(char* const filename, const char delimiter, size_t output_column,
+                         bool is_header, csv_stats_t *stats) {
+    double start_time = timer_seconds();
+    double trace_start_time = trace_begin();
+
+    mapped_file_t file;
+    if (!map_file(filename, false, &file)) {
+        perror(filename);
+        return NULL;
     }
 
-    matrix_t y = zeroes(num_rows, 1);
-    for (size_t i = 0; i < num_rows; i++) {
-        y.values[i] = dataframe[i * num_cols + output_column];
+    csv_job_t job;
+    size_t num_rows = split_and_count(&job, &file, delimiter, output_column, is_header);
+    size_t num_cols = job.num_cols;
+
+    matrix_t X = matrix_alloc(num_rows, num_cols - 1);
+    matrix_t y = matrix_alloc(num_rows, 1);
+    job.X = &X;
+    job.y = &y;
+
+    parallel_for(job.num_chunks, 1, parse_chunk_rows, &job);
+
+    free(job.chunk_starts);
+    free(job.chunk_rows);
+
+    if (stats != NULL) {
+        stats->bytes = file.size;
+        stats->rows = num_rows;
+        stats->seconds = timer_seconds() - start_time;
+        stats->megabytes_per_second = (stats->seconds > 0)
+            ? (double)file.size / (1024.0 * 1024.0) / stats->seconds : 0.0;
     }
-    free(dataframe);
+    // The text read, then X and y written
+    trace_end(trace_start_time, "csv", "read_csv",
+              (trace_args_t){.m = num_rows, .n = num_cols, .bytes = file.size + num_rows * num_cols * sizeof(float)});
+    unmap_file(&file);
 
     matrix_t* output = malloc(2 * sizeof(matrix_t));
+    assert(output != NULL);
     output[0] = X;
     output[1] = y;
     return output;
 }
 
-// Returns the number of columns in the csv file
-static size_t count_cols(FILE* data, const char delimiter) {
-    size_t count = 1;
-    char buffer[BUFFER_SIZE];
-    fgets(buffer, BUFFER_SIZE, data);
-
-    for (char* letter = (char*) buffer; *letter != '\0'; letter++) {
-        count += (size_t) (*letter == delimiter);
+bool open_csv(char* const filename, const char delimiter, size_t output_column, bool is_header, csv_file_t *csv) {
+    if (!map_file(filename, false, &csv->file)) {
+        perror(filename);
+        return false;
     }
-    rewind(data);
-    return count;
+
+    csv_job_t job;
+    csv->num_rows = split_and_count(&job, &csv->file, delimiter, output_column, is_header);
+    csv->num_cols = job.num_cols;
+    csv->output_column = output_column;
+    csv->delimiter = delimiter;
+    csv->end = job.end;
+    csv->row_starts = malloc((csv->num_rows > 0 ? csv->num_rows : 1) * sizeof(char *));
+    assert(csv->row_starts != NULL);
+    job.row_starts = csv->row_starts;
+
+    parallel_for(job.num_chunks, 1, index_chunk_rows, &job);
+
+    free(job.chunk_starts);
+    free(job.chunk_rows);
+    return true;
 }
 
-// Returns the number of rows in the csv file
-static size_t count_rows(FILE* data) {
-    size_t count = 0;
-    char buffer[BUFFER_SIZE];
+void read_csv_row(const csv_file_t *csv, size_t row, float *x, float *y) {
+    assert(row < csv->num_rows);
+    const char *start = csv->row_starts[row];
+    parse_row(start, line_end(start, csv->end), csv->delimiter, csv->num_cols,
+              csv->output_column, x, y);
+}
 
-    while (fgets(buffer, BUFFER_SIZE, data) != NULL) {
-        if (buffer[0] == '\n') {
-            rewind(data);
-            return count;
-        }
-        count++;
-    }
-    rewind(data);
-    return count;
+void close_csv(csv_file_t *csv) {
+    free(csv->row_starts);
+    csv->row_starts = NULL;
+    unmap_file(&csv->file);
 }
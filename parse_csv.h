@@ -5,8 +5,43 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdbool.h>
+#include "mapped_file.h"
 #include "matrix.h"
 
+typedef struct {
+    size_t bytes;      // Size of the file
+    size_t rows;       // Rows parsed, excluding the header
+    double seconds;    // Wall clock time, including mapping the file
+    double megabytes_per_second;
+} csv_stats_t;
+
+// Returns a malloc'd array of X and y, whose values are freed with free_matrix.
+// Prints why and returns NULL if the file can't be opened.
 matrix_t* read_csv(char* const filename, const char delimiter, size_t output_column, bool is_header);
 
+// Same as read_csv, filling in stats (if not NULL) with the parse throughput
+matrix_t* read_csv_timed(char* const filename, const char delimiter, size_t output_column,
+                         bool is_header, csv_stats_t *stats);
+
+// A csv file indexed by row, for parsing rows on demand rather than all at
+// once. Only the start of each row is kept in memory, the file itself stays
+// mapped (and paged in by the OS as rows are read) until close_csv.
+typedef struct {
+    mapped_file_t file;
+    const char **row_starts; // Start of every data row, blank lines are skipped
+    const char *end;
+    size_t num_rows;
+    size_t num_cols;         // Including the output column
+    size_t output_column;
+    char delimiter;
+} csv_file_t;
+
+// Maps and indexes a csv file. Prints why and returns false if it can't be opened.
+bool open_csv(char* const filename, const char delimiter, size_t output_column, bool is_header,
+              csv_file_t *csv);
+
+// Parses one row into x (num_cols - 1 values) and y (one value)
+void read_csv_row(const csv_file_t *csv, size_t row, float *x, float *y);
+void close_csv(csv_file_t *csv);
+
 #endif
@@ -0,0 +1,217 @@
+#include "qgemm.h"
+
+#include <assert.h>
+#include <immintrin.h>
+#include <math.h>
+#include <string.h>
+
+#include "thread_pool.h"
+#include "trace.h"
+
+// The weights are packed once, when they are quantized. Columns are grouped in
+// blocks of 8, and within a block each pair of rows is stored interleaved:
+//
+//   w[k][j], w[k+1][j], w[k][j+1], w[k+1][j+1], ... w[k+1][j+7]   (16 bytes)
+//
+// so one 16 byte load widened to int16 (vpmovsxbw) lines up with a pair of
+// activations broadcast to every 32 bit lane, and vpmaddwd multiplies and
+// adds both rows of the pair into 8 int32 sums at once. Widening to int16
+// before multiplying keeps the products exact, where vpmaddubsw would
+// saturate. |x|, |w| <= 127 so each pair adds at most 32258, and the int32
+// sums can't overflow for any k below 130000.
+//
+// Each micro-kernel call computes a QGEMM_MR x QGEMM_NR tile (2 column
+// blocks). The packed weights of a tile are k x 16 bytes, which stays in L1
+// for the layer sizes used here, so there is no further cache blocking.
+
+#define COLUMN_BLOCK 8
+
+static inline size_t round_up(size_t x, size_t multiple) {
+    return (x + multiple - 1) / multiple * multiple;
+}
+
+size_t qgemm_padded_k(size_t k) {
+    return round_up(k, 2);
+}
+
+static inline size_t padded_n(size_t n) {
+    return round_up(n, QGEMM_NR);
+}
+
+qweights_t quantize_weights(matrix_t weights) {
+    qweights_t q;
+    q.k = weights.m;
+    q.n = weights.n;
+    size_t k_pad = qgemm_padded_k(q.k);
+    size_t n_pad = padded_n(q.n);
+
+    q.values = _mm_malloc((k_pad * n_pad > 0 ? k_pad * n_pad : 1), 64);
+    q.scales = calloc(n_pad > 0 ? n_pad : 1, sizeof(float));
+    assert(q.values != NULL && q.scales != NULL);
+    memset(q.values, 0, k_pad * n_pad);
+
+    for (size_t j = 0; j < q.n; j++) {
+        float max = 0;
+        for (size_t i = 0; i < q.k; i++) {
+            float value = fabsf(matrix_row(weights, i)[j]);
+            max = (value > max) ? value : max;
+        }
+        q.scales[j] = (max > 0) ? max / 127.0f : 1.0f;
+    }
+
+    for (size_t j = 0; j < q.n; j++) {
+        int8_t *block = q.values + (j / COLUMN_BLOCK) * k_pad * COLUMN_BLOCK;
+        size_t column = j % COLUMN_BLOCK;
+        for (size_t i = 0; i < q.k; i++) {
+            float value = roundf(matrix_row(weights, i)[j] / q.scales[j]);
+            value = (value > 127.0f) ? 127.0f : (value < -127.0f) ? -127.0f : value;
+            block[(i / 2) * 2 * COLUMN_BLOCK + column * 2 + (i % 2)] = (int8_t)value;
+        }
+    }
+    return q;
+}
+
+void free_qweights(qweights_t *weights) {
+    _mm_free(weights->values);
+    free(weights->scales);
+    weights->values = NULL;
+    weights->scales = NULL;
+}
+
+size_t qweights_bytes(const qweights_t *weights) {
+    return qgemm_padded_k(weights->k) * padded_n(weights->n) + padded_n(weights->n) * sizeof(float);
+}
+
+void quantize_activations(size_t m, size_t k, const float *x, size_t ld, float scale, int16_t *xq) {
+    size_t k_pad = qgemm_padded_k(k);
+    __m256 inverse = _mm256_set1_ps(1.0f / scale);
+    __m256 upper = _mm256_set1_ps(127.0f);
+    __m256 lower = _mm256_set1_ps(-127.0f);
+
+    for (size_t i = 0; i < m; i++) {
+        const float *row = x + i * ld;
+        int16_t *out = xq + i * k_pad;
+        size_t j = 0;
+        for (; j + 16 <= k; j += 16) {
+            __m256 v0 = _mm256_mul_ps(_mm256_loadu_ps(row + j), inverse);
+            __m256 v1 = _mm256_mul_ps(_mm256_loadu_ps(row + j + 8), inverse);
+            v0 = _mm256_max_ps(_mm256_min_ps(v0, upper), lower);
+            v1 = _mm256_max_ps(_mm256_min_ps(v1, upper), lower);
+            // Rounds to nearest even, then packs the two halves back into order
+            __m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(v0), _mm256_cvtps_epi32(v1));
+            packed = _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+            _mm256_storeu_si256((__m256i *)(out + j), packed);
+        }
+        for (; j < k; j++) {
+            float value = nearbyintf(row[j] / scale);
+            value = (value > 127.0f) ? 127.0f : (value < -127.0f) ? -127.0f : value;
+            out[j] = (int16_t)value;
+        }
+        for (; j < k_pad; j++) {
+            out[j] = 0;
+        }
+    }
+}
+
+// Computes a QGEMM_MR x QGEMM_NR tile of A * W, scaled back to floats.
+// a points at the first row of the tile, b at its first packed column block.
+static void micro_kernel(size_t k_pairs, const int16_t *a[QGEMM_MR], const int8_t *b0,
+                         const int8_t *b1, const float *scales, float a_scale,
+                         float tile[QGEMM_MR * QGEMM_NR]) {
+    __m256i acc[QGEMM_MR][2];
+    for (size_t r = 0; r < QGEMM_MR; r++) {
+        acc[r][0] = _mm256_setzero_si256();
+        acc[r][1] = _mm256_setzero_si256();
+    }
+
+    for (size_t p = 0; p < k_pairs; p++) {
+        __m256i w0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(b0 + p * 2 * COLUMN_BLOCK)));
+        __m256i w1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(b1 + p * 2 * COLUMN_BLOCK)));
+        for (size_t r = 0; r < QGEMM_MR; r++) {
+            int32_t pair;
+            memcpy(&pair, a[r] + 2 * p, sizeof(pair));
+            __m256i x = _mm256_set1_epi32(pair);
+            acc[r][0] = _mm256_add_epi32(acc[r][0], _mm256_madd_epi16(x, w0));
+            acc[r][1] = _mm256_add_epi32(acc[r][1], _mm256_madd_epi16(x, w1));
+        }
+    }
+
+    __m256 scale0 = _mm256_mul_ps(_mm256_loadu_ps(scales), _mm256_set1_ps(a_scale));
+    __m256 scale1 = _mm256_mul_ps(_mm256_loadu_ps(scales + COLUMN_BLOCK), _mm256_set1_ps(a_scale));
+    for (size_t r = 0; r < QGEMM_MR; r++) {
+        _mm256_storeu_ps(tile + r * QGEMM_NR, _mm256_mul_ps(_mm256_cvtepi32_ps(acc[r][0]), scale0));
+        _mm256_storeu_ps(tile + r * QGEMM_NR + COLUMN_BLOCK,
+                         _mm256_mul_ps(_mm256_cvtepi32_ps(acc[r][1]), scale1));
+    }
+}
+
+typedef struct {
+    size_t m;
+    const int16_t *a;
+    float a_scale;
+    const qweights_t *w;
+    float *c;
+    size_t ldc;
+    const gemm_epilogue_t *epilogue;
+    size_t num_row_tiles;
+} qgemm_args_t;
+
+// Tasks are numbered column tile first, so consecutive tasks reuse the same
+// packed weights while they are in L1
+static void run_tiles(void *context, size_t start, size_t end) {
+    qgemm_args_t *args = (qgemm_args_t *)context;
+    const qweights_t *w = args->w;
+    size_t k_pad = qgemm_padded_k(w->k);
+    float tile[QGEMM_MR * QGEMM_NR];
+
+    for (size_t task = start; task < end; task++) {
+        size_t i = (task % args->num_row_tiles) * QGEMM_MR;
+        size_t j = (task / args->num_row_tiles) * QGEMM_NR;
+        size_t rows = (args->m - i < QGEMM_MR) ? args->m - i : QGEMM_MR;
+        size_t cols = (w->n - j < QGEMM_NR) ? w->n - j : QGEMM_NR;
+
+        // Rows past the edge repeat the last row, their results are dropped
+        const int16_t *a[QGEMM_MR];
+        for (size_t r = 0; r < QGEMM_MR; r++) {
+            a[r] = args->a + (i + (r < rows ? r : rows - 1)) * k_pad;
+        }
+        const int8_t *b0 = w->values + (j / COLUMN_BLOCK) * k_pad * COLUMN_BLOCK;
+        micro_kernel(k_pad / 2, a, b0, b0 + k_pad * COLUMN_BLOCK, w->scales + j, args->a_scale, tile);
+
+        const float *bias = (args->epilogue != NULL) ? args->epilogue->bias : NULL;
+        for (size_t r = 0; r < rows; r++) {
+            float *row = args->c + (i + r) * args->ldc + j;
+            for (size_t col = 0; col < cols; col++) {
+                row[col] = tile[r * QGEMM_NR + col] + ((bias != NULL) ? bias[j + col] : 0.0f);
+            }
+            if (args->epilogue != NULL && args->epilogue->activation != NULL) {
+                args->epilogue->activation(row, row, cols);
+            }
+        }
+    }
+}
+
+void qgemm_fused(size_t m, const int16_t *a, float a_scale, const qweights_t *w,
+                 float *c, size_t ldc, const gemm_epilogue_t *epilogue) {
+    if (m == 0 || w->n == 0) {
+        return;
+    }
+    double trace_start_time = trace_begin();
+    qgemm_args_t args;
+    args.m = m;
+    args.a = a;
+    args.a_scale = a_scale;
+    args.w = w;
+    args.c = c;
+    args.ldc = ldc;
+    args.epilogue = epilogue;
+    args.num_row_tiles = (m + QGEMM_MR - 1) / QGEMM_MR;
+    size_t num_col_tiles = padded_n(w->n) / QGEMM_NR;
+
+    parallel_for(args.num_row_tiles * num_col_tiles, 0, run_tiles, &args);
+
+    // The int16 activations, the int8 weights and their scales, and C
+    trace_end(trace_start_time, "qgemm", gemm_trace_name(epilogue),
+              (trace_args_t){.m = m, .k = w->k, .n = w->n,
+                             .bytes = m * w->k * sizeof(int16_t) + qweights_bytes(w) + m * w->n * sizeof(float)});
+}
@@ -0,0 +1,45 @@
+#ifndef QGEMM_H
+#define QGEMM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "gemm.h"
+#include "matrix.h"
+
+// Int8 matrix multiplication for quantized inference. Weights are int8 with
+// one scale per output column, activations are int8 values held in int16
+// with one scale per matrix, and products are accumulated exactly in int32.
+// Needs AVX2.
+
+// Shape of the register tile computed by the micro-kernel
+#define QGEMM_MR 4
+#define QGEMM_NR 16
+
+typedef struct {
+    int8_t *values; // Packed for the micro-kernel, see qgemm.c
+    float *scales;  // n values, column j was quantized as round(w / scales[j])
+    size_t k;       // Shape of the float matrix that was quantized
+    size_t n;
+} qweights_t;
+
+// Symmetric per column quantization, the largest magnitude in each column maps to 127
+qweights_t quantize_weights(matrix_t weights);
+void free_qweights(qweights_t *weights);
+
+// Bytes taken up by the packed values and scales
+size_t qweights_bytes(const qweights_t *weights);
+
+// Activation rows are padded to an even length, this is the padded length
+size_t qgemm_padded_k(size_t k);
+
+// Quantizes an m x k matrix (rows ld floats apart) as round(x / scale),
+// clamped to [-127, 127], into m rows of qgemm_padded_k(k) int16 values
+void quantize_activations(size_t m, size_t k, const float *x, size_t ld, float scale, int16_t *xq);
+
+// C = activation((A * W) * (a_scale * w.scales) + bias), where A is m rows
+// of quantized activations from quantize_activations and C is m x w.n floats
+void qgemm_fused(size_t m, const int16_t *a, float a_scale, const qweights_t *w,
+                 float *c, size_t ldc, const gemm_epilogue_t *epilogue);
+
+#endif
@@ -0,0 +1,161 @@
+// Load generator for the inference server. Each connection sends random
+// samples one at a time and waits for the answer, and the client reports the
+// latency it saw end to end.
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../include/random.h"
+#include "../include/threads.h"
+#include "../include/timer.h"
+#include "protocol.h"
+
+#define DEFAULT_SOCKET "/tmp/nn.sock"
+
+typedef struct {
+    const char *socket_path;
+    size_t num_requests;
+    uint64_t seed;
+    float *latencies; // num_requests, in microseconds
+    bool failed;
+} client_t;
+
+static bool read_full(int fd, void *buffer, size_t size) {
+    char *p = (char *)buffer;
+    while (size > 0) {
+        ssize_t count = read(fd, p, size);
+        if (count <= 0) {
+            return false;
+        }
+        p += count;
+        size -= (size_t)count;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *buffer, size_t size) {
+    const char *p = (const char *)buffer;
+    while (size > 0) {
+        ssize_t count = write(fd, p, size);
+        if (count <= 0) {
+            return false;
+        }
+        p += count;
+        size -= (size_t)count;
+    }
+    return true;
+}
+
+static THREAD_ENTRY client_main(thread_func_param_t arg) {
+    client_t *client = (client_t *)arg;
+    client->failed = true;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, client->socket_path, sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        perror(client->socket_path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return (thread_func_return_t)(uintptr_t)NULL;
+    }
+
+    hello_t hello;
+    if (!read_full(fd, &hello, sizeof(hello)) || hello.version != PROTOCOL_VERSION) {
+        close(fd);
+        return (thread_func_return_t)(uintptr_t)NULL;
+    }
+    float *features = malloc(hello.num_features * sizeof(float));
+    float *distribution = malloc(hello.num_classes * sizeof(float));
+    assert(features != NULL && distribution != NULL);
+
+    size_t completed = 0;
+    for (; completed < client->num_requests; completed++) {
+        for (uint32_t i = 0; i < hello.num_features; i++) {
+            features[i] = (float)(splitmix64(&client->seed) >> 40) / (float)(1 << 24);
+        }
+        request_header_t header;
+        header.num_features = hello.num_features;
+
+        double start = timer_seconds();
+        response_header_t response;
+        bool ok = write_full(fd, &header, sizeof(header)) &&
+                  write_full(fd, features, hello.num_features * sizeof(float)) &&
+                  read_full(fd, &response, sizeof(response)) &&
+                  response.status == STATUS_OK &&
+                  read_full(fd, distribution, response.num_classes * sizeof(float));
+        if (!ok) {
+            break;
+        }
+        client->latencies[completed] = (float)((timer_seconds() - start) * 1e6);
+    }
+    client->failed = (completed != client->num_requests);
+
+    free(features);
+    free(distribution);
+    close(fd);
+    return (thread_func_return_t)(uintptr_t)NULL;
+}
+
+static int compare_floats(const void *a, const void *b) {
+    float x = *(const float *)a;
+    float y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    const char *socket_path = (argc > 1) ? argv[1] : DEFAULT_SOCKET;
+    size_t num_requests = (argc > 2) ? (size_t)atol(argv[2]) : 1000;
+    size_t num_connections = (argc > 3) ? (size_t)atol(argv[3]) : 16;
+    if (num_requests == 0 || num_connections == 0) {
+        fprintf(stderr, "Usage: %s [socket] [requests per connection] [connections]\n", argv[0]);
+        return 1;
+    }
+
+    client_t *clients = calloc(num_connections, sizeof(client_t));
+    thread_t *threads = malloc(num_connections * sizeof(thread_t));
+    float *latencies = malloc(num_requests * num_connections * sizeof(float));
+    assert(clients != NULL && threads != NULL && latencies != NULL);
+
+    double start = timer_seconds();
+    for (size_t i = 0; i < num_connections; i++) {
+        clients[i].socket_path = socket_path;
+        clients[i].num_requests = num_requests;
+        clients[i].seed = i + 1;
+        clients[i].latencies = &latencies[i * num_requests];
+        THREAD_CREATE(threads[i], client_main, &clients[i]);
+    }
+    THREAD_JOIN_AND_CLOSE(threads, num_connections);
+    double elapsed = timer_seconds() - start;
+
+    bool failed = false;
+    for (size_t i = 0; i < num_connections; i++) {
+        if (clients[i].failed) {
+            fprintf(stderr, "Connection %zu failed\n", i);
+            failed = true;
+        }
+    }
+
+    if (!failed) {
+        size_t total = num_requests * num_connections;
+        qsort(latencies, total, sizeof(float), compare_floats);
+        printf("%zu requests over %zu connections in %.3f s, %.0f requests/sec, "
+               "latency p50 %.0f us, p99 %.0f us, max %.0f us\n",
+               total, num_connections, elapsed, total / elapsed,
+               latencies[(total - 1) / 2], latencies[(size_t)((total - 1) * 0.99)], latencies[total - 1]);
+    }
+
+    free(clients);
+    free(threads);
+    free(latencies);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,432 @@
+#include "inference_server.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../include/threads.h"
+#include "../include/timer.h"
+#include "protocol.h"
+
+// Latencies of the most recent requests, used for the percentiles
+#define LATENCY_SAMPLES 65536
+#define LISTEN_BACKLOG 128
+
+// A request waiting for its batch. Lives on the stack of its connection
+// thread, which sleeps on finished until the batcher fills in the result.
+typedef struct pending {
+    const float *features;
+    float *distribution;
+    size_t prediction;
+    double enqueued;
+    bool done;
+    cond_t finished;
+    struct pending *next;
+} pending_t;
+
+typedef struct connection {
+    int fd;
+    inference_server_t *server;
+    struct connection *next;
+} connection_t;
+
+struct inference_server {
+    network_t *network;
+    server_config_t config;
+    size_t num_features;
+    size_t num_classes;
+    int listen_fd;
+    thread_t acceptor;
+    thread_t batcher;
+
+    // Requests waiting to be batched
+    mutex_t queue_lock;
+    cond_t work_available;
+    pending_t *head;
+    pending_t *tail;
+    size_t queued;
+    bool stopping;
+
+    // Open connections, each served by its own detached thread
+    mutex_t connection_lock;
+    cond_t connections_closed;
+    connection_t *connections;
+    size_t num_connections;
+
+    // Guarded by stats_lock
+    mutex_t stats_lock;
+    double stats_start;
+    size_t requests;
+    size_t batches;
+    float *latencies;     // Ring of the last LATENCY_SAMPLES latencies in microseconds
+    size_t num_latencies; // Total recorded, the ring holds the last LATENCY_SAMPLES of them
+};
+
+// Both return false if the connection was closed or broke before everything
+// was transferred
+static bool read_full(int fd, void *buffer, size_t size) {
+    char *p = (char *)buffer;
+    while (size > 0) {
+        ssize_t count = read(fd, p, size);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        p += count;
+        size -= (size_t)count;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *buffer, size_t size) {
+    const char *p = (const char *)buffer;
+    while (size > 0) {
+        ssize_t count = send(fd, p, size, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        p += count;
+        size -= (size_t)count;
+    }
+    return true;
+}
+
+static void record_batch(inference_server_t *server, pending_t **batch, size_t rows, double now) {
+    MUTEX_LOCK(server->stats_lock);
+    for (size_t i = 0; i < rows; i++) {
+        float latency = (float)((now - batch[i]->enqueued) * 1e6);
+        server->latencies[server->num_latencies % LATENCY_SAMPLES] = latency;
+        server->num_latencies++;
+    }
+    server->requests += rows;
+    server->batches++;
+    MUTEX_UNLOCK(server->stats_lock);
+}
+
+// Waits for the first request, then for the batch to fill up or for
+// max_wait_us to pass since that request arrived, whichever comes first.
+// Everything queued (up to max_batch) goes through one predict call.
+static THREAD_ENTRY batcher_main(thread_func_param_t arg) {
+    inference_server_t *server = (inference_server_t *)arg;
+    size_t max_batch = server->config.max_batch;
+    double max_wait = server->config.max_wait_us * 1e-6;
+
+    matrix_t X = zeroes(max_batch, server->num_features);
+    result_t *results = malloc(max_batch * sizeof(result_t));
+    float *distributions = malloc(max_batch * server->num_classes * sizeof(float));
+    pending_t **batch = malloc(max_batch * sizeof(pending_t *));
+    assert(results != NULL && distributions != NULL && batch != NULL);
+
+    while (true) {
+        MUTEX_LOCK(server->queue_lock);
+        while (server->queued == 0 && !server->stopping) {
+            COND_WAIT(server->work_available, server->queue_lock);
+        }
+        if (server->queued == 0) {
+            MUTEX_UNLOCK(server->queue_lock);
+            break; // Stopping, and nothing left to answer
+        }
+        double deadline = server->head->enqueued + max_wait;
+        double now;
+        while (server->queued < max_batch && !server->stopping && (now = timer_seconds()) < deadline) {
+            COND_TIMEDWAIT(server->work_available, server->queue_lock, deadline - now);
+        }
+
+        size_t rows = 0;
+        while (rows < max_batch && server->head != NULL) {
+            batch[rows++] = server->head;
+            server->head = server->head->next;
+        }
+        if (server->head == NULL) {
+            server->tail = NULL;
+        }
+        server->queued -= rows;
+        MUTEX_UNLOCK(server->queue_lock);
+
+        for (size_t i = 0; i < rows; i++) {
+            memcpy(matrix_row(X, i), batch[i]->features, X.n * sizeof(float));
+        }
+        matrix_t input = X;
+        input.m = rows;
+        predict(server->network, input, results, distributions);
+
+        double finished = timer_seconds();
+        record_batch(server, batch, rows, finished);
+
+        // Hand every result back to the thread waiting on it
+        MUTEX_LOCK(server->queue_lock);
+        for (size_t i = 0; i < rows; i++) {
+            pending_t *request = batch[i];
+            request->prediction = results[i].prediction;
+            memcpy(request->distribution, results[i].distribution, server->num_classes * sizeof(float));
+            request->done = true;
+            COND_SIGNAL(request->finished);
+        }
+        MUTEX_UNLOCK(server->queue_lock);
+    }
+
+    free_matrix(X);
+    free(results);
+    free(distributions);
+    free(batch);
+    return (thread_func_return_t)(uintptr_t)NULL;
+}
+
+// Queues a request and sleeps until the batcher has answered it
+static void submit(inference_server_t *server, pending_t *request) {
+    MUTEX_LOCK(server->queue_lock);
+    request->enqueued = timer_seconds();
+    request->done = false;
+    request->next = NULL;
+    if (server->tail != NULL) {
+        server->tail->next = request;
+    } else {
+        server->head = request;
+    }
+    server->tail = request;
+    server->queued++;
+    // Only the batch filling up or the first request of a batch matter to the batcher
+    if (server->queued == 1 || server->queued >= server->config.max_batch) {
+        COND_SIGNAL(server->work_available);
+    }
+    while (!request->done) {
+        COND_WAIT(request->finished, server->queue_lock);
+    }
+    MUTEX_UNLOCK(server->queue_lock);
+}
+
+static void remove_connection(inference_server_t *server, connection_t *connection) {
+    MUTEX_LOCK(server->connection_lock);
+    connection_t **link = &server->connections;
+    while (*link != connection) {
+        link = &(*link)->next;
+    }
+    *link = connection->next;
+    server->num_connections--;
+    COND_BROADCAST(server->connections_closed);
+    MUTEX_UNLOCK(server->connection_lock);
+}
+
+static THREAD_ENTRY connection_main(thread_func_param_t arg) {
+    connection_t *connection = (connection_t *)arg;
+    inference_server_t *server = connection->server;
+    int fd = connection->fd;
+
+    float *features = malloc(server->num_features * sizeof(float));
+    float *distribution = malloc(server->num_classes * sizeof(float));
+    assert(features != NULL && distribution != NULL);
+
+    pending_t request;
+    request.features = features;
+    request.distribution = distribution;
+    COND_INIT(request.finished);
+
+    hello_t hello;
+    hello.version = PROTOCOL_VERSION;
+    hello.num_features = (uint32_t)server->num_features;
+    hello.num_classes = (uint32_t)server->num_classes;
+    bool open = write_full(fd, &hello, sizeof(hello));
+
+    request_header_t header;
+    while (open && read_full(fd, &header, sizeof(header))) {
+        response_header_t response;
+        response.num_classes = (uint32_t)server->num_classes;
+        response.prediction = 0;
+
+        if (header.num_features != server->num_features) {
+            // A longer payload isn't read at all, the client decides its size.
+            // A shorter one fits in the features buffer, so it is skipped in
+            // one read and the next request can still be read.
+            response.status = STATUS_BAD_REQUEST;
+            if (header.num_features > server->num_features) {
+                write_full(fd, &response, sizeof(response));
+                break;
+            }
+            open = read_full(fd, features, header.num_features * sizeof(float)) &&
+                   write_full(fd, &response, sizeof(response));
+            continue;
+        }
+
+        if (!read_full(fd, features, server->num_features * sizeof(float))) {
+            break;
+        }
+        submit(server, &request);
+
+        response.status = STATUS_OK;
+        response.prediction = (uint32_t)request.prediction;
+        open = write_full(fd, &response, sizeof(response)) &&
+               write_full(fd, distribution, server->num_classes * sizeof(float));
+    }
+
+    COND_DESTROY(request.finished);
+    free(features);
+    free(distribution);
+    close(fd);
+    remove_connection(server, connection);
+    free(connection);
+    pthread_detach(pthread_self());
+    return (thread_func_return_t)(uintptr_t)NULL;
+}
+
+static THREAD_ENTRY acceptor_main(thread_func_param_t arg) {
+    inference_server_t *server = (inference_server_t *)arg;
+    while (true) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break; // The listening socket was shut down
+        }
+
+        connection_t *connection = malloc(sizeof(connection_t));
+        assert(connection != NULL);
+        connection->fd = fd;
+        connection->server = server;
+
+        MUTEX_LOCK(server->connection_lock);
+        connection->next = server->connections;
+        server->connections = connection;
+        server->num_connections++;
+        MUTEX_UNLOCK(server->connection_lock);
+
+        thread_t thread;
+        THREAD_CREATE(thread, connection_main, connection);
+    }
+    return (thread_func_return_t)(uintptr_t)NULL;
+}
+
+inference_server_t *server_start(network_t *network, const server_config_t *config) {
+    assert(config->max_batch > 0);
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(config->socket_path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(address.sun_path, config->socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    unlink(config->socket_path); // Left over from a server that didn't shut down cleanly
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, LISTEN_BACKLOG) != 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+
+    inference_server_t *server = calloc(1, sizeof(inference_server_t));
+    assert(server != NULL);
+    server->network = network;
+    server->config = *config;
+    server->num_features = network_num_inputs(network);
+    server->num_classes = network_num_classes(network);
+    server->listen_fd = fd;
+
+    MUTEX_INIT(server->queue_lock);
+    COND_INIT(server->work_available);
+    MUTEX_INIT(server->connection_lock);
+    COND_INIT(server->connections_closed);
+    MUTEX_INIT(server->stats_lock);
+    server->latencies = malloc(LATENCY_SAMPLES * sizeof(float));
+    assert(server->latencies != NULL);
+    server->stats_start = timer_seconds();
+
+    THREAD_CREATE(server->batcher, batcher_main, server);
+    THREAD_CREATE(server->acceptor, acceptor_main, server);
+    return server;
+}
+
+void server_stop(inference_server_t *server) {
+    void *result;
+
+    // No new connections
+    shutdown(server->listen_fd, SHUT_RDWR);
+    THREAD_JOIN(server->acceptor, result);
+    close(server->listen_fd);
+    unlink(server->config.socket_path);
+
+    // Wake every connection thread blocked on a read, any request already
+    // submitted is still answered by the batcher before its thread exits
+    MUTEX_LOCK(server->connection_lock);
+    for (connection_t *connection = server->connections; connection != NULL; connection = connection->next) {
+        shutdown(connection->fd, SHUT_RDWR);
+    }
+    while (server->num_connections > 0) {
+        COND_WAIT(server->connections_closed, server->connection_lock);
+    }
+    MUTEX_UNLOCK(server->connection_lock);
+
+    MUTEX_LOCK(server->queue_lock);
+    server->stopping = true;
+    COND_SIGNAL(server->work_available);
+    MUTEX_UNLOCK(server->queue_lock);
+    THREAD_JOIN(server->batcher, result);
+    (void)result;
+
+    MUTEX_DESTROY(server->queue_lock);
+    COND_DESTROY(server->work_available);
+    MUTEX_DESTROY(server->connection_lock);
+    COND_DESTROY(server->connections_closed);
+    MUTEX_DESTROY(server->stats_lock);
+    free(server->latencies);
+    free(server);
+}
+
+static int compare_floats(const void *a, const void *b) {
+    float x = *(const float *)a;
+    float y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+server_stats_t server_stats(inference_server_t *server, bool reset) {
+    server_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+
+    MUTEX_LOCK(server->stats_lock);
+    double now = timer_seconds();
+    stats.requests = server->requests;
+    stats.batches = server->batches;
+    stats.seconds = now - server->stats_start;
+    size_t count = (server->num_latencies < LATENCY_SAMPLES) ? server->num_latencies : LATENCY_SAMPLES;
+    float *sorted = malloc((count > 0 ? count : 1) * sizeof(float));
+    assert(sorted != NULL);
+    memcpy(sorted, server->latencies, count * sizeof(float));
+    if (reset) {
+        server->requests = 0;
+        server->batches = 0;
+        server->num_latencies = 0;
+        server->stats_start = now;
+    }
+    MUTEX_UNLOCK(server->stats_lock);
+
+    if (stats.seconds > 0) {
+        stats.requests_per_second = stats.requests / stats.seconds;
+    }
+    if (stats.batches > 0) {
+        stats.mean_batch = (double)stats.requests / stats.batches;
+    }
+    if (count > 0) {
+        qsort(sorted, count, sizeof(float), compare_floats);
+        stats.p50_us = sorted[(count - 1) / 2];
+        stats.p99_us = sorted[(size_t)((count - 1) * 0.99)];
+        stats.max_us = sorted[count - 1];
+    }
+    free(sorted);
+    return stats;
+}
@@ -0,0 +1,44 @@
+#ifndef INFERENCE_SERVER_H
+#define INFERENCE_SERVER_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "../neural_network.h"
+
+// A daemon that answers single sample requests over a Unix domain socket (see
+// protocol.h). Requests from every connection are coalesced into one batch of
+// up to max_batch rows, or whatever has arrived max_wait_us after the first
+// one, and each batch is a single call to predict. POSIX only.
+
+typedef struct {
+    const char *socket_path;
+    size_t max_batch;     // Most rows per predict call
+    double max_wait_us;   // How long the first request of a batch waits for others
+} server_config_t;
+
+// Counted since the server started, or since the last reset
+typedef struct {
+    size_t requests;
+    size_t batches;
+    double seconds;
+    double requests_per_second;
+    double mean_batch;
+    double p50_us;        // Latency from reading a request to its result being ready
+    double p99_us;
+    double max_us;
+} server_stats_t;
+
+typedef struct inference_server inference_server_t;
+
+// Binds the socket and starts serving on background threads. network must
+// outlive the server. Returns NULL (with errno set) if the socket can't be set up.
+inference_server_t *server_start(network_t *network, const server_config_t *config);
+
+// Stops accepting, finishes the requests already queued, closes every
+// connection and removes the socket file
+void server_stop(inference_server_t *server);
+
+server_stats_t server_stats(inference_server_t *server, bool reset);
+
+#endif
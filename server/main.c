@@ -0,0 +1,87 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../matrix.h"
+#include "../neural_network.h"
+#include "../thread_pool.h"
+#include "inference_server.h"
+
+#define DEFAULT_SOCKET "/tmp/nn.sock"
+#define DEFAULT_MAX_BATCH 64
+#define DEFAULT_MAX_WAIT_US 500
+#define STATS_INTERVAL 5 // Seconds between stats reports
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_signal(int signal) {
+    (void)signal;
+    stop_requested = 1;
+}
+
+static void print_stats(const server_stats_t *stats) {
+    printf("%zu requests in %zu batches (mean batch %.1f), %.0f requests/sec, "
+           "latency p50 %.0f us, p99 %.0f us, max %.0f us\n",
+           stats->requests, stats->batches, stats->mean_batch, stats->requests_per_second,
+           stats->p50_us, stats->p99_us, stats->max_us);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s model [socket] [max batch] [max wait us]\n", argv[0]);
+        return 1;
+    }
+
+    server_config_t config;
+    config.socket_path = (argc > 2) ? argv[2] : DEFAULT_SOCKET;
+    config.max_batch = (argc > 3) ? (size_t)atol(argv[3]) : DEFAULT_MAX_BATCH;
+    config.max_wait_us = (argc > 4) ? atof(argv[4]) : DEFAULT_MAX_WAIT_US;
+    if (config.max_batch == 0) {
+        fprintf(stderr, "max batch must be at least 1\n");
+        return 1;
+    }
+
+    determine_cache();
+    thread_pool_init(0);
+    network_t *network = load_network(argv[1], config.max_batch);
+    if (network == NULL) {
+        return 1;
+    }
+
+    struct sigaction action;
+    action.sa_handler = handle_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0; // No SA_RESTART, so sleep returns straight away
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    inference_server_t *server = server_start(network, &config);
+    if (server == NULL) {
+        perror(config.socket_path);
+        return 1;
+    }
+    printf("Serving %s on %s, batches of up to %zu rows or %.0f us\n",
+           argv[1], config.socket_path, config.max_batch, config.max_wait_us);
+    fflush(stdout);
+
+    while (!stop_requested) {
+        sleep(STATS_INTERVAL);
+        server_stats_t stats = server_stats(server, true);
+        if (stats.requests > 0) {
+            print_stats(&stats);
+        }
+    }
+
+    // Whatever came in since the last report
+    server_stats_t stats = server_stats(server, false);
+    server_stop(server);
+    if (stats.requests > 0) {
+        print_stats(&stats);
+    }
+
+    free_network(network);
+    thread_pool_shutdown();
+    return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+// Wire format between the inference server and its clients, over a Unix
+// domain stream socket. Everything is in host byte order, both ends are on
+// the same machine.
+//
+//   server -> client, once on connect:  hello_t
+//   client -> server, per sample:       request_header_t, num_features floats
+//   server -> client, per sample:       response_header_t, num_classes floats
+//
+// A connection can send any number of requests, each one is answered in order.
+// A request with the wrong number of features gets STATUS_BAD_REQUEST, and if
+// it has more than num_features the server closes the connection after it.
+
+#define PROTOCOL_VERSION 1
+
+typedef struct {
+    uint32_t version;
+    uint32_t num_features; // Floats the server expects in every request
+    uint32_t num_classes;  // Floats in every response distribution
+} hello_t;
+
+typedef struct {
+    uint32_t num_features;
+} request_header_t;
+
+typedef enum { STATUS_OK = 0, STATUS_BAD_REQUEST = 1 } response_status_t;
+
+typedef struct {
+    uint32_t status;      // response_status_t, no distribution follows unless STATUS_OK
+    uint32_t prediction;
+    uint32_t num_classes;
+} response_header_t;
+
+#endif
@@ -0,0 +1,384 @@
+#include "thread_pool.h"
+
+#include <assert.h>
+#include <immintrin.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "include/threads.h"
+#include "numa.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+// Number of chunks each thread gets when the caller lets us pick the grain.
+// More than one per thread so that uneven chunks can be balanced out.
+#define CHUNKS_PER_THREAD 4
+
+// The chunks of a job set aside for the threads of one NUMA node. Each on
+// its own cache line, the threads of different nodes claim from them at once.
+typedef struct {
+    _Alignas(64) atomic_size_t next_chunk;
+    size_t end_chunk;
+} job_part_t;
+
+// A single parallel_for call. Lives on the caller's stack, and stays in the
+// queue until the caller removes it, so any job reachable from the queue is valid.
+typedef struct job {
+    parallel_func_t func;
+    void *context;
+    size_t count;
+    size_t grain;
+    job_part_t parts[NUMA_MAX_NODES]; // Only the first when the pool isn't split by node
+    size_t num_parts;
+    size_t active_workers; // Workers currently inside the job, guarded by the pool lock
+    struct job *next;
+} job_t;
+
+enum { POOL_UNINITIALISED, POOL_INITIALISING, POOL_READY };
+
+static struct {
+    thread_t *workers;
+    size_t num_workers;
+    mutex_t lock;
+    cond_t work_available;
+    cond_t job_finished;
+    job_t *head;
+    job_t *tail;
+    bool shutting_down;
+    bool pinned;
+    size_t num_parts;                     // Nodes the jobs are split over, 1 unless pinned
+    size_t node_threads[NUMA_MAX_NODES];  // Threads pinned to each node
+} pool;
+
+static atomic_int pool_state = POOL_UNINITIALISED;
+
+typedef struct {
+    void *buffers[NUM_SCRATCH_SLOTS];
+    size_t sizes[NUM_SCRATCH_SLOTS];
+} scratch_t;
+
+static _Thread_local scratch_t *thread_scratch_space = NULL;
+
+static atomic_size_t default_size = 0;
+
+// -1 until NN_PIN_THREADS is read
+static atomic_int pinning = -1;
+
+void thread_pool_set_pinning(bool pin) {
+    atomic_store(&pinning, pin ? 1 : 0);
+}
+
+static bool pinning_enabled(void) {
+    int pin = atomic_load(&pinning);
+    if (pin < 0) {
+        const char *env = getenv("NN_PIN_THREADS");
+        pin = (env != NULL && atoi(env) > 0) ? 1 : 0;
+        atomic_store(&pinning, pin);
+    }
+    return pin == 1;
+}
+
+void thread_pool_set_default_size(size_t num_threads) {
+    atomic_store(&default_size, num_threads);
+}
+
+static size_t cpu_count(void) {
+    const char *env = getenv("NN_NUM_THREADS");
+    if (env != NULL && atoi(env) > 0) {
+        return (size_t)atoi(env);
+    }
+    if (atomic_load(&default_size) > 0) {
+        return atomic_load(&default_size);
+    }
+
+    #ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+    #else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? (size_t)count : 1;
+    #endif
+}
+
+// Runs chunks of a job until there are none left to claim, starting with
+// the part for the calling thread's node and then helping out the others
+static void run_chunks(job_t *job) {
+    size_t first_part = (job->num_parts > 1) ? numa_current_node() % job->num_parts : 0;
+    for (size_t i = 0; i < job->num_parts; i++) {
+        job_part_t *part = &job->parts[(first_part + i) % job->num_parts];
+        size_t chunk;
+        while ((chunk = atomic_fetch_add(&part->next_chunk, 1)) < part->end_chunk) {
+            size_t start = chunk * job->grain;
+            size_t end = (start + job->grain < job->count) ? start + job->grain : job->count;
+            job->func(job->context, start, end);
+        }
+    }
+}
+
+static inline bool job_exhausted(job_t *job) {
+    for (size_t i = 0; i < job->num_parts; i++) {
+        if (atomic_load(&job->parts[i].next_chunk) < job->parts[i].end_chunk) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Must be called with the pool lock held
+static void dequeue(job_t *job) {
+    job_t **link = &pool.head;
+    job_t *previous = NULL;
+    while (*link != NULL && *link != job) {
+        previous = *link;
+        link = &(*link)->next;
+    }
+    if (*link == NULL) {
+        return;
+    }
+    *link = job->next;
+    if (pool.tail == job) {
+        pool.tail = previous;
+    }
+}
+
+static THREAD_ENTRY worker_main(thread_func_param_t arg) {
+    // The pool counted this thread on its node before starting it
+    if (pool.pinned) {
+        numa_pin_thread((size_t)(uintptr_t)arg);
+    }
+
+    MUTEX_LOCK(pool.lock);
+    while (true) {
+        // Drop jobs that have no chunks left to hand out
+        while (pool.head != NULL && job_exhausted(pool.head)) {
+            dequeue(pool.head);
+        }
+        if (pool.head == NULL) {
+            if (pool.shutting_down) {
+                break;
+            }
+            COND_WAIT(pool.work_available, pool.lock);
+            continue;
+        }
+
+        job_t *job = pool.head;
+        job->active_workers++;
+        MUTEX_UNLOCK(pool.lock);
+
+        run_chunks(job);
+
+        MUTEX_LOCK(pool.lock);
+        if (--job->active_workers == 0) {
+            COND_BROADCAST(pool.job_finished);
+        }
+    }
+    MUTEX_UNLOCK(pool.lock);
+
+    return (thread_func_return_t)(uintptr_t)NULL;
+}
+
+void thread_pool_init(size_t num_threads) {
+    int expected = POOL_UNINITIALISED;
+    if (!atomic_compare_exchange_strong(&pool_state, &expected, POOL_INITIALISING)) {
+        // Someone else got here first, wait for them to finish
+        while (atomic_load(&pool_state) != POOL_READY) {
+            THREAD_YIELD();
+        }
+        return;
+    }
+
+    if (num_threads == 0) {
+        num_threads = cpu_count();
+    }
+
+    MUTEX_INIT(pool.lock);
+    COND_INIT(pool.work_available);
+    COND_INIT(pool.job_finished);
+    pool.head = NULL;
+    pool.tail = NULL;
+    pool.shutting_down = false;
+    pool.num_workers = num_threads - 1;
+    pool.workers = malloc((pool.num_workers + 1) * sizeof(thread_t));
+    assert(pool.workers != NULL);
+
+    // The calling thread takes the first CPU and worker i the (i + 1)th. Jobs
+    // are only split by node when there is more than one to split over.
+    pool.pinned = pinning_enabled();
+    pool.num_parts = 1;
+    for (size_t node = 0; node < NUMA_MAX_NODES; node++) {
+        pool.node_threads[node] = 0;
+    }
+    if (pool.pinned) {
+        pool.node_threads[numa_pin_thread(0)]++;
+        for (size_t i = 1; i < num_threads; i++) {
+            pool.node_threads[numa_pin_node(i)]++;
+        }
+        pool.num_parts = numa_num_nodes();
+    }
+
+    for (size_t i = 0; i < pool.num_workers; i++) {
+        THREAD_CREATE(pool.workers[i], worker_main, (thread_func_param_t)(uintptr_t)(i + 1));
+    }
+
+    atomic_store(&pool_state, POOL_READY);
+}
+
+void thread_pool_shutdown(void) {
+    if (atomic_load(&pool_state) != POOL_READY) {
+        return;
+    }
+
+    MUTEX_LOCK(pool.lock);
+    pool.shutting_down = true;
+    COND_BROADCAST(pool.work_available);
+    MUTEX_UNLOCK(pool.lock);
+
+    thread_t *threads = pool.workers;
+    THREAD_JOIN_AND_CLOSE(threads, pool.num_workers);
+    free(pool.workers);
+
+    MUTEX_DESTROY(pool.lock);
+    COND_DESTROY(pool.work_available);
+    COND_DESTROY(pool.job_finished);
+
+    atomic_store(&pool_state, POOL_UNINITIALISED);
+}
+
+static void free_scratch(void *arg) {
+    scratch_t *scratch = (scratch_t *)arg;
+    for (size_t i = 0; i < NUM_SCRATCH_SLOTS; i++) {
+        _mm_free(scratch->buffers[i]);
+    }
+    free(scratch);
+}
+
+// The scratch space is registered with a thread exit callback, so threads that
+// are not part of the pool don't leak it either
+#ifdef _WIN32
+static DWORD scratch_key = FLS_OUT_OF_INDEXES;
+static INIT_ONCE scratch_key_once = INIT_ONCE_STATIC_INIT;
+
+static VOID WINAPI free_scratch_callback(PVOID arg) {
+    if (arg != NULL) {
+        free_scratch(arg);
+    }
+}
+
+static BOOL CALLBACK create_scratch_key(PINIT_ONCE once, PVOID param, PVOID *context) {
+    (void)once;
+    (void)param;
+    (void)context;
+    scratch_key = FlsAlloc(free_scratch_callback);
+    return scratch_key != FLS_OUT_OF_INDEXES;
+}
+
+static void register_scratch(scratch_t *scratch) {
+    InitOnceExecuteOnce(&scratch_key_once, create_scratch_key, NULL, NULL);
+    FlsSetValue(scratch_key, scratch);
+}
+#else
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_key_once = PTHREAD_ONCE_INIT;
+
+static void create_scratch_key(void) {
+    if (pthread_key_create(&scratch_key, free_scratch) != 0) {
+        perror("pthread_key_create");
+        exit(1);
+    }
+}
+
+static void register_scratch(scratch_t *scratch) {
+    pthread_once(&scratch_key_once, create_scratch_key);
+    pthread_setspecific(scratch_key, scratch);
+}
+#endif
+
+void *thread_scratch(scratch_slot_t slot, size_t size) {
+    assert(slot < NUM_SCRATCH_SLOTS);
+
+    scratch_t *scratch = thread_scratch_space;
+    if (scratch == NULL) {
+        scratch = calloc(1, sizeof(scratch_t));
+        assert(scratch != NULL);
+        register_scratch(scratch);
+        thread_scratch_space = scratch;
+    }
+
+    if (scratch->sizes[slot] < size) {
+        _mm_free(scratch->buffers[slot]);
+        scratch->buffers[slot] = _mm_malloc(size, 64);
+        assert(scratch->buffers[slot] != NULL);
+        scratch->sizes[slot] = size;
+    }
+    return scratch->buffers[slot];
+}
+
+size_t thread_pool_size(void) {
+    if (atomic_load(&pool_state) != POOL_READY) {
+        thread_pool_init(0);
+    }
+    return pool.num_workers + 1;
+}
+
+void parallel_for(size_t count, size_t grain, parallel_func_t func, void *context) {
+    if (count == 0) {
+        return;
+    }
+
+    size_t num_threads = thread_pool_size();
+    if (grain == 0) {
+        grain = (count + num_threads * CHUNKS_PER_THREAD - 1) / (num_threads * CHUNKS_PER_THREAD);
+    }
+
+    // Not worth waking anyone up for
+    if (num_threads == 1 || grain >= count) {
+        func(context, 0, count);
+        return;
+    }
+
+    job_t job;
+    job.func = func;
+    job.context = context;
+    job.count = count;
+    job.grain = grain;
+    size_t num_chunks = (count + grain - 1) / grain;
+
+    // Each node gets a contiguous run of chunks, in proportion to its threads
+    job.num_parts = pool.num_parts;
+    size_t first_chunk = 0, threads_so_far = 0;
+    for (size_t i = 0; i < job.num_parts; i++) {
+        threads_so_far += (job.num_parts > 1) ? pool.node_threads[i] : num_threads;
+        size_t end_chunk = num_chunks * threads_so_far / num_threads;
+        atomic_init(&job.parts[i].next_chunk, first_chunk);
+        job.parts[i].end_chunk = end_chunk;
+        first_chunk = end_chunk;
+    }
+    job.active_workers = 0;
+    job.next = NULL;
+
+    MUTEX_LOCK(pool.lock);
+    if (pool.tail != NULL) {
+        pool.tail->next = &job;
+    } else {
+        pool.head = &job;
+    }
+    pool.tail = &job;
+    COND_BROADCAST(pool.work_available);
+    MUTEX_UNLOCK(pool.lock);
+
+    run_chunks(&job);
+
+    // Every chunk has been claimed, wait for the workers still running one
+    MUTEX_LOCK(pool.lock);
+    while (job.active_workers > 0) {
+        COND_WAIT(pool.job_finished, pool.lock);
+    }
+    dequeue(&job);
+    MUTEX_UNLOCK(pool.lock);
+}
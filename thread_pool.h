@@ -0,0 +1,50 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Body of a parallel loop. Called with the half-open range [start, end) of
+// iterations that the calling thread is responsible for.
+typedef void (*parallel_func_t)(void *context, size_t start, size_t end);
+
+// Starts the worker threads. num_threads counts the calling thread, so a pool
+// of size N owns N - 1 workers. Passing 0 sizes the pool to the core count,
+// which can be overridden with the NN_NUM_THREADS environment variable.
+// Calling this is optional, parallel_for initialises the pool lazily.
+void thread_pool_init(size_t num_threads);
+void thread_pool_shutdown(void);
+size_t thread_pool_size(void);
+
+// The size thread_pool_init picks when passed 0, instead of the core count
+// (NN_NUM_THREADS still takes precedence). 0 goes back to the core count.
+// Only affects pools started afterwards.
+void thread_pool_set_default_size(size_t num_threads);
+
+// Pins the pool threads to CPUs, and the thread starting the pool to the
+// first of them, see numa.h. Off unless NN_PIN_THREADS=1. Only affects pools
+// started afterwards, and shutting the pool down doesn't unpin the caller.
+void thread_pool_set_pinning(bool pin);
+
+// Splits [0, count) into chunks of grain iterations and runs them on the pool,
+// returning once every chunk has finished. The calling thread works on the
+// chunks as well, so nested calls from inside a parallel loop are safe.
+// Passing 0 as the grain picks a chunk size from the pool size.
+void parallel_for(size_t count, size_t grain, parallel_func_t func, void *context);
+
+// Per-thread scratch buffers, so kernels can keep packing space around
+// between calls instead of allocating it every time.
+typedef enum {
+    SCRATCH_GEMM_A,
+    SCRATCH_GEMM_B,
+    SCRATCH_HGEMM_B,
+    SCRATCH_LOSS_SUMS,
+    NUM_SCRATCH_SLOTS
+} scratch_slot_t;
+
+// Returns a 64 byte aligned buffer of at least size bytes, owned by the calling
+// thread. The contents are not preserved when the buffer has to grow.
+// Freed automatically when the thread exits.
+void *thread_scratch(scratch_slot_t slot, size_t size);
+
+#endif
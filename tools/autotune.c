@@ -0,0 +1,43 @@
+// Measures the GEMM blocking, element-wise grain and thread count that run
+// fastest on this host, and saves them to its tuning file (see tune.h), which
+// determine_cache loads from then on. Usage: build/autotune [tuning file].
+// Tune with the same NN_ISA as the runs that should use it, a file tuned for
+// one kernel table is ignored by the others.
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../gemm.h"
+#include "../kernels/kernels.h"
+#include "../matrix.h"
+#include "../thread_pool.h"
+#include "../tune.h"
+
+static void print_tuning(const char *label, const tuning_t *tuning) {
+    printf("%-10s mc %4zu  kc %4zu  nc %5zu  elementwise_grain %6zu  threads %zu\n", label, tuning->gemm.mc,
+           tuning->gemm.kc, tuning->gemm.nc, tuning->elementwise_grain, tuning->threads);
+}
+
+int main(int argc, char **argv) {
+    const char *filename = (argc > 1) ? argv[1] : tuning_path();
+
+    // The search starts from what determine_cache picked, which is a previous
+    // tuning if there is one, on every core
+    determine_cache();
+    tuning_t start = current_tuning();
+    start.threads = 0;
+    apply_tuning(&start);
+    thread_pool_init(0);
+
+    printf("Tuning the %s kernels on %zu threads\n", kernels()->name, thread_pool_size());
+    print_tuning("start", &start);
+    tuning_t tuned = autotune(true);
+    print_tuning("tuned", &tuned);
+
+    if (!save_tuning(filename, &tuned)) {
+        thread_pool_shutdown();
+        return 1;
+    }
+    printf("Wrote %s\n", filename);
+    thread_pool_shutdown();
+    return 0;
+}
@@ -0,0 +1,341 @@
+// Benchmarks the hot paths and prints the results as one JSON object on
+// stdout, for accepting or rejecting performance changes by comparing runs:
+//
+//   gemm       GFLOP/s of matrix_tile_multiply on square, tall-skinny and
+//              network layer shapes
+//   bandwidth  GB/s of transpose, matrix_add_vector, matrix_apply and every
+//              activation and its derivative, counting each byte read or
+//              written once
+//   read_csv   MB/s of parsing a csv file
+//   predict    latency percentiles of predict on the 784-256-128-10 network
+//              of main.c, at batch sizes from 1 to 10000
+//
+// Every throughput is taken from the median of several timed samples, with
+// the best sample alongside it. Usage: build/bench [csv file], where the csv
+// defaults to a generated mnist sized file. NN_ISA and NN_NUM_THREADS apply as
+// usual, and the kernels and thread count used are part of the output.
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/random.h"
+#include "../include/timer.h"
+#include "../kernels/kernels.h"
+#include "../matrix.h"
+#include "../neural_network.h"
+#include "../parse_csv.h"
+#include "../thread_pool.h"
+#include "../train/activation.h"
+
+#define DEFAULT_CSV "build/bench.csv"
+#define CSV_ROWS 10000
+#define CSV_COLS 785
+
+#define SAMPLES 7
+#define MIN_SAMPLE_SECONDS 0.05
+#define ELEMENTWISE_ROWS 1024
+#define ELEMENTWISE_COLS 1024
+
+#define PREDICT_MIN_RUNS 20
+#define PREDICT_MAX_RUNS 2000
+#define PREDICT_MIN_SECONDS 0.5
+#define MAX_BATCH 1024
+
+typedef void (*bench_func_t)(void *context);
+
+typedef struct {
+    double median; // Seconds per call
+    double best;
+} timing_t;
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Times func(context), repeated enough times per sample that each sample
+// takes at least MIN_SAMPLE_SECONDS
+static timing_t measure(bench_func_t func, void *context) {
+    double start = timer_seconds();
+    func(context); // Warms up the caches and the thread pool
+    double once = timer_seconds() - start;
+    size_t reps = (once > 0 && once < MIN_SAMPLE_SECONDS) ? (size_t)(MIN_SAMPLE_SECONDS / once) + 1 : 1;
+
+    double samples[SAMPLES];
+    for (size_t s = 0; s < SAMPLES; s++) {
+        start = timer_seconds();
+        for (size_t r = 0; r < reps; r++) {
+            func(context);
+        }
+        samples[s] = (timer_seconds() - start) / (double)reps;
+    }
+    qsort(samples, SAMPLES, sizeof(double), compare_doubles);
+
+    timing_t timing = {samples[SAMPLES / 2], samples[0]};
+    return timing;
+}
+
+// Comma separated entries of the JSON array being written
+static void begin_entry(FILE *out, bool *first) {
+    fprintf(out, "%s\n    ", *first ? "" : ",");
+    *first = false;
+}
+
+// GEMM
+
+typedef struct {
+    const char *name;
+    size_t m, k, n;
+} gemm_shape_t;
+
+static const gemm_shape_t gemm_shapes[] = {
+    {"square", 256, 256, 256},
+    {"square", 512, 512, 512},
+    {"square", 1024, 1024, 1024},
+    {"tall_skinny", 16384, 256, 16},
+    {"tall_skinny", 65536, 32, 32},
+    {"layer_784x256", 1, 784, 256},
+    {"layer_784x256", 64, 784, 256},
+    {"layer_784x256", 1024, 784, 256},
+    {"layer_256x128", 1024, 256, 128},
+    {"layer_128x10", 1024, 128, 10},
+};
+
+typedef struct {
+    matrix_t a, b;
+} multiply_args_t;
+
+static void run_multiply(void *context) {
+    multiply_args_t *args = (multiply_args_t *)context;
+    free_matrix(matrix_tile_multiply(args->a, args->b));
+}
+
+static void bench_gemm(FILE *out) {
+    fprintf(out, "  \"gemm\": [");
+    bool first = true;
+    for (size_t i = 0; i < sizeof(gemm_shapes) / sizeof(gemm_shapes[0]); i++) {
+        const gemm_shape_t *shape = &gemm_shapes[i];
+        multiply_args_t args = {random_matrix(shape->m, shape->k), random_matrix(shape->k, shape->n)};
+        timing_t timing = measure(run_multiply, &args);
+        double flops = 2.0 * (double)shape->m * (double)shape->k * (double)shape->n;
+
+        begin_entry(out, &first);
+        fprintf(out, "{\"name\": \"%s\", \"m\": %zu, \"k\": %zu, \"n\": %zu, "
+                     "\"gflops\": %.3f, \"gflops_best\": %.3f}",
+                shape->name, shape->m, shape->k, shape->n,
+                flops / timing.median * 1e-9, flops / timing.best * 1e-9);
+        free_matrix(args.a);
+        free_matrix(args.b);
+    }
+    fprintf(out, "\n  ],\n");
+}
+
+// Memory bound operations
+
+typedef struct {
+    matrix_t a, b, vector;
+    activation_func_t activation;
+    bool derivative;
+} elementwise_args_t;
+
+static void run_transpose(void *context) {
+    free_matrix(transpose(((elementwise_args_t *)context)->a));
+}
+
+static void run_add_vector(void *context) {
+    elementwise_args_t *args = (elementwise_args_t *)context;
+    free_matrix(matrix_add_vector(args->a, args->vector));
+}
+
+static void run_apply_add(void *context) {
+    elementwise_args_t *args = (elementwise_args_t *)context;
+    free_matrix(matrix_apply(&args->a, &args->b, 0.0f, add));
+}
+
+static void run_apply_scale(void *context) {
+    elementwise_args_t *args = (elementwise_args_t *)context;
+    free_matrix(matrix_apply(&args->a, NULL, 0.5f, multiply));
+}
+
+static void run_activation(void *context) {
+    elementwise_args_t *args = (elementwise_args_t *)context;
+    free_matrix(matrix_activation(args->a, args->activation, args->derivative));
+}
+
+static void write_bandwidth(FILE *out, bool *first, const char *name, matrix_t shape,
+                            size_t arrays, timing_t timing) {
+    double bytes = (double)arrays * (double)(shape.m * shape.n * sizeof(float));
+    begin_entry(out, first);
+    fprintf(out, "{\"name\": \"%s\", \"m\": %zu, \"n\": %zu, \"gb_per_s\": %.3f, \"gb_per_s_best\": %.3f}",
+            name, shape.m, shape.n, bytes / timing.median * 1e-9, bytes / timing.best * 1e-9);
+}
+
+static void bench_bandwidth(FILE *out) {
+    static const char *const activation_names[] = {"sigmoid", "softsign", "relu", "tanh", "leaky_relu"};
+
+    elementwise_args_t args;
+    args.a = random_matrix(ELEMENTWISE_ROWS, ELEMENTWISE_COLS);
+    args.b = random_matrix(ELEMENTWISE_ROWS, ELEMENTWISE_COLS);
+    args.vector = random_matrix(1, ELEMENTWISE_COLS);
+    // Centred on 0, so the activations see both signs
+    for (size_t i = 0; i < ELEMENTWISE_ROWS * ELEMENTWISE_COLS; i++) {
+        args.a.values[i] = args.a.values[i] * 8.0f - 4.0f;
+    }
+
+    fprintf(out, "  \"bandwidth\": [");
+    bool first = true;
+    write_bandwidth(out, &first, "transpose", args.a, 2, measure(run_transpose, &args));
+
+    // The weights of the first layer, as the backward pass transposes them
+    elementwise_args_t weights = {.a = random_matrix(784, 256)};
+    write_bandwidth(out, &first, "transpose", weights.a, 2, measure(run_transpose, &weights));
+    free_matrix(weights.a);
+
+    write_bandwidth(out, &first, "matrix_add_vector", args.a, 2, measure(run_add_vector, &args));
+    write_bandwidth(out, &first, "matrix_apply_add", args.a, 3, measure(run_apply_add, &args));
+    write_bandwidth(out, &first, "matrix_apply_scalar", args.a, 2, measure(run_apply_scale, &args));
+
+    for (size_t f = 0; f < NUM_ACTIVATIONS; f++) {
+        for (int derivative = 0; derivative < 2; derivative++) {
+            char name[64];
+            snprintf(name, sizeof(name), "%s%s", derivative ? "d_" : "", activation_names[f]);
+            args.activation = (activation_func_t)f;
+            args.derivative = derivative;
+            write_bandwidth(out, &first, name, args.a, 2, measure(run_activation, &args));
+        }
+    }
+    fprintf(out, "\n  ],\n");
+
+    free_matrix(args.a);
+    free_matrix(args.b);
+    free_matrix(args.vector);
+}
+
+// CSV parsing
+
+// An mnist shaped file: a label, then pixels that are mostly 0
+static void write_csv(const char *filename) {
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) {
+        perror(filename);
+        exit(1);
+    }
+    uint64_t state = 1;
+    for (size_t col = 0; col < CSV_COLS; col++) {
+        fprintf(file, col == 0 ? "label" : ",pixel%zu", col - 1);
+    }
+    fputc('\n', file);
+    for (size_t row = 0; row < CSV_ROWS; row++) {
+        fprintf(file, "%u", (unsigned)(splitmix64(&state) % 10));
+        for (size_t col = 1; col < CSV_COLS; col++) {
+            uint64_t r = splitmix64(&state);
+            fprintf(file, ",%u", (r % 5 == 0) ? (unsigned)((r >> 8) % 256) : 0u);
+        }
+        fputc('\n', file);
+    }
+    fclose(file);
+}
+
+static void bench_read_csv(FILE *out, char *filename) {
+    csv_stats_t samples[SAMPLES];
+    double rates[SAMPLES];
+    for (size_t s = 0; s < SAMPLES; s++) {
+        matrix_t *data = read_csv_timed(filename, ',', 0, true, &samples[s]);
+        if (data == NULL) {
+            exit(1);
+        }
+        free_matrix(data[0]);
+        free_matrix(data[1]);
+        free(data);
+        rates[s] = samples[s].megabytes_per_second;
+    }
+    qsort(rates, SAMPLES, sizeof(double), compare_doubles);
+
+    fprintf(out, "  \"read_csv\": {\"file\": \"%s\", \"bytes\": %zu, \"rows\": %zu, "
+                 "\"mb_per_s\": %.3f, \"mb_per_s_best\": %.3f},\n",
+            filename, samples[0].bytes, samples[0].rows, rates[SAMPLES / 2], rates[SAMPLES - 1]);
+}
+
+// End to end
+
+static double percentile(const double *sorted, size_t n, double p) {
+    return sorted[(size_t)((double)(n - 1) * p)];
+}
+
+static void bench_predict(FILE *out) {
+    static const size_t batches[] = {1, 10, 100, 1000, 10000};
+    size_t layer_info[] = {784, 256, 128, 10};
+    size_t num_classes = layer_info[3];
+    network_t *network = create_network(layer_info, sizeof(layer_info) / sizeof(size_t), MAX_BATCH);
+
+    fprintf(out, "  \"predict\": [");
+    bool first = true;
+    for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+        size_t batch = batches[b];
+        matrix_t X = random_matrix(batch, layer_info[0]);
+        result_t *results = malloc(batch * sizeof(result_t));
+        float *distributions = malloc(batch * num_classes * sizeof(float));
+        double *latencies = malloc(PREDICT_MAX_RUNS * sizeof(double));
+        assert(results != NULL && distributions != NULL && latencies != NULL);
+
+        predict(network, X, results, distributions);
+        size_t runs = 0;
+        double total = 0;
+        while (runs < PREDICT_MAX_RUNS && (runs < PREDICT_MIN_RUNS || total < PREDICT_MIN_SECONDS)) {
+            double start = timer_seconds();
+            predict(network, X, results, distributions);
+            latencies[runs] = timer_seconds() - start;
+            total += latencies[runs++];
+        }
+        qsort(latencies, runs, sizeof(double), compare_doubles);
+
+        begin_entry(out, &first);
+        fprintf(out, "{\"batch\": %zu, \"runs\": %zu, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+                     "\"p99_us\": %.1f, \"max_us\": %.1f, \"rows_per_s\": %.0f}",
+                batch, runs, percentile(latencies, runs, 0.5) * 1e6, percentile(latencies, runs, 0.9) * 1e6,
+                percentile(latencies, runs, 0.99) * 1e6, latencies[runs - 1] * 1e6,
+                (double)batch / percentile(latencies, runs, 0.5));
+
+        free_matrix(X);
+        free(results);
+        free(distributions);
+        free(latencies);
+    }
+    fprintf(out, "\n  ]\n");
+    free_network(network);
+}
+
+int main(int argc, char **argv) {
+    char *csv = (argc > 1) ? argv[1] : DEFAULT_CSV;
+
+    // Progress goes to stderr, stdout only gets the JSON
+    FILE *out = stdout;
+    if (argc <= 1) {
+        FILE *existing = fopen(csv, "r");
+        if (existing != NULL) {
+            fclose(existing);
+        } else {
+            fprintf(stderr, "Writing %s\n", csv);
+            write_csv(csv);
+        }
+    }
+
+    determine_cache();
+    thread_pool_init(0);
+
+    fprintf(out, "{\n  \"isa\": \"%s\",\n  \"threads\": %zu,\n", kernels()->name, thread_pool_size());
+    fprintf(stderr, "gemm\n");
+    bench_gemm(out);
+    fprintf(stderr, "bandwidth\n");
+    bench_bandwidth(out);
+    fprintf(stderr, "read_csv\n");
+    bench_read_csv(out, csv);
+    fprintf(stderr, "predict\n");
+    bench_predict(out);
+    fprintf(out, "}\n");
+
+    thread_pool_shutdown();
+    return 0;
+}
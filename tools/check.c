@@ -0,0 +1,555 @@
+// Checks what the comments in include/simd_math.h, kernels/ and train/loss.c
+// promise, for every instruction set this CPU supports:
+//   - the ulp error of vec_exp, vec_log, vec_tanh and vec_sigmoid against
+//     double precision libm stays within the table in include/simd_math.h,
+//     and they saturate where it says
+//   - spans of 1 to 2 * 16 values (two of the widest vectors) give the same
+//     values as full vectors, and neither read nor write past their end. The
+//     inputs end right before an unreadable page, the outputs are followed by
+//     canaries.
+//   - the loss and its gradient are bit for bit the same for any number of
+//     threads, for contiguous, padded and strided matrices
+// Prints a line per check and exits with 1 if any fails. The ulp sweep takes
+// every ULP_STRIDE-th float, "build/check exhaustive" takes every float, as
+// the table was measured (about seven minutes per instruction set on one core).
+#include <float.h>
+#include <immintrin.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../kernels/kernels.h"
+#include "../matrix.h"
+#include "../thread_pool.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#define ULP_STRIDE 1021
+#define SWEEP_BATCH 4096
+// Two AVX-512 vectors, which is two or more vectors of every instruction set
+#define MAX_SPAN 32
+#define CANARIES 16
+#define CANARY_BITS 0x7fa5a5a5u // A NaN no kernel produces
+
+#define PAGE_SIZE 4096
+#define NUM_GUARDED 3
+
+#define LOSS_ROWS 300
+#define LOSS_COLS 1000
+
+static size_t failures = 0;
+
+static void report(bool ok, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    printf("%s ", ok ? "ok  " : "FAIL");
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+    failures += ok ? 0 : 1;
+}
+
+static uint32_t float_bits(float x) {
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+static float canary(void) {
+    uint32_t bits = CANARY_BITS;
+    float x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+static float random_between(float low, float high) {
+    return low + (high - low) * (float)rand() / (float)RAND_MAX;
+}
+
+// Buffers followed by a page that can't be read or written
+
+static char *guarded_pages[NUM_GUARDED];
+
+static void allocate_guarded(void) {
+    for (size_t i = 0; i < NUM_GUARDED; i++) {
+        #ifdef _WIN32
+        char *pages = VirtualAlloc(NULL, 2 * PAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        DWORD old_protection;
+        if (pages == NULL || !VirtualProtect(pages + PAGE_SIZE, PAGE_SIZE, PAGE_NOACCESS, &old_protection)) {
+            fprintf(stderr, "Can't allocate guard pages\n");
+            exit(1);
+        }
+        #else
+        char *pages = mmap(NULL, 2 * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pages == MAP_FAILED || mprotect(pages + PAGE_SIZE, PAGE_SIZE, PROT_NONE) != 0) {
+            perror("guard pages");
+            exit(1);
+        }
+        #endif
+        guarded_pages[i] = pages;
+    }
+}
+
+// n floats (at most a page) that end where the guard page starts
+static float *guarded(size_t which, size_t n) {
+    return (float *)(guarded_pages[which] + PAGE_SIZE) - n;
+}
+
+// Ulp error against libm
+
+typedef struct {
+    const char *name;
+    double (*reference)(double);
+    uint32_t first_bits; // Smallest input swept
+    bool positive_only;
+    float limits[NUM_ISAS]; // The -Ofast columns of the table in include/simd_math.h
+} math_function_t;
+
+static double reference_sigmoid(double x) {
+    return 1.0 / (1.0 + exp(-x));
+}
+
+// log only takes normal positive inputs
+static const math_function_t math_functions[] = {
+    {"exp", exp, 0, false, {1.3f, 1.3f, 1.3f}},
+    {"log", log, 0x00800000u, true, {0.9f, 0.9f, 0.9f}},
+    {"tanh", tanh, 0, false, {2.2f, 2.2f, 1.4f}},
+    {"sigmoid", reference_sigmoid, 0, false, {4.5f, 4.5f, 3.2f}},
+};
+
+#define NUM_MATH_FUNCTIONS (sizeof(math_functions) / sizeof(math_functions[0]))
+
+static activation_span_t math_span(const kernel_table_t *k, size_t function) {
+    activation_span_t spans[] = {k->exp, k->log, k->activation[TANH], k->activation[SIGMOID]};
+    return spans[function];
+}
+
+// The ulp of the float nearest to x
+static double ulp_of(double x) {
+    int exponent;
+    frexp(x, &exponent);
+    return ldexp(1.0, (exponent - 24 > -149) ? exponent - 24 : -149);
+}
+
+typedef struct {
+    activation_span_t span;
+    double (*reference)(double);
+    float inputs[SWEEP_BATCH];
+    float outputs[SWEEP_BATCH];
+    size_t count;
+    double max_error;
+    float worst_input;
+} sweep_t;
+
+// Only results that are normal floats count, as in the table
+static void sweep_batch(sweep_t *sweep) {
+    sweep->span(sweep->outputs, sweep->inputs, sweep->count);
+    for (size_t i = 0; i < sweep->count; i++) {
+        double expected = sweep->reference(sweep->inputs[i]);
+        if (!(fabs(expected) >= FLT_MIN && fabs(expected) <= FLT_MAX)) {
+            continue;
+        }
+        double error = fabs((double)sweep->outputs[i] - expected) / ulp_of(expected);
+        if (!(error <= sweep->max_error)) {
+            sweep->max_error = error;
+            sweep->worst_input = sweep->inputs[i];
+        }
+    }
+    sweep->count = 0;
+}
+
+static void check_ulp(const kernel_table_t *k, uint32_t stride) {
+    for (size_t f = 0; f < NUM_MATH_FUNCTIONS; f++) {
+        const math_function_t *function = &math_functions[f];
+        sweep_t sweep;
+        sweep.span = math_span(k, f);
+        sweep.reference = function->reference;
+        sweep.count = 0;
+        sweep.max_error = 0;
+        sweep.worst_input = 0;
+        for (uint32_t sign = 0; sign < (function->positive_only ? 1u : 2u); sign++) {
+            // Every finite float of this sign
+            for (uint64_t bits = function->first_bits; bits < 0x7f800000u; bits += stride) {
+                uint32_t pattern = (uint32_t)bits | (sign << 31);
+                memcpy(&sweep.inputs[sweep.count++], &pattern, sizeof(float));
+                if (sweep.count == SWEEP_BATCH) {
+                    sweep_batch(&sweep);
+                }
+            }
+        }
+        if (sweep.count > 0) {
+            sweep_batch(&sweep);
+        }
+        // The table rounds to one decimal
+        float limit = function->limits[k->isa];
+        report(sweep.max_error < limit + 0.05, "%-7s %-7s %.2f ulp (worst at %.9g), table says %.1f",
+               k->name, function->name, sweep.max_error, sweep.worst_input, limit);
+    }
+}
+
+// Saturation, as the top of include/simd_math.h describes it
+static void check_saturation(const kernel_table_t *k) {
+    float inputs[] = {100.0f, 200.0f, -200.0f, 50.0f, -50.0f};
+    float exp_out[5], sigmoid_out[5], tanh_out[5];
+    k->exp(exp_out, inputs, 5);
+    k->activation[SIGMOID](sigmoid_out, inputs, 5);
+    k->activation[TANH](tanh_out, inputs, 5);
+
+    const float below_one = nextafterf(1.0f, 0.0f);
+    report(exp_out[0] >= FLT_MAX * (1.0f - 2e-5f) && exp_out[0] <= FLT_MAX && exp_out[1] == exp_out[0] &&
+           exp_out[2] == 0.0f, "%-7s exp saturates at %a and 0", k->name, exp_out[0]);
+    report(sigmoid_out[1] >= below_one && sigmoid_out[1] <= 1.0f && sigmoid_out[2] >= FLT_MIN &&
+           sigmoid_out[2] <= FLT_MIN * (1.0f + 1e-5f),
+           "%-7s sigmoid saturates at %a and %a", k->name, sigmoid_out[1], sigmoid_out[2]);
+    report(tanh_out[3] >= below_one && tanh_out[3] <= 1.0f && tanh_out[4] == -tanh_out[3],
+           "%-7s tanh saturates at +-%a", k->name, tanh_out[3]);
+}
+
+// Spans shorter than two vectors
+
+static bool canaries_intact(const float *values, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (float_bits(values[i]) != CANARY_BITS) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void fill_canaries(float *values, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        values[i] = canary();
+    }
+}
+
+typedef struct {
+    const char *name;
+    activation_span_t span;
+    bool positive_only;
+} named_span_t;
+
+// Every element-wise span must give exactly what it gives for the same value
+// in a full vector
+static void check_span_tails(const kernel_table_t *k) {
+    static const char *activation_names[NUM_ACTIVATIONS] = {"sigmoid", "softsign", "relu", "tanh", "leaky_relu"};
+    static char derivative_names[NUM_ACTIVATIONS][32];
+    named_span_t spans[2 * NUM_ACTIVATIONS + 2];
+    size_t num_spans = 0;
+    for (size_t a = 0; a < NUM_ACTIVATIONS; a++) {
+        snprintf(derivative_names[a], sizeof(derivative_names[a]), "d_%s", activation_names[a]);
+        spans[num_spans++] = (named_span_t){activation_names[a], k->activation[a], false};
+        spans[num_spans++] = (named_span_t){derivative_names[a], k->activation_derivative[a], false};
+    }
+    spans[num_spans++] = (named_span_t){"exp", k->exp, false};
+    spans[num_spans++] = (named_span_t){"log", k->log, true};
+
+    for (size_t s = 0; s < num_spans; s++) {
+        bool ok = true;
+        for (size_t n = 1; n <= MAX_SPAN && ok; n++) {
+            float *src = guarded(0, n);
+            float full_src[2 * MAX_SPAN], full_dst[2 * MAX_SPAN], dst[MAX_SPAN + CANARIES];
+            for (size_t i = 0; i < 2 * MAX_SPAN; i++) {
+                full_src[i] = spans[s].positive_only ? random_between(0.05f, 4.0f) : random_between(-4.0f, 4.0f);
+            }
+            memcpy(src, full_src, n * sizeof(float));
+            spans[s].span(full_dst, full_src, 2 * MAX_SPAN);
+
+            fill_canaries(dst, n + CANARIES);
+            spans[s].span(dst, src, n);
+            ok = memcmp(dst, full_dst, n * sizeof(float)) == 0 && canaries_intact(dst + n, CANARIES);
+
+            // In place
+            spans[s].span(src, src, n);
+            ok = ok && memcmp(src, full_dst, n * sizeof(float)) == 0;
+        }
+        report(ok, "%-7s %-13s tails of 1..%d", k->name, spans[s].name, MAX_SPAN);
+    }
+}
+
+static void check_bias_argmax_softmax_tails(const kernel_table_t *k) {
+    bool bias_ok = true, argmax_ok = true, softmax_ok = true;
+    for (size_t n = 1; n <= MAX_SPAN; n++) {
+        float *src = guarded(0, n);
+        float *bias = guarded(1, n);
+        float dst[MAX_SPAN + CANARIES];
+        for (size_t i = 0; i < n; i++) {
+            src[i] = random_between(-4.0f, 4.0f);
+            bias[i] = random_between(-4.0f, 4.0f);
+        }
+
+        fill_canaries(dst, n + CANARIES);
+        k->add_bias(dst, src, bias, n);
+        for (size_t i = 0; i < n; i++) {
+            bias_ok = bias_ok && dst[i] == src[i] + bias[i];
+        }
+        bias_ok = bias_ok && canaries_intact(dst + n, CANARIES);
+
+        // The first of equal values wins
+        src[n / 2] = 5.0f;
+        src[n - 1] = 5.0f;
+        float max;
+        argmax_ok = argmax_ok && k->argmax(src, n, &max) == n / 2 && max == 5.0f;
+
+        fill_canaries(dst, n + CANARIES);
+        softmax_ok = softmax_ok && k->softmax(dst, src, n) == n / 2 && canaries_intact(dst + n, CANARIES);
+        double sum = 0;
+        for (size_t i = 0; i < n; i++) {
+            sum += exp((double)src[i] - 5.0);
+        }
+        for (size_t i = 0; i < n; i++) {
+            double expected = exp((double)src[i] - 5.0) / sum;
+            softmax_ok = softmax_ok && fabs(dst[i] - expected) <= 1e-6 + 1e-5 * expected;
+        }
+    }
+    report(bias_ok, "%-7s %-13s tails of 1..%d", k->name, "add_bias", MAX_SPAN);
+    report(argmax_ok, "%-7s %-13s tails of 1..%d", k->name, "argmax", MAX_SPAN);
+    report(softmax_ok, "%-7s %-13s tails of 1..%d", k->name, "softmax", MAX_SPAN);
+}
+
+// The gradient must match full vectors exactly. The sum is in a different
+// order, so it only has to be close to the sum of the losses one at a time.
+static void check_loss_tails(const kernel_table_t *k) {
+    static const char *names[NUM_LOSSES + 1] = {"mse", "mae", "hubler", "log", "categorical", "softmax_xent"};
+    for (size_t l = 0; l <= NUM_LOSSES; l++) {
+        loss_chunk_t chunk = (l < NUM_LOSSES) ? k->loss[l] : k->loss_softmax;
+        float scale = 0.37f;
+        bool ok = true;
+        for (size_t n = 1; n <= MAX_SPAN && ok; n++) {
+            float *y = guarded(0, n);
+            float *p = guarded(1, n);
+            float full_y[2 * MAX_SPAN], full_p[2 * MAX_SPAN], full_gradient[2 * MAX_SPAN];
+            float gradient[MAX_SPAN + CANARIES];
+            for (size_t i = 0; i < 2 * MAX_SPAN; i++) {
+                full_y[i] = (rand() % 4 == 0) ? 1.0f : 0.0f;
+                full_p[i] = random_between(0.05f, 0.95f);
+            }
+            memcpy(y, full_y, n * sizeof(float));
+            memcpy(p, full_p, n * sizeof(float));
+            chunk(full_y, full_p, full_gradient, 2 * MAX_SPAN, scale);
+
+            fill_canaries(gradient, n + CANARIES);
+            float sum = chunk(y, p, gradient, n, scale);
+            ok = memcmp(gradient, full_gradient, n * sizeof(float)) == 0 && canaries_intact(gradient + n, CANARIES);
+            // The loss only loop is a copy of the other one
+            ok = ok && float_bits(chunk(y, p, NULL, n, scale)) == float_bits(sum);
+
+            double expected = 0;
+            for (size_t i = 0; i < n; i++) {
+                expected += chunk(y + i, p + i, NULL, 1, scale);
+            }
+            ok = ok && fabs(sum - expected) <= 1e-6 + 1e-5 * fabs(expected);
+        }
+        report(ok, "%-7s %-13s tails of 1..%d", k->name, names[l], MAX_SPAN);
+    }
+}
+
+// Every rows x cols edge of the register tile, accumulating into C and adding
+// a bias. Small integers keep every sum exact, in any order, with or without FMA.
+static void check_gemm_edges(const kernel_table_t *k) {
+    const size_t kc = 5, mr = k->gemm_mr, nr = k->gemm_nr, ldc = nr + CANARIES;
+    float *a = _mm_malloc(kc * mr * sizeof(float), 64);
+    float *packed = _mm_malloc(kc * nr * sizeof(float), 64);
+    float *c = malloc((mr + 1) * ldc * sizeof(float));
+    float *expected = malloc(mr * nr * sizeof(float));
+    if (a == NULL || packed == NULL || c == NULL || expected == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    bool pack_ok = true, edge_ok = true;
+    for (size_t rows = 1; rows <= mr; rows++) {
+        for (size_t cols = 1; cols <= nr; cols++) {
+            // A comes packed and zero padded, B is packed from guarded memory
+            for (size_t p = 0; p < kc; p++) {
+                for (size_t i = 0; i < mr; i++) {
+                    a[p * mr + i] = (i < rows) ? (float)(rand() % 7 - 3) : 0.0f;
+                }
+            }
+            float *b = guarded(2, kc * cols);
+            float *bias = guarded(1, cols);
+            for (size_t i = 0; i < kc * cols; i++) {
+                b[i] = (float)(rand() % 7 - 3);
+            }
+            for (size_t j = 0; j < cols; j++) {
+                bias[j] = (float)(rand() % 7 - 3);
+            }
+            k->gemm_pack_b(kc, cols, b, cols, packed);
+            for (size_t p = 0; p < kc; p++) {
+                for (size_t j = 0; j < nr; j++) {
+                    pack_ok = pack_ok && packed[p * nr + j] == ((j < cols) ? b[p * cols + j] : 0.0f);
+                }
+            }
+
+            fill_canaries(c, (mr + 1) * ldc);
+            for (size_t i = 0; i < rows; i++) {
+                for (size_t j = 0; j < cols; j++) {
+                    c[i * ldc + j] = (float)(rand() % 7 - 3);
+                    float sum = c[i * ldc + j] + bias[j];
+                    for (size_t p = 0; p < kc; p++) {
+                        sum += a[p * mr + i] * b[p * cols + j];
+                    }
+                    expected[i * nr + j] = sum;
+                }
+            }
+            k->gemm_edge_kernel(kc, a, packed, c, ldc, true, bias, rows, cols);
+            for (size_t i = 0; i <= mr; i++) {
+                for (size_t j = 0; j < ldc; j++) {
+                    bool inside = i < rows && j < cols;
+                    edge_ok = edge_ok && (inside ? c[i * ldc + j] == expected[i * nr + j]
+                                                 : float_bits(c[i * ldc + j]) == CANARY_BITS);
+                }
+            }
+        }
+    }
+    report(pack_ok, "%-7s %-13s 1..%zu columns", k->name, "gemm_pack_b", nr);
+    report(edge_ok, "%-7s %-13s 1..%zu x 1..%zu", k->name, "gemm_edge", mr, nr);
+
+    _mm_free(a);
+    _mm_free(packed);
+    free(c);
+    free(expected);
+}
+
+// Loss reproducibility
+
+static const size_t thread_counts[] = {1, 2, 3, 4, 8};
+
+#define NUM_THREAD_COUNTS (sizeof(thread_counts) / sizeof(thread_counts[0]))
+#define NUM_LAYOUTS 3
+
+static const char *layout_names[NUM_LAYOUTS] = {"contiguous", "padded", "strided"};
+
+// FNV-1a over the rows, so padding and gaps don't count
+static uint64_t hash_matrix(matrix_t matrix) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < matrix.m; i++) {
+        const unsigned char *bytes = (const unsigned char *)matrix_row(matrix, i);
+        for (size_t j = 0; j < matrix.n * sizeof(float); j++) {
+            hash = (hash ^ bytes[j]) * 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+static void fill_loss_inputs(matrix_t y, matrix_t p) {
+    for (size_t i = 0; i < y.m; i++) {
+        for (size_t j = 0; j < y.n; j++) {
+            matrix_row(y, i)[j] = (rand() % 10 == 0) ? 1.0f : 0.0f;
+            matrix_row(p, i)[j] = random_between(0.01f, 0.99f);
+        }
+    }
+}
+
+static void check_loss_threads(const kernel_table_t *k) {
+    // Three layouts of the same shape, each with its own values. A padded
+    // gradient would send the contiguous inputs down the row at a time path.
+    float *dense_values[3];
+    matrix_t y[NUM_LAYOUTS], p[NUM_LAYOUTS], gradient[NUM_LAYOUTS], wide[2];
+    for (size_t i = 0; i < 3; i++) {
+        dense_values[i] = malloc(LOSS_ROWS * LOSS_COLS * sizeof(float));
+        if (dense_values[i] == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < 2; i++) {
+        wide[i] = matrix_alloc(LOSS_ROWS, LOSS_COLS + 7);
+    }
+    y[0] = matrix_view(dense_values[0], LOSS_ROWS, LOSS_COLS, LOSS_COLS);
+    p[0] = matrix_view(dense_values[1], LOSS_ROWS, LOSS_COLS, LOSS_COLS);
+    y[1] = matrix_alloc(LOSS_ROWS, LOSS_COLS);
+    p[1] = matrix_alloc(LOSS_ROWS, LOSS_COLS);
+    y[2] = matrix_columns(wide[0], 3, LOSS_COLS);
+    p[2] = matrix_columns(wide[1], 3, LOSS_COLS);
+    gradient[0] = matrix_view(dense_values[2], LOSS_ROWS, LOSS_COLS, LOSS_COLS);
+    gradient[1] = matrix_alloc(LOSS_ROWS, LOSS_COLS);
+    gradient[2] = matrix_alloc(LOSS_ROWS, LOSS_COLS);
+    for (size_t layout = 0; layout < NUM_LAYOUTS; layout++) {
+        fill_loss_inputs(y[layout], p[layout]);
+    }
+
+    // The loss and gradient hash of every layout and loss, with one thread
+    float losses[NUM_LAYOUTS][NUM_LOSSES + 1];
+    uint64_t hashes[NUM_LAYOUTS][NUM_LOSSES + 1];
+    bool same[NUM_LAYOUTS][NUM_LOSSES + 1];
+    for (size_t t = 0; t < NUM_THREAD_COUNTS; t++) {
+        thread_pool_shutdown();
+        thread_pool_init(thread_counts[t]);
+        for (size_t layout = 0; layout < NUM_LAYOUTS; layout++) {
+            for (size_t l = 0; l <= NUM_LOSSES; l++) {
+                loss_func_t loss = (l < NUM_LOSSES) ? (loss_func_t)l : CATEGORICAL;
+                bool uses_softmax = (l == NUM_LOSSES);
+                float value = matrix_loss_gradient(y[layout], p[layout], loss, uses_softmax, gradient[layout]);
+                uint64_t hash = hash_matrix(gradient[layout]);
+                bool loss_only_same = uses_softmax || float_bits(matrix_loss(y[layout], p[layout], loss)) ==
+                                                      float_bits(value);
+                if (t == 0) {
+                    losses[layout][l] = value;
+                    hashes[layout][l] = hash;
+                    same[layout][l] = loss_only_same;
+                } else {
+                    same[layout][l] = same[layout][l] && loss_only_same &&
+                                      float_bits(value) == float_bits(losses[layout][l]) &&
+                                      hash == hashes[layout][l];
+                }
+            }
+        }
+    }
+
+    for (size_t layout = 0; layout < NUM_LAYOUTS; layout++) {
+        bool ok = true;
+        for (size_t l = 0; l <= NUM_LOSSES; l++) {
+            ok = ok && same[layout][l];
+        }
+        report(ok, "%-7s loss and gradient, %s %dx%d, identical on 1, 2, 3, 4 and 8 threads", k->name,
+               layout_names[layout], LOSS_ROWS, LOSS_COLS);
+    }
+
+    // The rest are views
+    for (size_t i = 0; i < 3; i++) {
+        free(dense_values[i]);
+    }
+    for (size_t i = 0; i < 2; i++) {
+        free_matrix(wide[i]);
+    }
+    free_matrix(y[1]);
+    free_matrix(p[1]);
+    free_matrix(gradient[1]);
+    free_matrix(gradient[2]);
+}
+
+int main(int argc, char **argv) {
+    uint32_t stride = (argc > 1 && strcmp(argv[1], "exhaustive") == 0) ? 1 : ULP_STRIDE;
+    srand(0);
+    allocate_guarded();
+
+    for (int isa = 0; isa < NUM_ISAS; isa++) {
+        if (isa > (int)cpu_isa()) {
+            printf("skip %s, this CPU doesn't support it\n", isa_name((isa_t)isa));
+            continue;
+        }
+        const kernel_table_t *k = select_kernels((isa_t)isa);
+        check_ulp(k, stride);
+        check_saturation(k);
+        check_span_tails(k);
+        check_bias_argmax_softmax_tails(k);
+        check_loss_tails(k);
+        check_gemm_edges(k);
+        check_loss_threads(k);
+    }
+    thread_pool_shutdown();
+
+    if (failures > 0) {
+        printf("%zu checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
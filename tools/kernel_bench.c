@@ -0,0 +1,139 @@
+// Times the dispatched kernels of every instruction set this CPU supports on
+// the layer shapes of the network in main.c (784-256-128-10), so the ISAs can
+// be compared side by side. GEMM runs through gemm_fused with the bias and
+// activation epilogue, like a forward pass. The element-wise kernels are
+// called straight from each table on one thread. Passing an ISA name (sse2,
+// avx2 or avx512) only runs that one.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../gemm.h"
+#include "../include/timer.h"
+#include "../kernels/kernels.h"
+#include "../matrix.h"
+#include "../thread_pool.h"
+
+#define TIMING_RUNS 5
+#define ELEMENTWISE_ROWS 1024
+
+static const size_t layers[][2] = {{784, 256}, {256, 128}, {128, 10}};
+static const size_t batches[] = {1, 64, 1024};
+
+#define NUM_LAYERS (sizeof(layers) / sizeof(layers[0]))
+#define NUM_BATCHES (sizeof(batches) / sizeof(batches[0]))
+
+// Enough repetitions for about 2^27 multiply-adds or element operations per run
+static size_t repetitions(size_t work) {
+    size_t reps = ((size_t)1 << 27) / (work + 1);
+    return (reps > 0) ? reps : 1;
+}
+
+static float *random_values(size_t n) {
+    float *values = malloc(n * sizeof(float));
+    if (values == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < n; i++) {
+        values[i] = (float)rand() / (float)RAND_MAX * 8.0f - 4.0f;
+    }
+    return values;
+}
+
+// Best of a few runs of reps calls, in seconds per call
+#define TIME_BEST(result, reps, call)                                  \
+    do {                                                               \
+        result = 0;                                                    \
+        for (size_t run = 0; run < TIMING_RUNS; run++) {               \
+            double start = timer_seconds();                            \
+            for (size_t rep = 0; rep < (reps); rep++) {                \
+                call;                                                  \
+            }                                                          \
+            double elapsed = (timer_seconds() - start) / (double)(reps); \
+            result = (run == 0 || elapsed < result) ? elapsed : result; \
+        }                                                              \
+    } while (0)
+
+static void bench_gemm(const kernel_table_t *k) {
+    for (size_t l = 0; l < NUM_LAYERS; l++) {
+        size_t in = layers[l][0], out = layers[l][1];
+        float *weights = random_values(in * out);
+        float *bias = random_values(out);
+        gemm_epilogue_t epilogue = {bias, k->activation[SIGMOID]};
+
+        for (size_t b = 0; b < NUM_BATCHES; b++) {
+            size_t batch = batches[b];
+            float *x = random_values(batch * in);
+            float *y = random_values(batch * out);
+            size_t reps = repetitions(batch * in * out);
+            double seconds;
+            TIME_BEST(seconds, reps, gemm_fused(batch, out, in, x, in, weights, out, y, out, &epilogue, NULL));
+            printf("%-7s gemm %4zu x %3zu -> %3zu  %8.2f GFLOP/s\n", k->name, batch, in, out,
+                   2.0 * (double)(batch * in * out) / seconds * 1e-9);
+            free(x);
+            free(y);
+        }
+        free(weights);
+        free(bias);
+    }
+}
+
+static void bench_elementwise(const kernel_table_t *k) {
+    size_t n = ELEMENTWISE_ROWS * layers[0][1];
+    float *src = random_values(n);
+    float *dst = random_values(n);
+    float *bias = random_values(layers[0][1]);
+    size_t reps = repetitions(n);
+    double seconds;
+
+    // Read and written once each
+    double bytes = 2.0 * (double)(n * sizeof(float));
+    size_t width = layers[0][1];
+    TIME_BEST(seconds, reps, for (size_t row = 0; row < ELEMENTWISE_ROWS; row++) {
+        k->add_bias(dst + row * width, src + row * width, bias, width);
+    });
+    printf("%-7s add_bias         %8.2f GB/s\n", k->name, bytes / seconds * 1e-9);
+
+    static const struct {
+        activation_func_t activation;
+        const char *name;
+    } activations[] = {{SIGMOID, "sigmoid"}, {RELU, "relu"}, {TANH, "tanh"}};
+    for (size_t a = 0; a < sizeof(activations) / sizeof(activations[0]); a++) {
+        TIME_BEST(seconds, reps, k->activation[activations[a].activation](dst, src, n));
+        printf("%-7s %-16s %8.2f GB/s\n", k->name, activations[a].name, bytes / seconds * 1e-9);
+        TIME_BEST(seconds, reps, k->activation_derivative[activations[a].activation](dst, src, n));
+        printf("%-7s d_%-14s %8.2f GB/s\n", k->name, activations[a].name, bytes / seconds * 1e-9);
+    }
+
+    // One row of output per sample, as predict runs it
+    size_t classes = layers[NUM_LAYERS - 1][1];
+    reps = repetitions(ELEMENTWISE_ROWS * classes);
+    TIME_BEST(seconds, reps, for (size_t row = 0; row < ELEMENTWISE_ROWS; row++) {
+        k->softmax(dst + row * classes, src + row * classes, classes);
+    });
+    printf("%-7s softmax %zu        %8.2f ns/row\n", k->name, classes, seconds / ELEMENTWISE_ROWS * 1e9);
+
+    free(src);
+    free(dst);
+    free(bias);
+}
+
+int main(int argc, char **argv) {
+    srand(0);
+    thread_pool_init(0);
+
+    for (int isa = 0; isa <= (int)cpu_isa(); isa++) {
+        if (argc > 1 && strcmp(argv[1], isa_name((isa_t)isa)) != 0) {
+            continue;
+        }
+        const kernel_table_t *k = select_kernels((isa_t)isa);
+        // The blocking follows the register tile of the kernels in use
+        determine_cache();
+        bench_gemm(k);
+        bench_elementwise(k);
+    }
+
+    thread_pool_shutdown();
+    return 0;
+}
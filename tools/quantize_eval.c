@@ -0,0 +1,111 @@
+// Compares int8 inference against the float network it was quantized from.
+// Trains a float network on the training csv, calibrates the quantization on
+// the first rows of it, then reports the test accuracy, agreement and speed of
+// both paths.
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../include/timer.h"
+#include "../matrix.h"
+#include "../neural_network.h"
+#include "../parse_csv.h"
+#include "../thread_pool.h"
+
+#define DEFAULT_TRAIN "data/mnist_train_data.csv"
+#define DEFAULT_TEST "data/mnist_test_data.csv"
+#define CALIBRATION_ROWS 1000
+#define TIMING_RUNS 5
+
+// Returns the best of a few runs, in seconds
+static double time_predict(network_t *network, matrix_t X, result_t *results, float *distributions) {
+    double best = 0;
+    for (size_t run = 0; run < TIMING_RUNS; run++) {
+        double start = timer_seconds();
+        predict(network, X, results, distributions);
+        double elapsed = timer_seconds() - start;
+        best = (run == 0 || elapsed < best) ? elapsed : best;
+    }
+    return best;
+}
+
+static double accuracy(const result_t *results, matrix_t y) {
+    size_t correct = 0;
+    for (size_t i = 0; i < y.m; i++) {
+        correct += (results[i].prediction == (size_t)y.values[i]);
+    }
+    return (double)correct / (double)y.m;
+}
+
+int main(int argc, char **argv) {
+    char *train_file = (argc > 1) ? argv[1] : DEFAULT_TRAIN;
+    char *test_file = (argc > 2) ? argv[2] : DEFAULT_TEST;
+    size_t epochs = (argc > 3) ? (size_t)atol(argv[3]) : 10;
+
+    determine_cache();
+    thread_pool_init(0);
+
+    matrix_t *train_data = read_csv(train_file, ',', 0, true);
+    matrix_t *test_data = read_csv(test_file, ',', 0, true);
+    if (train_data == NULL || test_data == NULL) {
+        return 1;
+    }
+    normalise(train_data[0]);
+    normalise(test_data[0]);
+    matrix_t X_test = test_data[0];
+    matrix_t y_test = test_data[1];
+
+    size_t num_classes = 10;
+    size_t layer_info[] = {train_data[0].n, 256, 128, num_classes};
+    network_t *network = create_network(layer_info, sizeof(layer_info) / sizeof(size_t), 1024);
+    train(network, train_data[0], train_data[1], epochs, 64, 0.05f, 1);
+
+    result_t *float_results = malloc(X_test.m * sizeof(result_t));
+    result_t *int8_results = malloc(X_test.m * sizeof(result_t));
+    float *float_distributions = malloc(X_test.m * num_classes * sizeof(float));
+    float *int8_distributions = malloc(X_test.m * num_classes * sizeof(float));
+    assert(float_results != NULL && int8_results != NULL);
+    assert(float_distributions != NULL && int8_distributions != NULL);
+
+    size_t float_bytes = network_weight_bytes(network);
+    double float_seconds = time_predict(network, X_test, float_results, float_distributions);
+
+    matrix_t calibration = train_data[0];
+    calibration.m = (calibration.m < CALIBRATION_ROWS) ? calibration.m : CALIBRATION_ROWS;
+    quantize_network(network, calibration);
+    size_t int8_bytes = network_weight_bytes(network);
+    double int8_seconds = time_predict(network, X_test, int8_results, int8_distributions);
+
+    size_t agree = 0;
+    float max_difference = 0;
+    for (size_t i = 0; i < X_test.m; i++) {
+        agree += (float_results[i].prediction == int8_results[i].prediction);
+        for (size_t j = 0; j < num_classes; j++) {
+            float difference = float_results[i].distribution[j] - int8_results[i].distribution[j];
+            difference = (difference < 0) ? -difference : difference;
+            max_difference = (difference > max_difference) ? difference : max_difference;
+        }
+    }
+
+    printf("%zu test rows, calibrated on %zu training rows\n", X_test.m, calibration.m);
+    printf("float: accuracy %.4f, %zu weight bytes, %.0f rows/sec\n",
+           accuracy(float_results, y_test), float_bytes, X_test.m / float_seconds);
+    printf("int8:  accuracy %.4f, %zu weight bytes, %.0f rows/sec\n",
+           accuracy(int8_results, y_test), int8_bytes, X_test.m / int8_seconds);
+    printf("predictions agree on %.4f of rows, largest probability difference %.5f\n",
+           (double)agree / (double)X_test.m, max_difference);
+
+    free(float_results);
+    free(int8_results);
+    free(float_distributions);
+    free(int8_distributions);
+    free_matrix(train_data[0]);
+    free_matrix(train_data[1]);
+    free(train_data);
+    free_matrix(test_data[0]);
+    free_matrix(test_data[1]);
+    free(test_data);
+    free_network(network);
+    thread_pool_shutdown();
+    return 0;
+}
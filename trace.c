@@ -0,0 +1,172 @@
+#include "trace.h"
+
+#ifndef NN_NO_TRACE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define EVENTS_PER_CHUNK 4096
+
+typedef struct {
+    double start, end;
+    const char *category;
+    const char *name;
+    trace_args_t args;
+} event_t;
+
+typedef struct chunk {
+    event_t events[EVENTS_PER_CHUNK];
+    size_t count;
+    struct chunk *next;
+} chunk_t;
+
+// One per thread that has recorded anything. They stay on the list after the
+// thread exits so its events still get written out.
+typedef struct thread_trace {
+    size_t tid;
+    chunk_t *head; // Newest chunk, events are written out oldest first
+    struct thread_trace *next;
+} thread_trace_t;
+
+atomic_int trace_state = TRACE_UNKNOWN;
+
+static double trace_origin;
+static _Atomic(thread_trace_t *) threads = NULL;
+static atomic_size_t next_tid = 1;
+static _Thread_local thread_trace_t *this_thread = NULL;
+static const char *env_filename = NULL;
+
+static void write_env_trace(void) {
+    trace_write(env_filename);
+}
+
+bool trace_check_env(void) {
+    const char *env = getenv("NN_TRACE");
+    if (env == NULL || env[0] == '\0') {
+        int expected = TRACE_UNKNOWN;
+        atomic_compare_exchange_strong(&trace_state, &expected, TRACE_OFF);
+        return atomic_load(&trace_state) == TRACE_ON;
+    }
+
+    // Only the first thread here registers the writer
+    static atomic_flag registered = ATOMIC_FLAG_INIT;
+    if (!atomic_flag_test_and_set(&registered)) {
+        env_filename = env;
+        atexit(write_env_trace);
+        trace_start();
+    }
+    return true;
+}
+
+void trace_start(void) {
+    if (atomic_load(&trace_state) != TRACE_ON) {
+        trace_origin = timer_seconds();
+    }
+    atomic_store(&trace_state, TRACE_ON);
+}
+
+static thread_trace_t *register_thread(void) {
+    thread_trace_t *thread = calloc(1, sizeof(thread_trace_t));
+    if (thread == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    thread->tid = atomic_fetch_add(&next_tid, 1);
+    thread->next = atomic_load(&threads);
+    while (!atomic_compare_exchange_weak(&threads, &thread->next, thread)) {
+    }
+    this_thread = thread;
+    return thread;
+}
+
+void trace_record(double start, double end, const char *category, const char *name, trace_args_t args) {
+    thread_trace_t *thread = (this_thread != NULL) ? this_thread : register_thread();
+    chunk_t *chunk = thread->head;
+    if (chunk == NULL || chunk->count == EVENTS_PER_CHUNK) {
+        chunk = malloc(sizeof(chunk_t));
+        if (chunk == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        chunk->count = 0;
+        chunk->next = thread->head;
+        thread->head = chunk;
+    }
+    chunk->events[chunk->count++] = (event_t){start, end, category, name, args};
+}
+
+static void write_arg(FILE *file, bool *first, const char *key, size_t value) {
+    if (value != 0) {
+        fprintf(file, "%s\"%s\":%zu", *first ? "" : ",", key, value);
+        *first = false;
+    }
+}
+
+// The chunks are newest first, so recurse down to the oldest
+static void write_chunks(FILE *file, const chunk_t *chunk, size_t tid) {
+    if (chunk == NULL) {
+        return;
+    }
+    write_chunks(file, chunk->next, tid);
+    for (size_t i = 0; i < chunk->count; i++) {
+        const event_t *event = &chunk->events[i];
+        fprintf(file,
+                ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"cat\":\"%s\",\"name\":\"%s\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"args\":{",
+                tid, event->category, event->name, (event->start - trace_origin) * 1e6,
+                (event->end - event->start) * 1e6);
+        bool first = true;
+        if (strcmp(event->category, "layer") == 0) {
+            fprintf(file, "\"layer\":%zu", event->args.layer);
+            first = false;
+        }
+        write_arg(file, &first, "m", event->args.m);
+        write_arg(file, &first, "k", event->args.k);
+        write_arg(file, &first, "n", event->args.n);
+        write_arg(file, &first, "bytes", event->args.bytes);
+        fputs("}}", file);
+    }
+}
+
+bool trace_write(const char *filename) {
+    atomic_store(&trace_state, TRACE_OFF);
+
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) {
+        perror(filename);
+    } else {
+        fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+              "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"nn\"}}",
+              file);
+        for (thread_trace_t *thread = atomic_load(&threads); thread != NULL; thread = thread->next) {
+            fprintf(file,
+                    ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"name\":\"thread_name\","
+                    "\"args\":{\"name\":\"thread %zu\"}}",
+                    thread->tid, thread->tid);
+            write_chunks(file, thread->head, thread->tid);
+        }
+        fputs("\n]}\n", file);
+    }
+
+    // The thread records stay registered, only their events go
+    for (thread_trace_t *thread = atomic_load(&threads); thread != NULL; thread = thread->next) {
+        while (thread->head != NULL) {
+            chunk_t *next = thread->head->next;
+            free(thread->head);
+            thread->head = next;
+        }
+    }
+
+    if (file == NULL) {
+        return false;
+    }
+    bool ok = !ferror(file);
+    if (fclose(file) != 0 || !ok) {
+        fprintf(stderr, "Failed to write trace %s\n", filename);
+        return false;
+    }
+    return true;
+}
+
+#endif // NN_NO_TRACE
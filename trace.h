@@ -0,0 +1,97 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Per-op timing in the Chrome trace event format, for viewing in Perfetto
+// (ui.perfetto.dev) or chrome://tracing. Each op records one complete event:
+// its name, start time, duration, thread and arguments (shape and bytes
+// touched). Events nest by time on each thread, so a predict call shows its
+// layers, and each layer its GEMM and output stage.
+//
+// Two switches:
+//   compile time  building with -DNN_NO_TRACE turns every call here into an
+//                 empty inline function, which compiles away
+//   run time      off until trace_start is called or the NN_TRACE environment
+//                 variable names an output file. While off, each traced op
+//                 costs one relaxed atomic load and a branch.
+//
+// Each thread records into its own buffer, so recording takes no locks. With
+// NN_TRACE set, the trace is written when the process exits.
+
+typedef struct {
+    size_t m, k, n; // Shape, as m x k times k x n for GEMM. 0 for unused dimensions
+    size_t bytes;   // Bytes read plus bytes written
+    size_t layer;   // Only reported for the "layer" category
+} trace_args_t;
+
+#ifndef NN_NO_TRACE
+
+#include <stdatomic.h>
+
+#include "include/timer.h"
+
+enum { TRACE_UNKNOWN, TRACE_OFF, TRACE_ON };
+
+extern atomic_int trace_state;
+
+// Reads NN_TRACE the first time, returns whether tracing is on
+bool trace_check_env(void);
+
+// Starts recording. Any events recorded since the last trace_write are kept.
+void trace_start(void);
+
+// Stops recording and writes every event since trace_start to filename, then
+// discards them. Must not run while other threads are recording. Returns
+// false (with a message) if the file can't be written.
+bool trace_write(const char *filename);
+
+static inline bool trace_enabled(void) {
+    int state = atomic_load_explicit(&trace_state, memory_order_relaxed);
+    return (state == TRACE_UNKNOWN) ? trace_check_env() : state == TRACE_ON;
+}
+
+// A start time for trace_end, or 0 when tracing is off
+static inline double trace_begin(void) {
+    return trace_enabled() ? timer_seconds() : 0.0;
+}
+
+void trace_record(double start, double end, const char *category, const char *name, trace_args_t args);
+
+// Records the op that started at start. category and name must be string
+// literals, or otherwise outlive the trace.
+static inline void trace_end(double start, const char *category, const char *name, trace_args_t args) {
+    if (start != 0.0) {
+        trace_record(start, timer_seconds(), category, name, args);
+    }
+}
+
+#else
+
+static inline bool trace_enabled(void) {
+    return false;
+}
+
+static inline void trace_start(void) {
+}
+
+static inline bool trace_write(const char *filename) {
+    (void)filename;
+    return false;
+}
+
+static inline double trace_begin(void) {
+    return 0.0;
+}
+
+static inline void trace_end(double start, const char *category, const char *name, trace_args_t args) {
+    (void)start;
+    (void)category;
+    (void)name;
+    (void)args;
+}
+
+#endif // NN_NO_TRACE
+
+#endif // TRACE_H
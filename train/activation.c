@@ -1,239 +1,79 @@
 #include "activation.h"
 
 #include <assert.h>
-#include <errno.h>
-#include <math.h>
-#include <stdio.h>
-#include <stdint.h>
 
-#include "../include/threads.h"
+#include "../kernels/kernels.h"
+#include "../thread_pool.h"
+#include "../trace.h"
+#include "../tune.h"
 
-extern size_t tile_size;
+// Every activation and derivative is a span function over contiguous values,
+// a vector at a time with a masked load and store for the tail, and no
+// branches on the data. The spans themselves are in kernels/impl.h, built for
+// each instruction set. matrix_activation hands each thread a long run of the
+// matrix, so the passes are limited by memory bandwidth rather than by libm.
+// The run length is the grain passed in, a network's tiling.elementwise_grain.
 
-typedef struct {
-    matrix_t *a;
-    matrix_t *b;
-    size_t start_row;
-    size_t start_col;
-} thread_args_t;
-
-static THREAD_ENTRY matrix_activation_sigmoid(thread_func_param_t arg);
-static THREAD_ENTRY matrix_d_activation_sigmoid(thread_func_param_t  arg);
-static THREAD_ENTRY matrix_activation_softsign(thread_func_param_t  arg);
-static THREAD_ENTRY matrix_d_activation_softsign(thread_func_param_t  arg);
-static THREAD_ENTRY matrix_activation_relu(thread_func_param_t  arg);
-static THREAD_ENTRY matrix_d_activation_relu(thread_func_param_t  arg);
-static THREAD_ENTRY matrix_activation_tanh(thread_func_param_t  arg);
-static THREAD_ENTRY matrix_d_activation_tanh(thread_func_param_t  arg);
-static THREAD_ENTRY matrix_activation_leaky_relu(thread_func_param_t  arg);
-static THREAD_ENTRY matrix_d_activation_leaky_relu(thread_func_param_t  arg);
-
-static THREAD_ENTRY matrix_activation_sigmoid(thread_func_param_t  arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            b->values[i * a->n + j] =
-                1.0 / (1.0 + exp(-a->values[i * a->n + j]));
-        }
-    }
-    return (thread_func_return_t)(uintptr_t)NULL;
+activation_span_t activation_span(activation_func_t activation) {
+    return ((size_t)activation < NUM_ACTIVATIONS) ? kernels()->activation[activation] : NULL;
 }
 
-static THREAD_ENTRY matrix_d_activation_sigmoid(thread_func_param_t  arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            float value = exp(-a->values[i * a->n + j]);
-            b->values[i * a->n + j] = value / ((1.0 + value) * (1.0 + value));
-        }
-    }
-    return (thread_func_return_t)(uintptr_t)NULL;
+activation_span_t activation_derivative_span(activation_func_t activation) {
+    return ((size_t)activation < NUM_ACTIVATIONS) ? kernels()->activation_derivative[activation] : NULL;
 }
 
-static THREAD_ENTRY  matrix_activation_softsign(thread_func_param_t  arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            float val = a->values[i * a->n + j];
-            b->values[i * a->n + j] = val / (1.0 + fabs(val));
-        }
-    }
-    return (thread_func_return_t)(uintptr_t)NULL;
+size_t argmax_span(const float *src, size_t n, float *max) {
+    return kernels()->argmax(src, n, max);
 }
 
-static THREAD_ENTRY matrix_d_activation_softsign(thread_func_param_t  arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            float val = a->values[i * a->n + j];
-            b->values[i * a->n + j] = 1 / ((1 + fabs(val)) * (1 + fabs(val)));
-        }
-    }
-    return (thread_func_return_t)(uintptr_t)NULL;
+size_t softmax_span(float *dst, const float *src, size_t n) {
+    return kernels()->softmax(dst, src, n);
 }
 
-static THREAD_ENTRY matrix_activation_relu(thread_func_param_t  arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            b->values[i * a->n + j] = fmax(0.0, a->values[i * a->n + j]);
-        }
-    }
-    return (thread_func_return_t)(uintptr_t)NULL;
-}
-
-static THREAD_ENTRY matrix_d_activation_relu(thread_func_param_t  arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            b->values[i * a->n + j] = a->values[i * a->n + j] > 0;
-        }
-    }
-    return (thread_func_return_t)(uintptr_t)NULL;
-}
-
-static THREAD_ENTRY matrix_activation_tanh(thread_func_param_t  arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            b->values[i * a->n + j] = tanh(a->values[i * a->n + j]);
-        }
-    }
-    return (thread_func_return_t)(uintptr_t)NULL;
-}
-
-static THREAD_ENTRY matrix_d_activation_tanh(thread_func_param_t  arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            float val = tanh(a->values[i * a->n + j]);
-            b->values[i * a->n + j] = 1 - val * val;
-        }
-    }
-    return (thread_func_return_t)(uintptr_t)NULL;
+typedef struct {
+    activation_span_t span;
+    matrix_t dst;
+    matrix_t src;
+} span_job_t;
+
+// Contiguous matrices are one long span, split anywhere. So are padded ones,
+// padding included, which keeps the vector loops free of tails.
+static void run_span(void *context, size_t start, size_t end) {
+    span_job_t *job = (span_job_t *)context;
+    job->span(job->dst.values + start, job->src.values + start, end - start);
 }
 
-#define LEAKY_RELU_ALPHA 0.01
-
-static THREAD_ENTRY matrix_activation_leaky_relu(thread_func_param_t  arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            float val = a->values[i * a->n + j];
-            b->values[i * a->n + j] = (val > 0) ? val : LEAKY_RELU_ALPHA * val;
-        }
+// Views with gaps between their rows go a row at a time
+static void run_rows(void *context, size_t start, size_t end) {
+    span_job_t *job = (span_job_t *)context;
+    for (size_t row = start; row < end; row++) {
+        job->span(matrix_row(job->dst, row), matrix_row(job->src, row), job->src.n);
     }
-    return (thread_func_return_t)(uintptr_t)NULL;
 }
 
-static THREAD_ENTRY matrix_d_activation_leaky_relu(thread_func_param_t  arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            float val = a->values[i * a->n + j];
-            b->values[i * a->n + j] = val > 0 ? 1 : LEAKY_RELU_ALPHA;
-        }
+void matrix_activation_into(matrix_t dst, matrix_t a, activation_func_t activation, bool derivative,
+                            size_t grain) {
+    assert(dst.m == a.m && dst.n == a.n && grain > 0);
+    span_job_t job;
+    job.span = derivative ? activation_derivative_span(activation) : activation_span(activation);
+    assert(job.span != NULL);
+
+    double trace_start_time = trace_begin();
+    job.dst = dst;
+    job.src = a;
+    size_t flat = matrix_flat_size(a, dst);
+    if (flat != 0 || a.m * a.n == 0) {
+        parallel_for(flat, grain, run_span, &job);
+    } else {
+        size_t rows_per_chunk = (a.n < grain) ? grain / a.n : 1;
+        parallel_for(a.m, rows_per_chunk, run_rows, &job);
     }
-    return (thread_func_return_t)(uintptr_t)NULL;
+    trace_end(trace_start_time, "activation", derivative ? "activation_derivative" : "activation",
+              (trace_args_t){.m = a.m, .n = a.n, .bytes = 2 * a.m * a.n * sizeof(float)});
 }
 
-matrix_t matrix_activation(matrix_t a, activation_func_t activation,
-                           bool derivative) {
-    thread_func_return_t(*activation_function)(thread_func_param_t) = NULL;
-    switch (activation) {
-        case SIGMOID:
-            activation_function = derivative ? matrix_d_activation_sigmoid
-                                             : matrix_activation_sigmoid;
-            break;
-        case SOFTSIGN:
-            activation_function = derivative ? matrix_d_activation_softsign
-                                             : matrix_activation_softsign;
-            break;
-        case RELU:
-            activation_function =
-                derivative ? matrix_d_activation_relu : matrix_activation_relu;
-            break;
-        case TANH:
-            activation_function =
-                derivative ? matrix_d_activation_tanh : matrix_activation_tanh;
-            break;
-        case LEAKY_RELU:
-            activation_function = derivative ? matrix_d_activation_leaky_relu
-                                             : matrix_activation_leaky_relu;
-            break;
-    }
-
-    matrix_t b = zeroes(a.m, a.n);
-
-    size_t num_tiles_row = (a.m + tile_size - 1) / tile_size;
-    size_t num_tiles_col = (a.n + tile_size - 1) / tile_size;
-
-    size_t num_tiles_row_col = num_tiles_row * num_tiles_col;
-
-    #ifdef _WIN32
-    thread_t *threads = malloc(num_tiles_row_col *sizeof(thread_t));
-    thread_args_t *args = malloc(num_tiles_row_col * sizeof(thread_args_t));
-    #else
-    thread_t threads[num_tiles_row_col];
-    thread_args_t args[num_tiles_row_col];
-    #endif
-
-    for (size_t i = 0; i < num_tiles_row; i++) {
-        for (size_t j = 0; j < num_tiles_col; j++) {
-            args[i * num_tiles_col + j].a = &a;
-            args[i * num_tiles_col + j].b = &b;
-            args[i * num_tiles_col + j].start_row = i * tile_size;
-            args[i * num_tiles_col + j].start_col = j * tile_size;
-            THREAD_CREATE(threads[i * num_tiles_col + j], activation_function, &args[i * num_tiles_col + j]);
-        }
-    }
-
-    THREAD_JOIN_AND_CLOSE(threads, num_tiles_row_col);
-
-    #ifdef _WIN32
-    free(threads);
-    free(args);
-    #endif
-
+matrix_t matrix_activation(matrix_t a, activation_func_t activation, bool derivative) {
+    matrix_t b = matrix_alloc(a.m, a.n);
+    matrix_activation_into(b, a, activation, derivative, current_tuning().elementwise_grain);
     return b;
 }
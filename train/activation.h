@@ -7,7 +7,33 @@
 
 typedef enum { SIGMOID, SOFTSIGN, RELU, TANH, LEAKY_RELU } activation_func_t;
 
-matrix_t matrix_activation(matrix_t a, activation_func_t activation,
-                           bool derivative);
+// Applies the activation (or its derivative) to every element of a, into a
+// new matrix. The elements are split into long contiguous runs over the
+// thread pool, of the default grain in tune.h.
+matrix_t matrix_activation(matrix_t a, activation_func_t activation, bool derivative);
+
+// The same into dst, which has the shape of a and may be a itself, in runs
+// of grain values (a network's tiling.elementwise_grain)
+void matrix_activation_into(matrix_t dst, matrix_t a, activation_func_t activation, bool derivative,
+                            size_t grain);
+
+// Applies an activation function to n contiguous values. dst may equal src.
+// Vectorised and branch free, see include/simd_math.h for the accuracy of the
+// exp based ones (sigmoid and tanh).
+typedef void (*activation_span_t)(float *dst, const float *src, size_t n);
+
+activation_span_t activation_span(activation_func_t activation);
+
+// The derivative of the activation, as a function of its input
+activation_span_t activation_derivative_span(activation_func_t activation);
+
+// Index of the largest of n values, the first one if there is a tie. The
+// value itself goes into max, unless it is NULL.
+size_t argmax_span(const float *src, size_t n, float *max);
+
+// Numerically stable softmax of n values into dst, which may equal src. The
+// largest value is subtracted first, so large inputs can't overflow. Returns
+// the index of the largest value, as argmax_span.
+size_t softmax_span(float *dst, const float *src, size_t n);
 
 #endif
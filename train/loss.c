@@ -1,368 +1,123 @@
 #include "loss.h"
 
 #include <assert.h>
-#include <math.h>
-#include "../include/threads.h"
-#include <stdio.h>
 #include <stdlib.h>
-#include <stdint.h>
 
-extern size_t tile_size;
+#include "../kernels/kernels.h"
+#include "../thread_pool.h"
+#include "../trace.h"
+
+// The loss and its gradient come out of one vectorised pass over Y and
+// actual. The elements are cut into fixed LOSS_CHUNK sized chunks, each chunk
+// sums its losses into vector lanes in order, and the per chunk sums are added
+// in a fixed pairwise tree. Which thread runs which chunk never affects the
+// order of any addition, so the loss is bit-for-bit the same for any number
+// of threads (though not across instruction sets, which have different lane
+// counts). The per chunk kernels are in kernels/impl.h.
+//
+// Views with gaps between their rows, and padded matrices (the padding must
+// not be summed), are summed a row at a time: a chunk that crosses rows adds
+// up the sums of its pieces in row order. That is just as reproducible, but
+// rounds differently from the same values stored contiguously.
+
+// Elements per chunk, 16KB of each input
+#define LOSS_CHUNK 4096
 
 typedef struct {
-    matrix_t *a;
-    matrix_t *b;
-    matrix_t *c;
-    size_t start_row;
-    size_t start_col;
-} thread_args_t;
-
-static THREAD_ENTRY matrix_loss_mse(thread_func_param_t arg);
-static THREAD_ENTRY matrix_d_loss_mse(thread_func_param_t arg);
-
-static THREAD_ENTRY matrix_loss_mae(thread_func_param_t arg);
-static THREAD_ENTRY matrix_d_loss_mae(thread_func_param_t arg);
-
-static THREAD_ENTRY matrix_loss_hubler(thread_func_param_t arg);
-static THREAD_ENTRY matrix_d_loss_hubler(thread_func_param_t arg);
-
-static THREAD_ENTRY matrix_loss_log(thread_func_param_t arg);
-static THREAD_ENTRY matrix_d_loss_log(thread_func_param_t arg);
-
-static THREAD_ENTRY matrix_loss_categorical(thread_func_param_t arg);
-static THREAD_ENTRY matrix_d_loss_categorical(thread_func_param_t arg);
-static THREAD_ENTRY matrix_d_loss_categorical_softmax(thread_func_param_t arg);
-
-static THREAD_ENTRY matrix_loss_mse(thread_func_param_t arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    float *sum = calloc(1, sizeof(float));
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            float actual = a->values[i * a->n + j];
-            float predict = b->values[i * b->n + j];
-            float error = (actual - predict) * (actual - predict);
-            *sum += error;
-        }
-    }
-    return (thread_func_return_t)(uintptr_t)sum;
-}
-
-static THREAD_ENTRY matrix_d_loss_mse(thread_func_param_t arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    matrix_t *c = args->c;
-    size_t n = a->m * a->n;
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            float actual = a->values[i * a->n + j];
-            float predict = b->values[i * b->n + j];
-            c->values[i * c->n + j] = (2.0 / n) * (predict - actual);
-        }
-    }
-    return (thread_func_return_t)(uintptr_t)NULL;
-}
-
-static THREAD_ENTRY matrix_loss_mae(thread_func_param_t arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    float *sum = calloc(1, sizeof(float));
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            float actual = a->values[i * a->n + j];
-            float predict = b->values[i * b->n + j];
-            *sum += fabs(actual - predict);
-        }
-    }
-    return (thread_func_return_t)(uintptr_t)sum;
-}
-
-static THREAD_ENTRY matrix_d_loss_mae(thread_func_param_t arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    matrix_t *c = args->c;
-    size_t n = a->m * a->n;
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            float actual = a->values[i * a->n + j];
-            float predict = b->values[i * b->n + j];
-            c->values[i * c->n + j] = ((actual - predict) > 0   ? 1
-                                       : (actual - predict) < 0 ? -1
-                                                                : 0) /
-                                      (float)n;
+    matrix_t y;
+    matrix_t p;
+    matrix_t gradient;  // values is NULL when only the loss is needed
+    size_t count;
+    float scale;
+    float *chunk_sums;  // One per chunk
+    loss_chunk_t chunk;
+} loss_job_t;
+
+static void run_chunks(void *context, size_t start, size_t end) {
+    loss_job_t *job = (loss_job_t *)context;
+    size_t width = job->y.n;
+    for (size_t chunk = start; chunk < end; chunk++) {
+        size_t offset = chunk * LOSS_CHUNK;
+        size_t chunk_end = (job->count - offset < LOSS_CHUNK) ? job->count : offset + LOSS_CHUNK;
+
+        // The pieces of the chunk in each row it covers
+        float sum = 0;
+        while (offset < chunk_end) {
+            size_t row = offset / width, column = offset % width;
+            size_t n = (chunk_end - offset < width - column) ? chunk_end - offset : width - column;
+            float *gradient = (job->gradient.values != NULL) ? matrix_row(job->gradient, row) + column : NULL;
+            sum += job->chunk(matrix_row(job->y, row) + column, matrix_row(job->p, row) + column, gradient, n,
+                              job->scale);
+            offset += n;
         }
+        job->chunk_sums[chunk] = sum;
     }
-    return (thread_func_return_t)(uintptr_t)NULL;
 }
 
-#define HUBLER_THRESHOLD 0.01
-
-static THREAD_ENTRY matrix_loss_hubler(thread_func_param_t arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    float *sum = calloc(1, sizeof(float));
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            float actual = a->values[i * a->n + j];
-            float predict = b->values[i * b->n + j];
-            *sum += (fabs(actual - predict) > HUBLER_THRESHOLD)
-                        ? (actual - predict) * (actual - predict) / 2.0
-                        : HUBLER_THRESHOLD * fabs(actual - predict) -
-                              HUBLER_THRESHOLD * HUBLER_THRESHOLD / 2.0;
+// Pairwise sum in a fixed order
+static float tree_sum(float *values, size_t count) {
+    for (size_t stride = 1; stride < count; stride *= 2) {
+        for (size_t i = 0; i + stride < count; i += 2 * stride) {
+            values[i] += values[i + stride];
         }
     }
-    return (thread_func_return_t)(uintptr_t)sum;
+    return (count > 0) ? values[0] : 0.0f;
 }
 
-static THREAD_ENTRY matrix_d_loss_hubler(thread_func_param_t arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    matrix_t *c = args->c;
-    size_t n = a->m * a->n;
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            float actual = a->values[i * a->n + j];
-            float predict = b->values[i * b->n + j];
-            c->values[i * c->n + j] =
-                ((fabs(actual - predict) > HUBLER_THRESHOLD)
-                     ? -(actual - predict)
-                     : -HUBLER_THRESHOLD * ((actual - predict) > 0   ? 1
-                                            : (actual - predict) < 0 ? -1
-                                                                     : 0)) /
-                (float)n;
-        }
-    }
-    return (thread_func_return_t)(uintptr_t)NULL;
+// Treats a contiguous matrix as a single row, so chunks never get split
+static matrix_t as_rows(matrix_t matrix, bool contiguous) {
+    return contiguous ? matrix_view(matrix.values, 1, matrix.m * matrix.n, matrix.m * matrix.n) : matrix;
 }
 
-static THREAD_ENTRY matrix_loss_log(thread_func_param_t arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    float *sum = calloc(1, sizeof(float));
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            float actual = a->values[i * a->n + j];
-            float predict = b->values[i * b->n + j];
-            *sum += actual * log(predict) + (1 - actual) * log(1 - predict);
-        }
-    }
-    return (thread_func_return_t)(uintptr_t)sum;
-}
-
-static THREAD_ENTRY matrix_d_loss_log(thread_func_param_t arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    matrix_t *c = args->c;
-    size_t n = a->m * a->n;
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            float actual = a->values[i * a->n + j];
-            float predict = b->values[i * b->n + j];
-            c->values[i * c->n + j] =
-                ((predict - actual) / (predict * (1 - predict))) / (float)n;
-        }
-    }
-    return (thread_func_return_t)(uintptr_t)NULL;
-}
-
-static THREAD_ENTRY matrix_loss_categorical(thread_func_param_t arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    float *sum = calloc(1, sizeof(float));
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            float actual = a->values[i * a->n + j];
-            float predict = b->values[i * b->n + j];
-            *sum += actual * log(predict);
-        }
-    }
-    return (thread_func_return_t)(uintptr_t)sum;
+// Shared by all three entry points, gradient.values may be NULL
+static float loss_pass(matrix_t Y, matrix_t actual, loss_func_t loss, bool uses_softmax, matrix_t gradient) {
+    assert(Y.m == actual.m && Y.n == actual.n);
+    assert((size_t)loss < NUM_LOSSES);
+    if (Y.m * Y.n == 0) {
+        return 0.0f;
+    }
+
+    double trace_start_time = trace_begin();
+    loss_job_t job;
+    job.chunk = (loss == CATEGORICAL && uses_softmax) ? kernels()->loss_softmax : kernels()->loss[loss];
+    assert(job.chunk != NULL);
+
+    bool contiguous = matrix_is_contiguous(Y) && matrix_is_contiguous(actual) &&
+                      (gradient.values == NULL || matrix_is_contiguous(gradient));
+    job.y = as_rows(Y, contiguous);
+    job.p = as_rows(actual, contiguous);
+    job.gradient = as_rows(gradient, contiguous);
+    job.count = Y.m * Y.n;
+    job.scale = 1.0f / (float)job.count;
+
+    // The calling thread's scratch, so training steps don't allocate. The
+    // pool threads write their chunks' sums into it before parallel_for returns.
+    size_t num_chunks = (job.count + LOSS_CHUNK - 1) / LOSS_CHUNK;
+    job.chunk_sums = thread_scratch(SCRATCH_LOSS_SUMS, num_chunks * sizeof(float));
+
+    parallel_for(num_chunks, 1, run_chunks, &job);
+
+    float sum = tree_sum(job.chunk_sums, num_chunks);
+
+    // Y and actual are read, and the gradient written if there is one
+    size_t streams = (gradient.values != NULL) ? 3 : 2;
+    trace_end(trace_start_time, "loss", (gradient.values != NULL) ? "loss+gradient" : "loss",
+              (trace_args_t){.m = Y.m, .n = Y.n, .bytes = streams * job.count * sizeof(float)});
+    return sum * job.scale;
 }
 
-static THREAD_ENTRY matrix_d_loss_categorical(thread_func_param_t arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    matrix_t *c = args->c;
-    size_t n = a->m * a->n;
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            float actual = a->values[i * a->n + j];
-            float predict = b->values[i * b->n + j];
-            c->values[i * c->n + j] = (actual / predict) / n;
-        }
-    }
-    return (thread_func_return_t)(uintptr_t)NULL;
+float matrix_loss(matrix_t Y, matrix_t actual, loss_func_t loss) {
+    return loss_pass(Y, actual, loss, false, matrix_view(NULL, Y.m, Y.n, Y.n));
 }
 
-static THREAD_ENTRY matrix_d_loss_categorical_softmax(thread_func_param_t arg) {
-    thread_args_t *args = (thread_args_t *)arg;
-    matrix_t *a = args->a;
-    matrix_t *b = args->b;
-    matrix_t *c = args->c;
-    size_t n = a->m * a->n;
-    for (size_t i = args->start_row;
-         i < args->start_row + tile_size && i < a->m; i++) {
-        for (size_t j = args->start_col;
-             j < args->start_col + tile_size && j < a->n; j++) {
-            float actual = a->values[i * a->n + j];
-            float predict = b->values[i * b->n + j];
-            c->values[i * c->n + j] = (predict - actual) / n;
-        }
-    }
-    return (thread_func_return_t)(uintptr_t)NULL;
+matrix_t matrix_d_loss(matrix_t Y, matrix_t actual, loss_func_t loss, bool uses_softmax) {
+    matrix_t gradient = matrix_alloc(Y.m, Y.n);
+    loss_pass(Y, actual, loss, uses_softmax, gradient);
+    return gradient;
 }
 
-float matrix_loss(matrix_t Y, matrix_t actual, loss_func_t loss) {
-    thread_func_return_t (*loss_function)(thread_func_param_t) = NULL;
-    switch (loss) {
-        case MSE:
-            loss_function = matrix_loss_mse;
-            break;
-        case MAE:
-            loss_function = matrix_loss_mae;
-            break;
-        case HUBLER:
-            loss_function = matrix_loss_hubler;
-            break;
-        case LOG:
-            loss_function = matrix_loss_log;
-            break;
-        case CATEGORICAL:
-            loss_function = matrix_loss_categorical;
-            break;
-    }
-
-    assert(Y.m == actual.m && Y.n == actual.n);
-
-    size_t num_tiles_row = (Y.m + tile_size - 1) / tile_size;
-    size_t num_tiles_col = (Y.n + tile_size - 1) / tile_size;
-
-    size_t num_tiles_row_col = num_tiles_row * num_tiles_col;
-
-    #ifdef _WIN32
-    thread_t *threads = malloc(num_tiles_row_col *sizeof(thread_t));
-    thread_args_t *args = malloc(num_tiles_row_col * sizeof(thread_args_t));
-    #else
-    thread_t threads[num_tiles_row_col];
-    thread_args_t args[num_tiles_row_col];
-    #endif
-
-    for (size_t i = 0; i < num_tiles_row; i++) {
-        for (size_t j = 0; j < num_tiles_col; j++) {
-            args[i * num_tiles_col + j].a = &Y;
-            args[i * num_tiles_col + j].b = &actual;
-            args[i * num_tiles_col + j].c = NULL;
-            args[i * num_tiles_col + j].start_row = i * tile_size;
-            args[i * num_tiles_col + j].start_col = j * tile_size;
-            THREAD_CREATE(threads[i * num_tiles_col + j], loss_function, &args[i * num_tiles_col + j]);
-        }
-    }
-
-    void *result;
-    float sum = 0;
-
-    for (size_t i = 0; i < num_tiles_row_col; i++) {
-        THREAD_JOIN(threads[i], result);
-        THREAD_CLOSE(threads[i]);
-        sum += *(int *)result;
-        free(result);
-    }
-
-    #ifdef _WIN32
-    free(threads);
-    free(args);
-    #endif
-
-    return sum / (Y.m * Y.n);
+float matrix_loss_gradient(matrix_t Y, matrix_t actual, loss_func_t loss, bool uses_softmax,
+                           matrix_t gradient) {
+    assert(gradient.m == Y.m && gradient.n == Y.n);
+    return loss_pass(Y, actual, loss, uses_softmax, gradient);
 }
-
-matrix_t matrix_d_loss(matrix_t Y, matrix_t actual, loss_func_t loss,
-                       bool uses_softmax) {
-    thread_func_return_t(*loss_d_function)(thread_func_param_t) = NULL;
-    switch (loss) {
-        case MSE:
-            loss_d_function = matrix_d_loss_mae;
-            break;
-        case MAE:
-            loss_d_function = matrix_d_loss_mse;
-            break;
-        case HUBLER:
-            loss_d_function = matrix_d_loss_hubler;
-            break;
-        case LOG:
-            loss_d_function = matrix_d_loss_log;
-            break;
-        case CATEGORICAL:
-            loss_d_function = uses_softmax ? matrix_d_loss_categorical_softmax
-                                           : matrix_d_loss_categorical;
-            break;
-    }
-
-    assert(Y.m == actual.m && Y.n == actual.n);
-
-    matrix_t c = zeroes(Y.m, Y.n);
-
-    size_t num_tiles_row = (Y.m + tile_size - 1) / tile_size;
-    size_t num_tiles_col = (Y.n + tile_size - 1) / tile_size;
-
-    size_t num_tiles_row_col = num_tiles_row * num_tiles_col;
-
-    #ifdef _WIN32
-    thread_t *threads = malloc(num_tiles_row_col *sizeof(thread_t));
-    thread_args_t *args = malloc(num_tiles_row_col * sizeof(thread_args_t));
-    #else
-    thread_t threads[num_tiles_row_col];
-    thread_args_t args[num_tiles_row_col];
-    #endif
-
-
-    for (size_t i = 0; i < num_tiles_row; i++) {
-        for (size_t j = 0; j < num_tiles_col; j++) {
-            args[i * num_tiles_col + j].a = &Y;
-            args[i * num_tiles_col + j].b = &actual;
-            args[i * num_tiles_col + j].c = &c;
-            args[i * num_tiles_col + j].start_row = i * tile_size;
-            args[i * num_tiles_col + j].start_col = j * tile_size;
-            THREAD_CREATE(threads[i * num_tiles_col + j], loss_d_function, &args[i * num_tiles_col + j]);
-        }
-    }
-
-    THREAD_JOIN_AND_CLOSE(threads, num_tiles_row_col);
-
-    #ifdef _WIN32
-    free(threads);
-    free(args);
-    #endif
-
-    return c;
-}
\ No newline at end of file
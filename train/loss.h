@@ -13,9 +13,20 @@ typedef enum {
     CATEGORICAL,  // Categorical Cross Entropy
 } loss_func_t;
 
+// Mean loss over every element. Y holds the expected values, actual the
+// predictions. LOG and CATEGORICAL return the mean log likelihood, which the
+// caller negates.
 float matrix_loss(matrix_t Y, matrix_t actual, loss_func_t loss);
 
-matrix_t matrix_d_loss(matrix_t Y, matrix_t actual, loss_func_t loss,
-                       bool uses_softmax);
+// Gradient of matrix_loss with respect to actual, into a new matrix. With
+// uses_softmax, the CATEGORICAL gradient is with respect to the logits of a
+// softmax output instead, which simplifies to (actual - Y) / count.
+matrix_t matrix_d_loss(matrix_t Y, matrix_t actual, loss_func_t loss, bool uses_softmax);
+
+// Both at once, in a single pass over Y and actual. Returns matrix_loss and
+// writes matrix_d_loss into gradient, which must be Y.m x Y.n. The loss is
+// summed in a fixed order, so it is bit reproducible whatever the thread count.
+float matrix_loss_gradient(matrix_t Y, matrix_t actual, loss_func_t loss, bool uses_softmax,
+                           matrix_t gradient);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,341 @@
+#include "tune.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "include/timer.h"
+#include "kernels/kernels.h"
+#include "thread_pool.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#define DEFAULT_ELEMENTWISE_GRAIN 4096
+
+// Each candidate is timed for at least this long, best of TIMING_RUNS
+#define MIN_RUN_SECONDS 0.03
+#define TIMING_RUNS 5
+
+static size_t default_elementwise_grain = DEFAULT_ELEMENTWISE_GRAIN;
+static size_t tuned_threads = 0;
+
+tuning_t current_tuning(void) {
+    tuning_t tuning;
+    tuning.gemm = gemm_blocking;
+    tuning.elementwise_grain = default_elementwise_grain;
+    tuning.threads = tuned_threads;
+    return tuning;
+}
+
+void apply_tuning(const tuning_t *tuning) {
+    gemm_blocking = tuning->gemm;
+    default_elementwise_grain = tuning->elementwise_grain;
+    tuned_threads = tuning->threads;
+    thread_pool_set_default_size(tuning->threads);
+}
+
+static void host_name(char *name, size_t size) {
+    #ifdef _WIN32
+    DWORD length = (DWORD)size;
+    if (!GetComputerNameA(name, &length)) {
+        snprintf(name, size, "unknown");
+    }
+    #else
+    if (gethostname(name, size) != 0) {
+        snprintf(name, size, "unknown");
+    }
+    name[size - 1] = '\0';
+    #endif
+}
+
+const char *tuning_path(void) {
+    static char path[512];
+    const char *env = getenv("NN_TUNING_FILE");
+    if (env != NULL && env[0] != '\0') {
+        return env;
+    }
+
+    char host[128];
+    host_name(host, sizeof(host));
+    #ifdef _WIN32
+    const char *home = getenv("USERPROFILE");
+    #else
+    const char *home = getenv("HOME");
+    #endif
+    snprintf(path, sizeof(path), "%s/.nn_tuning_%s", (home != NULL) ? home : ".", host);
+    return path;
+}
+
+bool save_tuning(const char *filename, const tuning_t *tuning) {
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) {
+        perror(filename);
+        return false;
+    }
+    char host[128];
+    host_name(host, sizeof(host));
+    fprintf(file, "host %s\n", host);
+    fprintf(file, "kernels %s\n", kernels()->name);
+    fprintf(file, "gemm_mc %zu\n", tuning->gemm.mc);
+    fprintf(file, "gemm_kc %zu\n", tuning->gemm.kc);
+    fprintf(file, "gemm_nc %zu\n", tuning->gemm.nc);
+    fprintf(file, "elementwise_grain %zu\n", tuning->elementwise_grain);
+    fprintf(file, "threads %zu\n", tuning->threads);
+    bool ok = !ferror(file);
+    if (fclose(file) != 0 || !ok) {
+        fprintf(stderr, "Failed to write %s\n", filename);
+        return false;
+    }
+    return true;
+}
+
+bool load_tuning(const char *filename, tuning_t *tuning) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        return false;
+    }
+
+    char host[128];
+    host_name(host, sizeof(host));
+    tuning_t loaded = *tuning;
+    bool same_host = false, same_kernels = false;
+    char line[256], key[64], value[128];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "%63s %127s", key, value) != 2) {
+            continue;
+        }
+        size_t number = strtoul(value, NULL, 10);
+        if (strcmp(key, "host") == 0) {
+            same_host = strcmp(value, host) == 0;
+        } else if (strcmp(key, "kernels") == 0) {
+            same_kernels = strcmp(value, kernels()->name) == 0;
+        } else if (strcmp(key, "gemm_mc") == 0) {
+            loaded.gemm.mc = number;
+        } else if (strcmp(key, "gemm_kc") == 0) {
+            loaded.gemm.kc = number;
+        } else if (strcmp(key, "gemm_nc") == 0) {
+            loaded.gemm.nc = number;
+        } else if (strcmp(key, "elementwise_grain") == 0) {
+            loaded.elementwise_grain = number;
+        } else if (strcmp(key, "threads") == 0) {
+            loaded.threads = number;
+        }
+    }
+    fclose(file);
+
+    // Blocking tuned for another tile shape would be a poor fit, and 0 breaks the loops
+    if (!same_host || !same_kernels || loaded.gemm.mc == 0 || loaded.gemm.kc == 0 || loaded.gemm.nc == 0 ||
+        loaded.elementwise_grain == 0) {
+        return false;
+    }
+    *tuning = loaded;
+    return true;
+}
+
+// m x k times k x n, as in a forward pass at batch 1024 and the weight
+// gradient of the first layer of main.c's network
+static const size_t shapes[][3] = {{1024, 784, 256}, {1024, 256, 128}, {1024, 128, 10}, {784, 1024, 256}};
+
+#define NUM_SHAPES (sizeof(shapes) / sizeof(shapes[0]))
+
+typedef struct {
+    float *a[NUM_SHAPES];
+    float *b[NUM_SHAPES];
+    float *c[NUM_SHAPES];
+    float *values; // For the element-wise pass
+    size_t num_values;
+} tune_buffers_t;
+
+static float *filled(size_t count) {
+    float *values = malloc(count * sizeof(float));
+    if (values == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < count; i++) {
+        values[i] = (float)(i % 17) * 0.125f - 1.0f;
+    }
+    return values;
+}
+
+// Best time of a few runs of call(context), per call
+static double best_seconds(void (*call)(void *context), void *context) {
+    call(context); // Warm up the packing buffers and caches
+
+    double best = 0;
+    for (size_t run = 0; run < TIMING_RUNS; run++) {
+        size_t calls = 0;
+        double start = timer_seconds(), elapsed;
+        do {
+            call(context);
+            calls++;
+            elapsed = timer_seconds() - start;
+        } while (elapsed < MIN_RUN_SECONDS);
+        elapsed /= (double)calls;
+        best = (run == 0 || elapsed < best) ? elapsed : best;
+    }
+    return best;
+}
+
+typedef struct {
+    const tune_buffers_t *buffers;
+    size_t shape;
+    const gemm_blocking_t *blocking;
+} gemm_call_t;
+
+static void call_gemm(void *context) {
+    gemm_call_t *call = (gemm_call_t *)context;
+    size_t m = shapes[call->shape][0], k = shapes[call->shape][1], n = shapes[call->shape][2];
+    gemm_fused(m, n, k, call->buffers->a[call->shape], k, call->buffers->b[call->shape], n,
+               call->buffers->c[call->shape], n, NULL, call->blocking);
+}
+
+// Mean seconds per GFLOP over the shapes, so each shape counts the same
+// however big it is
+static double gemm_cost(const tune_buffers_t *buffers, const gemm_blocking_t *blocking) {
+    double cost = 0;
+    for (size_t s = 0; s < NUM_SHAPES; s++) {
+        gemm_call_t call = {buffers, s, blocking};
+        double flops = 2.0 * (double)(shapes[s][0] * shapes[s][1] * shapes[s][2]);
+        cost += best_seconds(call_gemm, &call) / flops * 1e9;
+    }
+    return cost / NUM_SHAPES;
+}
+
+typedef struct {
+    const tune_buffers_t *buffers;
+    size_t grain;
+} elementwise_call_t;
+
+static void sigmoid_chunk(void *context, size_t start, size_t end) {
+    float *values = ((elementwise_call_t *)context)->buffers->values;
+    kernels()->activation[SIGMOID](values + start, values + start, end - start);
+}
+
+// The same chunks as matrix_activation, in place so no page faults are timed
+static void call_elementwise(void *context) {
+    elementwise_call_t *call = (elementwise_call_t *)context;
+    parallel_for(call->buffers->num_values, call->grain, sigmoid_chunk, call);
+}
+
+// The candidate with the lowest cost, stored into *value. Candidates of 0 are skipped.
+static void pick(const char *name, size_t *value, const size_t *candidates, size_t count,
+                 double (*cost)(const tune_buffers_t *, size_t), const tune_buffers_t *buffers, bool verbose) {
+    size_t start_value = *value, best_value = *value;
+    double best_cost = cost(buffers, *value);
+    if (verbose) {
+        fprintf(stderr, "%-18s %6zu  %.4f\n", name, *value, best_cost);
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (candidates[i] == 0 || candidates[i] == start_value) {
+            continue;
+        }
+        double candidate_cost = cost(buffers, candidates[i]);
+        if (verbose) {
+            fprintf(stderr, "%-18s %6zu  %.4f\n", name, candidates[i], candidate_cost);
+        }
+        if (candidate_cost < best_cost) {
+            best_cost = candidate_cost;
+            best_value = candidates[i];
+        }
+    }
+    *value = best_value;
+}
+
+// The blocking being tuned, the field under test is swapped in by the cost functions
+static gemm_blocking_t search_blocking;
+
+static double mc_cost(const tune_buffers_t *buffers, size_t value) {
+    gemm_blocking_t blocking = search_blocking;
+    blocking.mc = value;
+    return gemm_cost(buffers, &blocking);
+}
+
+static double kc_cost(const tune_buffers_t *buffers, size_t value) {
+    gemm_blocking_t blocking = search_blocking;
+    blocking.kc = value;
+    return gemm_cost(buffers, &blocking);
+}
+
+static double nc_cost(const tune_buffers_t *buffers, size_t value) {
+    gemm_blocking_t blocking = search_blocking;
+    blocking.nc = value;
+    return gemm_cost(buffers, &blocking);
+}
+
+static double grain_cost(const tune_buffers_t *buffers, size_t value) {
+    elementwise_call_t call = {buffers, value};
+    return best_seconds(call_elementwise, &call);
+}
+
+// Restarts the pool with value threads, 0 for every core
+static double threads_cost(const tune_buffers_t *buffers, size_t value) {
+    thread_pool_shutdown();
+    thread_pool_init(value);
+    return gemm_cost(buffers, &search_blocking);
+}
+
+tuning_t autotune(bool verbose) {
+    const kernel_table_t *kernel = kernels();
+    size_t mr = kernel->gemm_mr, nr = kernel->gemm_nr;
+    tuning_t tuning = current_tuning();
+
+    tune_buffers_t buffers;
+    for (size_t s = 0; s < NUM_SHAPES; s++) {
+        buffers.a[s] = filled(shapes[s][0] * shapes[s][1]);
+        buffers.b[s] = filled(shapes[s][1] * shapes[s][2]);
+        buffers.c[s] = filled(shapes[s][0] * shapes[s][2]);
+    }
+    buffers.num_values = 1024 * 784;
+    buffers.values = filled(buffers.num_values);
+
+    // KC first, since the heuristics derive MC and NC from it
+    search_blocking = tuning.gemm;
+    size_t kc_candidates[] = {64, 128, 192, 256, 320, 384, 512, 768};
+    pick("gemm_kc", &search_blocking.kc, kc_candidates, sizeof(kc_candidates) / sizeof(size_t), kc_cost,
+         &buffers, verbose);
+
+    size_t mc_candidates[] = {2 * mr, 4 * mr, 8 * mr, 12 * mr, 16 * mr, 24 * mr, 32 * mr, 48 * mr};
+    pick("gemm_mc", &search_blocking.mc, mc_candidates, sizeof(mc_candidates) / sizeof(size_t), mc_cost,
+         &buffers, verbose);
+
+    // Only matters once n is wider than NC, the shapes above are narrower than
+    // most of these, so this mostly confirms the narrow end doesn't hurt
+    size_t nc_candidates[] = {8 * nr, 16 * nr, 32 * nr, 64 * nr, 128 * nr};
+    pick("gemm_nc", &search_blocking.nc, nc_candidates, sizeof(nc_candidates) / sizeof(size_t), nc_cost,
+         &buffers, verbose);
+    tuning.gemm = search_blocking;
+
+    size_t grain_candidates[] = {1024, 2048, 4096, 8192, 16384, 32768, 65536};
+    pick("elementwise_grain", &tuning.elementwise_grain, grain_candidates,
+         sizeof(grain_candidates) / sizeof(size_t), grain_cost, &buffers, verbose);
+
+    // Powers of two up to the core count, and the core count itself as 0
+    thread_pool_shutdown();
+    thread_pool_set_default_size(0);
+    thread_pool_init(0);
+    size_t cores = thread_pool_size();
+    size_t thread_candidates[32];
+    size_t num_thread_candidates = 0;
+    for (size_t threads = 1; threads < cores && num_thread_candidates < 31; threads *= 2) {
+        thread_candidates[num_thread_candidates++] = threads;
+    }
+    size_t threads = 0;
+    if (num_thread_candidates > 0) {
+        pick("threads", &threads, thread_candidates, num_thread_candidates, threads_cost, &buffers, verbose);
+    }
+    tuning.threads = threads;
+    thread_pool_shutdown();
+    thread_pool_init(threads);
+
+    for (size_t s = 0; s < NUM_SHAPES; s++) {
+        free(buffers.a[s]);
+        free(buffers.b[s]);
+        free(buffers.c[s]);
+    }
+    free(buffers.values);
+    return tuning;
+}
@@ -0,0 +1,51 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "gemm.h"
+
+// Blocking parameters measured on this host rather than derived from its
+// cache sizes. determine_cache starts from the cache size heuristics and then
+// loads the tuning file of this host if there is one, so a tuned host gets its
+// tuned values without repeating the search. build/autotune runs the search
+// and writes the file.
+//
+// The file is NN_TUNING_FILE if that is set, otherwise .nn_tuning_<host> in
+// the home directory. It is plain text, one "key value" pair per line, and is
+// ignored if it was tuned on another host or for other kernels (see NN_ISA).
+//
+// These are only defaults: create_network copies them into the network's
+// tiling_t, and a running network never reads them again.
+typedef struct {
+    gemm_blocking_t gemm;     // Defaults for gemm_fused and new networks
+    size_t elementwise_grain; // Values per parallel_for chunk of the element-wise passes
+    size_t threads;           // Pool size, 0 for one thread per core
+} tuning_t;
+
+// The defaults in use
+tuning_t current_tuning(void);
+
+// Makes tuning the defaults. Like determine_cache, call it before starting
+// any work, networks created earlier keep the values they were created with.
+// The thread count takes effect the next time the pool is started, see
+// thread_pool_set_default_size.
+void apply_tuning(const tuning_t *tuning);
+
+// The tuning file of this host, in a static buffer
+const char *tuning_path(void);
+
+// Returns false, leaving tuning as it was, if the file doesn't exist or
+// wasn't tuned for this host and kernel table
+bool load_tuning(const char *filename, tuning_t *tuning);
+bool save_tuning(const char *filename, const tuning_t *tuning);
+
+// Times gemm_fused on the layer shapes of main.c for candidate MC, KC and NC
+// (one at a time, keeping the best of each), then the element-wise grain and
+// the thread count, starting from the values in use. Takes tens of seconds.
+// The pool is restarted to try the thread counts, so nothing else may use it
+// meanwhile. verbose prints each candidate on stderr.
+tuning_t autotune(bool verbose);
+
+#endif